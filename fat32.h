@@ -3,8 +3,9 @@
 
 #include <stdint.h>
 
-// Bytes per sector is fixed at 512 in this homework.
-#define BPS 512
+// Supported range of bytes per sector. The value in use is read from BytesPerSector when the image is opened.
+#define MIN_BPS 512
+#define MAX_BPS 4096
 
 #pragma pack(push, 1)
 // Starting at offset 36 into the BIOS Parameter Block (BRB) for FAT32
@@ -28,7 +29,7 @@ typedef struct struct_BPB_struct {
 
     uint8_t BS_JumpBoot[3];        // Jump Instruction. Size: 3 bytes
     uint8_t BS_OEMName[8];         // The system that formatted the disk. Size: 8 bytes
-    uint16_t BytesPerSector;       // Bytes per logical sector (It is always will be 512 in our case). Size: 2 bytes
+    uint16_t BytesPerSector;       // Bytes per logical sector (512 up to 4096). Size: 2 bytes
     uint8_t SectorsPerCluster;     // Logical sectors per cluster in the order of two. Size: 1 byte
     uint16_t ReservedSectorCount;  // Count of reserved logical sectors. Size: 2 bytes
     uint8_t NumFATs;               // Number of file allocation tables. Default value is two but can be higher. Size: 1 byte
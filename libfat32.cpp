@@ -0,0 +1,5128 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+#include <ctype.h>
+#include <math.h>
+#include <fnmatch.h>
+#include <errno.h>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include "libfat32.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// AVX2 kernels are compiled with a target attribute and only run when the processor has AVX2.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2_TARGET 1
+#endif
+
+using namespace std;
+
+vector<string> MONTHS = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+FatFileEntry* ZERO_ENTRY = (FatFileEntry*) calloc(1, sizeof(FatFileEntry));
+bool USE_IO_URING = false;
+bool DIRECT_IO = false;
+
+// Requests kept in flight by the batched engine, and the largest amount of directory data read in one batch during tree build.
+const unsigned IO_QUEUE_DEPTH = 64;
+const size_t TREE_BATCH_BYTES = 8 * 1024 * 1024;
+size_t BLOCK_CACHE_BYTES = 32 * 1024 * 1024;
+bool USE_READAHEAD = true;
+bool SPARSE_IMAGE = true;
+bool USE_JOURNAL = false;
+bool USE_OVERLAY = false;
+bool RECOUNT_AT_MOUNT = false;
+bool STREAM_MODE = false;
+bool TRACK_HEAT = false;
+size_t STREAM_BUFFER_BYTES = 1024 * 1024;
+// Paths remembered by the dentry cache.
+const size_t DENTRY_CACHE_CAPACITY = 4096;
+
+thread_local Volume* VOLUME = nullptr;
+
+uint32_t toLittleEndian(uint32_t number) {
+    return (number & 0xFF000000) >> 24 + (number & 0x00FF0000) >> 16 + (number & 0x0000FF00) >> 8 + (number & 0x000000FF);
+}
+
+uint8_t getCurrentMs() {
+    timeval curTime;
+    gettimeofday(&curTime, NULL);
+    uint8_t ms = curTime.tv_usec / 1000;
+    return ms;
+}
+
+uint16_t getCurrentDate() {
+    time_t now = time(0);
+    tm local;
+    tm *tm = localtime_r(&now, &local);
+    uint16_t creationDate = ((tm->tm_year - 80) << 9) + (tm->tm_mon << 5) + tm->tm_mday;
+    return creationDate;
+}
+
+uint16_t getCurrentTime() {
+    time_t now = time(0);
+    tm local;
+    tm *tm = localtime_r(&now, &local);
+    uint16_t creationTime = (tm->tm_hour << 11) + (tm->tm_min << 5) + tm->tm_sec / 2;
+    return creationTime;
+}
+
+uint8_t lfn_checksum(char *pFCBName) {
+   int i;
+   uint8_t sum = 0;
+   for (i = 11; i; i--)
+      sum = ((sum & 1) << 7) + (sum >> 1) + *pFCBName++;
+
+   return sum;
+}
+
+/*
+ Trace output. Events are formatted into a buffer per thread and appended to the trace file
+ under a lock when the buffer grows large, when its thread ends and when the trace is closed.
+ The file is a JSON array of complete ("X") events with times in microseconds from the open.
+*/
+// Buffered events of a thread written out past this size.
+const size_t TRACE_FLUSH_BYTES = 1024 * 1024;
+
+bool TRACING = false;
+FILE* TRACE_FILE = nullptr;
+mutex TRACE_MUTEX;
+uint64_t TRACE_START = 0;
+atomic<unsigned> TRACE_THREADS(0);
+
+class TraceBuffer {
+public:
+    string events;
+    unsigned thread;
+    TraceBuffer() : thread(0) {}
+    ~TraceBuffer() {
+        flush();
+    }
+
+    void flush() {
+        lock_guard<mutex> lock(TRACE_MUTEX);
+        if (TRACE_FILE != nullptr) {
+            fwrite(events.data(), 1, events.size(), TRACE_FILE);
+        }
+        events.clear();
+    }
+};
+
+thread_local TraceBuffer TRACE_BUFFER;
+
+uint64_t traceClock() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void appendJsonString(string& out, const char* text, size_t length) {
+    out.push_back('"');
+    for (size_t i = 0; i < length; i++) {
+        char character = text[i];
+        if (character == '"' || character == '\\') {
+            out.push_back('\\');
+            out.push_back(character);
+        } else if ((uint8_t) character < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", character);
+            out += escaped;
+        } else {
+            out.push_back(character);
+        }
+    }
+    out.push_back('"');
+}
+
+void endSpan(const TraceSpan& span) {
+    uint64_t end = traceClock();
+    TraceBuffer& buffer = TRACE_BUFFER;
+    if (buffer.thread == 0) {
+        buffer.thread = ++TRACE_THREADS;
+    }
+    string& out = buffer.events;
+    out += "{\"name\":";
+    appendJsonString(out, span.name, strlen(span.name));
+    char numbers[128];
+    snprintf(numbers, sizeof(numbers), ",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+             (int) getpid(), buffer.thread, (span.start - TRACE_START) / 1000.0, (end - span.start) / 1000.0);
+    out += numbers;
+    if (span.text != nullptr || span.firstArg != nullptr) {
+        out += ",\"args\":{";
+        if (span.text != nullptr) {
+            out += "\"text\":";
+            appendJsonString(out, span.text->data(), span.text->size());
+        }
+        if (span.firstArg != nullptr) {
+            snprintf(numbers, sizeof(numbers), "%s\"%s\":%llu", span.text != nullptr ? "," : "", span.firstArg, (unsigned long long) span.first);
+            out += numbers;
+        }
+        if (span.secondArg != nullptr) {
+            snprintf(numbers, sizeof(numbers), ",\"%s\":%llu", span.secondArg, (unsigned long long) span.second);
+            out += numbers;
+        }
+        out.push_back('}');
+    }
+    out += "},\n";
+    if (out.size() >= TRACE_FLUSH_BYTES) {
+        buffer.flush();
+    }
+}
+
+bool openTrace(const string& path, string& error) {
+    TRACE_FILE = fopen(path.c_str(), "w");
+    if (TRACE_FILE == nullptr) {
+        error = path + ": " + strerror(errno);
+        return false;
+    }
+    fputs("[\n", TRACE_FILE);
+    TRACE_START = traceClock();
+    TRACING = true;
+    return true;
+}
+
+// Writes the events of the calling thread and ends the array. Other threads must have ended.
+void closeTrace() {
+    if (TRACE_FILE == nullptr) {
+        return;
+    }
+    TRACING = false;
+    TRACE_BUFFER.flush();
+    lock_guard<mutex> lock(TRACE_MUTEX);
+    // The last element names the process, so that every event can end in a comma
+    fprintf(TRACE_FILE, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"fat32-shell\"}}\n]\n", (int) getpid());
+    fclose(TRACE_FILE);
+    TRACE_FILE = nullptr;
+}
+
+/*
+ Block I/O layer. Every read and write of the image goes through readBytes/writeBytes,
+ which are served from the block cache and fall back to positional I/O on the single
+ descriptor opened by openVolume. submitBatch runs a list of independent requests, through
+ io_uring when enabled with --io-uring.
+*/
+uint64_t clusterOffset(unsigned cluster) {
+    return VOLUME->dataStart + (uint64_t) (cluster - 2) * VOLUME->clusterSize;
+}
+
+/*
+ With --direct the image is opened twice: aligned transfers use the O_DIRECT descriptor and
+ skip the page cache, while small unaligned metadata updates use the buffered one.
+*/
+int ioDescriptor(uint64_t offset, const void* buffer, size_t size) {
+    if (DIRECT_IO && offset % DIRECT_ALIGN == 0 && size % DIRECT_ALIGN == 0 && (uintptr_t) buffer % DIRECT_ALIGN == 0) {
+        return VOLUME->imgFd;
+    }
+    return VOLUME->bufferedFd;
+}
+
+bool readFully(int fd, uint64_t offset, void* buffer, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, (uint8_t*) buffer + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) { // Past the end of the image reads as zeros
+            memset((uint8_t*) buffer + done, 0, size - done);
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+bool writeFully(int fd, uint64_t offset, const void* buffer, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pwrite(fd, (const uint8_t*) buffer + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+/*
+ Copy-on-write overlay. With --overlay the image is opened read-only and every write lands at
+ the same offset in a sparse overlay file next to it. A map with one bit per cluster sized
+ granule tells which parts of the image the overlay holds: reads take those from the overlay
+ and the rest from the image, and a write covering a granule only partly copies it up first.
+ The map is stored behind the data when the volume is synced or closed, so an experiment can
+ span several runs. commit merges the overlay into the image and discard drops it.
+
+ Layout: data at image offsets | header at the image size rounded up to 4 KiB | map
+*/
+const char OVERLAY_MAGIC[8] = {'F', 'A', 'T', '3', '2', 'O', 'V', 'L'};
+
+#pragma pack(push, 1)
+struct OverlayHeader {
+    char magic[8];
+    uint64_t imageSize;
+    uint32_t granule;
+    uint32_t reserved;
+};
+#pragma pack(pop)
+
+class Overlay {
+public:
+    string path;
+    int fd;
+    uint64_t imageSize;
+    unsigned granule;
+    vector<uint64_t> map;
+
+    Overlay() {
+        fd = -1;
+        imageSize = 0;
+        granule = 0;
+    }
+
+    ~Overlay() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    bool mapped(uint64_t index) {
+        return map[index / 64] >> (index % 64) & 1;
+    }
+
+    uint64_t mapOffset() {
+        return (imageSize + 4095) / 4096 * 4096;
+    }
+
+    // Opens or creates the overlay of an image. An overlay whose map was never stored is started over.
+    bool open(const string& overlayPath, uint64_t size, unsigned granuleSize, string& error) {
+        path = overlayPath;
+        imageSize = size;
+        granule = granuleSize;
+        map.assign((imageSize / granule + 64) / 64, 0);
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            error = path + ": " + strerror(errno);
+            return false;
+        }
+        OverlayHeader header;
+        off_t fileSize = lseek(fd, 0, SEEK_END);
+        if (fileSize == 0) {
+            return true;
+        }
+        if (fileSize < (off_t) (mapOffset() + sizeof(header) + map.size() * 8)
+            || !readFully(fd, mapOffset(), &header, sizeof(header)) || memcmp(header.magic, OVERLAY_MAGIC, 8) != 0) {
+            cerr << path << ": no map stored, starting over" << endl;
+            return clear();
+        }
+        if (header.imageSize != imageSize || header.granule != granule) {
+            error = path + ": made for a different image";
+            return false;
+        }
+        return readFully(fd, mapOffset() + sizeof(header), map.data(), map.size() * 8);
+    }
+
+    // Stores the map once the data it describes is durable.
+    bool save() {
+        OverlayHeader header = {};
+        memcpy(header.magic, OVERLAY_MAGIC, 8);
+        header.imageSize = imageSize;
+        header.granule = granule;
+        return fdatasync(fd) == 0 && writeFully(fd, mapOffset(), &header, sizeof(header))
+            && writeFully(fd, mapOffset() + sizeof(header), map.data(), map.size() * 8) && fdatasync(fd) == 0;
+    }
+
+    bool clear() {
+        map.assign(map.size(), 0);
+        return ftruncate(fd, 0) == 0;
+    }
+
+    // Reads runs of granules from wherever they currently live.
+    bool read(int baseFd, uint64_t offset, void* buffer, size_t size) {
+        bool success = true;
+        size_t done = 0;
+        while (done < size) {
+            uint64_t index = (offset + done) / granule;
+            bool inOverlay = mapped(index);
+            uint64_t runEnd = (index + 1) * granule;
+            while (runEnd < offset + size && mapped(runEnd / granule) == inOverlay) {
+                runEnd += granule;
+            }
+            size_t length = min((uint64_t) size - done, runEnd - (offset + done));
+            success = readFully(inOverlay ? fd : baseFd, offset + done, (uint8_t*) buffer + done, length) && success;
+            done += length;
+        }
+        return success;
+    }
+
+    bool write(uint64_t offset, const void* buffer, size_t size) {
+        if (size == 0) {
+            return true;
+        }
+        uint64_t first = offset / granule;
+        uint64_t last = (offset + size - 1) / granule;
+        for (uint64_t index : {first, last}) {
+            bool partial = index * granule < offset || (index + 1) * granule > offset + size;
+            if (partial && !mapped(index)) {
+                vector<uint8_t> contents(granule);
+                readFully(VOLUME->bufferedFd, index * granule, contents.data(), granule);
+                if (!writeFully(fd, index * granule, contents.data(), granule)) {
+                    return false;
+                }
+                map[index / 64] |= 1ULL << (index % 64);
+            }
+        }
+        if (!writeFully(fd, offset, buffer, size)) {
+            return false;
+        }
+        for (uint64_t index = first; index <= last; index++) {
+            map[index / 64] |= 1ULL << (index % 64);
+        }
+        return true;
+    }
+};
+
+bool diskRead(uint64_t offset, void* buffer, size_t size) {
+    TraceSpan span("diskRead", "offset", offset, "size", size);
+    int fd = ioDescriptor(offset, buffer, size);
+    if (VOLUME->overlay != nullptr) {
+        return VOLUME->overlay->read(fd, offset, buffer, size);
+    }
+    return readFully(fd, offset, buffer, size);
+}
+
+bool diskWrite(uint64_t offset, const void* buffer, size_t size) {
+    TraceSpan span("diskWrite", "offset", offset, "size", size);
+    if (VOLUME->overlay != nullptr) {
+        return VOLUME->overlay->write(offset, buffer, size);
+    }
+    return writeFully(ioDescriptor(offset, buffer, size), offset, buffer, size);
+}
+
+// Makes the writes so far durable. With an overlay that includes its map.
+void syncImage() {
+    TraceSpan span("syncImage");
+    if (VOLUME->overlay != nullptr) {
+        VOLUME->overlay->save();
+    } else {
+        fdatasync(VOLUME->bufferedFd);
+    }
+}
+
+bool runRequest(IORequest& request) {
+    return request.write ? diskWrite(request.offset, request.buffer, request.size) : diskRead(request.offset, request.buffer, request.size);
+}
+
+#ifdef HAVE_IO_URING
+class IOUring {
+public:
+    int ringFd;
+    unsigned entries;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    io_uring_sqe* sqes;
+    io_uring_cqe* cqes;
+    uint8_t* sqRing;
+    uint8_t* cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    IOUring() {
+        ringFd = -1;
+        entries = 0;
+    }
+
+    ~IOUring() {
+        if (entries == 0) { // setup failed and has already closed the ring
+            return;
+        }
+        munmap(sqes, entries * sizeof(io_uring_sqe));
+        if (cqRing != sqRing) {
+            munmap(cqRing, cqRingSize);
+        }
+        munmap(sqRing, sqRingSize);
+        close(ringFd);
+    }
+
+    bool setup(unsigned depth) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ringFd = syscall(__NR_io_uring_setup, depth, &params);
+        if (ringFd < 0) {
+            return false;
+        }
+        size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMmap) {
+            sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+        }
+        sqRing = (uint8_t*) mmap(nullptr, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) {
+            close(ringFd);
+            return false;
+        }
+        cqRing = sqRing;
+        if (!singleMmap) {
+            cqRing = (uint8_t*) mmap(nullptr, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+            if (cqRing == MAP_FAILED) {
+                close(ringFd);
+                return false;
+            }
+        }
+        sqes = (io_uring_sqe*) mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            close(ringFd);
+            return false;
+        }
+        sqHead = (unsigned*) (sqRing + params.sq_off.head);
+        sqTail = (unsigned*) (sqRing + params.sq_off.tail);
+        sqMask = (unsigned*) (sqRing + params.sq_off.ring_mask);
+        sqArray = (unsigned*) (sqRing + params.sq_off.array);
+        cqHead = (unsigned*) (cqRing + params.cq_off.head);
+        cqTail = (unsigned*) (cqRing + params.cq_off.tail);
+        cqMask = (unsigned*) (cqRing + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*) (cqRing + params.cq_off.cqes);
+        sqRingSize = sqSize;
+        cqRingSize = cqSize;
+        entries = params.sq_entries;
+        return true;
+    }
+
+    // Keeps up to `entries` requests in flight until all of them complete. Short transfers are finished synchronously.
+    // On failure nothing is left running in the kernel, so the caller may reuse the buffers at once.
+    bool run(vector<IORequest>& requests) {
+        size_t next = 0;
+        size_t completed = 0;
+        unsigned inFlight = 0;
+        unsigned unsubmitted = 0; // Published in the ring but not yet taken by the kernel
+        bool success = true;
+        while (completed < requests.size()) {
+            unsigned tail = *sqTail;
+            while (next < requests.size() && inFlight < entries) {
+                unsigned index = tail & *sqMask;
+                io_uring_sqe* sqe = &sqes[index];
+                memset(sqe, 0, sizeof(io_uring_sqe));
+                sqe->opcode = requests[next].write ? IORING_OP_WRITE : IORING_OP_READ;
+                sqe->fd = ioDescriptor(requests[next].offset, requests[next].buffer, requests[next].size);
+                sqe->addr = (uint64_t) requests[next].buffer;
+                sqe->len = requests[next].size;
+                sqe->off = requests[next].offset;
+                sqe->user_data = next;
+                sqArray[index] = index;
+                tail++;
+                next++;
+                inFlight++;
+                unsubmitted++;
+            }
+            __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+            // Only wait when something has reached the kernel, the enter returns early after a partial submit anyway
+            unsigned waitFor = inFlight > unsubmitted ? 1 : 0;
+            int ret = syscall(__NR_io_uring_enter, ringFd, unsubmitted, waitFor, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (ret >= 0) {
+                unsubmitted -= min((unsigned) ret, unsubmitted);
+            } else if (errno != EINTR && !((errno == EAGAIN || errno == EBUSY) && inFlight > unsubmitted)) {
+                drain(inFlight - unsubmitted);
+                return false;
+            }
+            if (ret == 0 && waitFor == 0 && unsubmitted) { // The kernel took none and has nothing to complete
+                return false;
+            }
+            unsigned head = *cqHead;
+            while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+                io_uring_cqe* cqe = &cqes[head & *cqMask];
+                IORequest& request = requests[cqe->user_data];
+                if (cqe->res < 0) {
+                    success = runRequest(request) && success;
+                } else if ((size_t) cqe->res < request.size) {
+                    IORequest rest = {request.offset + cqe->res, (uint8_t*) request.buffer + cqe->res, request.size - cqe->res, request.write};
+                    success = runRequest(rest) && success;
+                }
+                head++;
+                inFlight--;
+                completed++;
+            }
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        }
+        return success;
+    }
+
+    // Waits until the requests the kernel has taken are complete, so their buffers are no longer written to.
+    void drain(unsigned running) {
+        while (running) {
+            syscall(__NR_io_uring_enter, ringFd, 0, running, IORING_ENTER_GETEVENTS, nullptr, 0);
+            unsigned head = *cqHead;
+            while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+                head++;
+                running--;
+            }
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        }
+    }
+};
+
+#endif
+
+// Sends every request to the image, bypassing the block cache.
+bool runBatch(vector<IORequest>& requests) {
+    if (requests.empty()) {
+        return true;
+    }
+    uint64_t bytes = 0;
+    for (size_t i = 0; TRACING && i < requests.size(); i++) {
+        bytes += requests[i].size;
+    }
+    TraceSpan span("runBatch", "requests", requests.size(), "bytes", bytes);
+#ifdef HAVE_IO_URING
+    if (VOLUME->ring != nullptr && VOLUME->overlay == nullptr && requests.size() > 1) {
+        if (VOLUME->ring->run(requests)) {
+            return true;
+        }
+        delete VOLUME->ring; // Ring is unusable, redo the batch synchronously from now on
+        VOLUME->ring = nullptr;
+    }
+#endif
+    bool success = true;
+    for (auto& request : requests) {
+        success = runRequest(request) && success;
+    }
+    return success;
+}
+
+/*
+ Block cache. Holds sector-sized pages of the image, keyed by page number, evicting the
+ least recently used page past capacity. Writes go through to the image and patch any
+ cached copy. Pages brought in by prefetch are flagged so that the readahead policy can
+ be judged by how many of them are read before eviction. Pinned pages, chosen from the
+ access heat, stay out of the LRU list and are never evicted.
+*/
+class BlockCache {
+public:
+    struct CachedPage {
+        uint8_t* data;
+        list<uint64_t>::iterator lruPosition;
+        bool prefetched;
+    };
+    unordered_map<uint64_t, CachedPage> pages;
+    list<uint64_t> lru;
+    unordered_set<uint64_t> pinned;
+    size_t capacity;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long readaheadPages;
+    unsigned long readaheadHits;
+    BlockCache() {
+        capacity = BLOCK_CACHE_BYTES / VOLUME->cachePageSize;
+        hits = 0;
+        misses = 0;
+        readaheadPages = 0;
+        readaheadHits = 0;
+    }
+
+    ~BlockCache() {
+        for (auto& page : pages) {
+            delete[] page.second.data;
+        }
+    }
+
+    bool contains(uint64_t offset, size_t size) {
+        for (uint64_t page = offset / VOLUME->cachePageSize; page * VOLUME->cachePageSize < offset + size; page++) {
+            if (pages.find(page) == pages.end()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Copies [offset, offset + size) out of the cache if every page of it is present.
+    bool read(uint64_t offset, void* buffer, size_t size) {
+        uint64_t firstPage = offset / VOLUME->cachePageSize;
+        uint64_t endPage = (offset + size + VOLUME->cachePageSize - 1) / VOLUME->cachePageSize;
+        if (size == 0) {
+            return true;
+        }
+        if (!contains(offset, size)) {
+            misses += endPage - firstPage;
+            return false;
+        }
+        for (uint64_t page = firstPage; page < endPage; page++) {
+            CachedPage& cached = pages[page];
+            uint64_t pageStart = page * VOLUME->cachePageSize;
+            uint64_t from = max(offset, pageStart);
+            uint64_t to = min(offset + size, pageStart + VOLUME->cachePageSize);
+            memcpy((uint8_t*) buffer + (from - offset), cached.data + (from - pageStart), to - from);
+            if (cached.lruPosition != lru.end()) {
+                lru.splice(lru.begin(), lru, cached.lruPosition);
+            }
+            if (cached.prefetched) {
+                readaheadHits++;
+                cached.prefetched = false;
+            }
+        }
+        hits += endPage - firstPage;
+        return true;
+    }
+
+    // Stores every page fully covered by [offset, offset + size).
+    void fill(uint64_t offset, const void* buffer, size_t size, bool prefetched) {
+        uint64_t firstPage = (offset + VOLUME->cachePageSize - 1) / VOLUME->cachePageSize;
+        uint64_t endPage = (offset + size) / VOLUME->cachePageSize;
+        for (uint64_t page = firstPage; page < endPage && capacity; page++) {
+            const uint8_t* source = (const uint8_t*) buffer + (page * VOLUME->cachePageSize - offset);
+            auto it = pages.find(page);
+            if (it != pages.end()) {
+                memcpy(it->second.data, source, VOLUME->cachePageSize);
+                continue;
+            }
+            uint8_t* data;
+            if (pages.size() >= capacity && lru.size()) {
+                auto victim = pages.find(lru.back());
+                data = victim->second.data;
+                pages.erase(victim);
+                lru.pop_back();
+            } else {
+                data = new uint8_t[VOLUME->cachePageSize];
+            }
+            memcpy(data, source, VOLUME->cachePageSize);
+            if (pinned.count(page)) {
+                pages[page] = {data, lru.end(), prefetched};
+            } else {
+                lru.push_front(page);
+                pages[page] = {data, lru.begin(), prefetched};
+            }
+            if (prefetched) {
+                readaheadPages++;
+            }
+        }
+    }
+
+    void clear() {
+        for (auto& page : pages) {
+            delete[] page.second.data;
+        }
+        pages.clear();
+        lru.clear();
+    }
+
+    void discard(uint64_t offset, size_t size) {
+        for (uint64_t page = offset / VOLUME->cachePageSize; page * VOLUME->cachePageSize < offset + size; page++) {
+            auto it = pages.find(page);
+            if (it != pages.end()) {
+                delete[] it->second.data;
+                if (it->second.lruPosition != lru.end()) {
+                    lru.erase(it->second.lruPosition);
+                }
+                pages.erase(it);
+            }
+        }
+    }
+
+    // Replaces the pinned set. Resident pages leaving it go back to the LRU list and joining ones leave it.
+    void pin(const unordered_set<uint64_t>& pagesToPin) {
+        for (auto& page : pinned) {
+            auto it = pages.find(page);
+            if (it != pages.end() && !pagesToPin.count(page)) {
+                lru.push_front(page);
+                it->second.lruPosition = lru.begin();
+            }
+        }
+        for (auto& page : pagesToPin) {
+            auto it = pages.find(page);
+            if (it != pages.end() && it->second.lruPosition != lru.end()) {
+                lru.erase(it->second.lruPosition);
+                it->second.lruPosition = lru.end();
+            }
+        }
+        pinned = pagesToPin;
+    }
+
+    // Patches cached pages overlapping a write.
+    void update(uint64_t offset, const void* buffer, size_t size) {
+        for (uint64_t page = offset / VOLUME->cachePageSize; page * VOLUME->cachePageSize < offset + size; page++) {
+            auto it = pages.find(page);
+            if (it == pages.end()) {
+                continue;
+            }
+            uint64_t pageStart = page * VOLUME->cachePageSize;
+            uint64_t from = max(offset, pageStart);
+            uint64_t to = min(offset + size, pageStart + VOLUME->cachePageSize);
+            memcpy(it->second.data + (from - pageStart), (const uint8_t*) buffer + (from - offset), to - from);
+        }
+    }
+};
+
+
+/*
+ Access heat. With --heat every read of the data region counts once for each cluster it covers,
+ and every path lookup counts for the node it lands on, keyed by the node's first cluster.
+ Each count keeps the time of its last access. Reads made while the tree is built at mount are
+ left out, so only what the session asked for shows. The counts are kept in <image>.heat
+ between runs, pick the cache pages that are pinned and the files relocated first.
+
+ Layout: header | cluster records | node records, each record a HeatRecord
+*/
+const char HEAT_MAGIC[8] = {'F', 'A', 'T', '3', '2', 'H', 'E', 'T'};
+// At most this part of the block cache is pinned, and only clusters read at least HEAT_PIN_MIN times.
+const unsigned HEAT_PIN_DIVISOR = 4;
+const uint32_t HEAT_PIN_MIN = 2;
+
+#pragma pack(push, 1)
+struct HeatHeader {
+    char magic[8];
+    uint32_t clusterSize;
+    uint32_t totalClusters;
+    uint32_t clusterRecords;
+    uint32_t nodeRecords;
+};
+
+struct HeatRecord {
+    uint32_t key;
+    uint32_t count;
+    uint32_t last;
+};
+#pragma pack(pop)
+
+class Heat {
+public:
+    uint32_t count;
+    uint32_t last;
+    Heat() : count(0), last(0) {}
+};
+
+class HeatMap {
+public:
+    string path;
+    unordered_map<unsigned, Heat> clusters;
+    unordered_map<unsigned, Heat> nodes;
+    bool dirty;
+    HeatMap() : dirty(false) {}
+
+    static void touch(Heat& heat, uint32_t now) {
+        heat.count++;
+        heat.last = now;
+    }
+
+    // Counts a read of [offset, offset + size) against the clusters it covers.
+    void record(uint64_t offset, size_t size) {
+        if (offset + size <= VOLUME->dataStart || size == 0 || VOLUME->root == nullptr) {
+            return;
+        }
+        offset = max(offset, (uint64_t) VOLUME->dataStart);
+        uint32_t now = time(nullptr);
+        uint64_t first = (offset - VOLUME->dataStart) / VOLUME->clusterSize + 2;
+        uint64_t last = (offset + size - 1 - VOLUME->dataStart) / VOLUME->clusterSize + 2;
+        for (uint64_t cluster = first; cluster <= last; cluster++) {
+            touch(clusters[cluster], now);
+        }
+        dirty = true;
+    }
+
+    void recordNode(unsigned firstCluster) {
+        touch(nodes[firstCluster], time(nullptr));
+        dirty = true;
+    }
+
+    // Reads the sidecar of an image. A missing sidecar or one made for another geometry starts empty.
+    void load(const string& heatPath) {
+        path = heatPath;
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        HeatHeader header;
+        vector<HeatRecord> records;
+        bool valid = readFully(fd, 0, &header, sizeof(header)) && memcmp(header.magic, HEAT_MAGIC, 8) == 0;
+        if (valid && (header.clusterSize != VOLUME->clusterSize || header.totalClusters != VOLUME->totalClusters)) {
+            cerr << path << ": made for a different image, starting over" << endl;
+            valid = false;
+        }
+        if (valid) {
+            records.resize((size_t) header.clusterRecords + header.nodeRecords);
+            valid = readFully(fd, sizeof(header), records.data(), records.size() * sizeof(HeatRecord));
+        }
+        close(fd);
+        for (size_t i = 0; valid && i < records.size(); i++) {
+            Heat& heat = i < header.clusterRecords ? clusters[records[i].key] : nodes[records[i].key];
+            heat.count = records[i].count;
+            heat.last = records[i].last;
+        }
+    }
+
+    // Writes the sidecar next to the old one and renames it over, so a crash leaves one or the other.
+    bool save() {
+        if (!dirty) {
+            return true;
+        }
+        HeatHeader header = {};
+        memcpy(header.magic, HEAT_MAGIC, 8);
+        header.clusterSize = VOLUME->clusterSize;
+        header.totalClusters = VOLUME->totalClusters;
+        header.clusterRecords = clusters.size();
+        header.nodeRecords = nodes.size();
+        vector<HeatRecord> records;
+        records.reserve(clusters.size() + nodes.size());
+        for (auto* table : {&clusters, &nodes}) {
+            for (auto& entry : *table) {
+                records.push_back({entry.first, entry.second.count, entry.second.last});
+            }
+        }
+        string temporary = path + ".tmp";
+        int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        bool success = writeFully(fd, 0, &header, sizeof(header))
+            && writeFully(fd, sizeof(header), records.data(), records.size() * sizeof(HeatRecord));
+        close(fd);
+        if (!success || rename(temporary.c_str(), path.c_str()) != 0) {
+            unlink(temporary.c_str());
+            return false;
+        }
+        dirty = false;
+        return true;
+    }
+};
+
+bool readBytes(uint64_t offset, void* buffer, size_t size);
+void forgetHole(uint64_t offset, size_t size);
+void punchHole(uint64_t offset, size_t size);
+
+/*
+ Write-ahead metadata journal. While it is enabled, writes are not applied to the image in place.
+ The pages they touch are kept dirty in memory and every read is patched with them. A group of
+ commands is committed by appending all dirty pages and a checksummed commit block to the
+ sidecar journal, syncing it, and only then checkpointing the pages into the image with
+ sequential writes. A journal that still holds a complete group at startup is replayed, so a
+ crash leaves either the old or the new tree but never a mix of the two.
+
+ Layout: header | count * (offset, page) | commit block
+*/
+const char JOURNAL_MAGIC[8] = {'F', 'A', 'T', '3', '2', 'J', 'N', 'L'};
+const char JOURNAL_COMMIT_MAGIC[8] = {'F', 'A', 'T', '3', '2', 'C', 'M', 'T'};
+// A group is committed after this many commands or once this much metadata is dirty, whichever comes first.
+const unsigned JOURNAL_GROUP_COMMANDS = 32;
+const size_t JOURNAL_GROUP_BYTES = 4 * 1024 * 1024;
+
+#pragma pack(push, 1)
+struct JournalHeader {
+    char magic[8];
+    uint64_t sequence;
+    uint32_t pageCount;
+    uint32_t pageSize;
+};
+
+struct JournalCommit {
+    char magic[8];
+    uint64_t sequence;
+    uint64_t checksum;
+};
+#pragma pack(pop)
+
+uint64_t fnv1a(const uint8_t* data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+class Journal {
+public:
+    bool enabled;
+    bool checkpointing;
+    string path;
+    int fd;
+    uint64_t sequence;
+    unsigned commands;
+    map<uint64_t, vector<uint8_t>> dirty; // Ordered by page so the checkpoint writes sequentially
+    vector<pair<uint64_t, size_t>> punches; // Holes to punch once the group is durable
+    unsigned long commits;
+    unsigned long pagesWritten;
+
+    Journal() {
+        enabled = false;
+        checkpointing = false;
+        fd = -1;
+        sequence = 0;
+        commands = 0;
+        commits = 0;
+        pagesWritten = 0;
+    }
+
+    // Opens the sidecar of an image and replays a complete group left in it.
+    bool open(const string& sidecarPath) {
+        path = sidecarPath;
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        off_t size = lseek(fd, 0, SEEK_END);
+        if (size > 0) {
+            vector<uint8_t> contents(size);
+            if (pread(fd, contents.data(), size, 0) == size && replay(contents)) {
+                cerr << path << ": replayed " << ((JournalHeader*) contents.data())->pageCount << " pages" << endl;
+            }
+            truncate();
+        }
+        return true;
+    }
+
+    bool replay(const vector<uint8_t>& contents) {
+        if (contents.size() < sizeof(JournalHeader) + sizeof(JournalCommit)) {
+            return false;
+        }
+        JournalHeader* header = (JournalHeader*) contents.data();
+        size_t recordSize = 8 + (size_t) header->pageSize;
+        size_t bodySize = sizeof(JournalHeader) + header->pageCount * recordSize;
+        if (memcmp(header->magic, JOURNAL_MAGIC, 8) != 0 || header->pageSize > MAX_BPS
+            || contents.size() < bodySize + sizeof(JournalCommit)) {
+            return false;
+        }
+        JournalCommit* commit = (JournalCommit*) (contents.data() + bodySize);
+        if (memcmp(commit->magic, JOURNAL_COMMIT_MAGIC, 8) != 0 || commit->sequence != header->sequence
+            || commit->checksum != fnv1a(contents.data(), bodySize)) {
+            return false; // The crash happened before the group was durable, the image still holds the old tree
+        }
+        sequence = header->sequence + 1;
+        for (uint32_t i = 0; i < header->pageCount; i++) {
+            const uint8_t* record = contents.data() + sizeof(JournalHeader) + i * recordSize;
+            uint64_t offset;
+            memcpy(&offset, record, 8);
+            diskWrite(offset, record + 8, header->pageSize);
+        }
+        syncImage();
+        return true;
+    }
+
+    void truncate() {
+        ftruncate(fd, 0);
+        fdatasync(fd);
+    }
+
+    bool isDirty(uint64_t offset, size_t size) {
+        auto it = dirty.lower_bound(offset / VOLUME->cachePageSize);
+        return it != dirty.end() && it->first * VOLUME->cachePageSize < offset + size;
+    }
+
+    // Patches a buffer read from the cache or the image with the dirty pages it overlaps.
+    void overlay(uint64_t offset, void* buffer, size_t size) {
+        if (dirty.empty()) {
+            return;
+        }
+        for (auto it = dirty.lower_bound(offset / VOLUME->cachePageSize); it != dirty.end() && it->first * VOLUME->cachePageSize < offset + size; it++) {
+            uint64_t pageStart = it->first * VOLUME->cachePageSize;
+            uint64_t from = max(offset, pageStart);
+            uint64_t to = min(offset + size, pageStart + VOLUME->cachePageSize);
+            memcpy((uint8_t*) buffer + (from - offset), it->second.data() + (from - pageStart), to - from);
+        }
+    }
+
+    void record(uint64_t offset, const void* buffer, size_t size) {
+        for (uint64_t page = offset / VOLUME->cachePageSize; page * VOLUME->cachePageSize < offset + size; page++) {
+            uint64_t pageStart = page * VOLUME->cachePageSize;
+            auto it = dirty.find(page);
+            if (it == dirty.end()) {
+                vector<uint8_t> contents(VOLUME->cachePageSize);
+                readBytes(pageStart, contents.data(), VOLUME->cachePageSize);
+                it = dirty.emplace(page, move(contents)).first;
+            }
+            uint64_t from = max(offset, pageStart);
+            uint64_t to = min(offset + size, pageStart + VOLUME->cachePageSize);
+            memcpy(it->second.data() + (from - pageStart), (const uint8_t*) buffer + (from - offset), to - from);
+        }
+    }
+
+    // Called after every command. Commands are the unit of atomicity, groups the unit of commit.
+    void endCommand() {
+        commands++;
+        if (commands >= JOURNAL_GROUP_COMMANDS || dirty.size() * VOLUME->cachePageSize >= JOURNAL_GROUP_BYTES) {
+            commit();
+        }
+    }
+
+    bool commit() {
+        commands = 0;
+        TraceSpan span("journalCommit", "pages", dirty.size());
+        if (dirty.empty() && punches.empty()) {
+            return true;
+        }
+        size_t recordSize = 8 + VOLUME->cachePageSize;
+        vector<uint8_t> group(sizeof(JournalHeader) + dirty.size() * recordSize + sizeof(JournalCommit));
+        JournalHeader* header = (JournalHeader*) group.data();
+        memcpy(header->magic, JOURNAL_MAGIC, 8);
+        header->sequence = sequence;
+        header->pageCount = dirty.size();
+        header->pageSize = VOLUME->cachePageSize;
+        uint8_t* cursor = group.data() + sizeof(JournalHeader);
+        for (auto& page : dirty) {
+            uint64_t offset = page.first * VOLUME->cachePageSize;
+            memcpy(cursor, &offset, 8);
+            memcpy(cursor + 8, page.second.data(), VOLUME->cachePageSize);
+            cursor += recordSize;
+        }
+        JournalCommit* commitBlock = (JournalCommit*) cursor;
+        memcpy(commitBlock->magic, JOURNAL_COMMIT_MAGIC, 8);
+        commitBlock->sequence = sequence;
+        commitBlock->checksum = fnv1a(group.data(), cursor - group.data());
+        // File data is written in place, and it must be durable before the metadata pointing at it
+        syncImage();
+        if (pwrite(fd, group.data(), group.size(), 0) != (ssize_t) group.size() || fdatasync(fd) != 0) {
+            perror("journal");
+            return false;
+        }
+        checkpoint();
+        truncate();
+        sequence++;
+        commits++;
+        return true;
+    }
+
+    // Applies a durable group to the image. Holes go first so that reused clusters get their new contents back.
+    void checkpoint() {
+        checkpointing = true;
+        for (auto& range : punches) {
+            punchHole(range.first, range.second);
+        }
+        punches.clear();
+        vector<uint8_t> run;
+        uint64_t runStart = 0;
+        for (auto it = dirty.begin(); it != dirty.end(); it++) {
+            if (run.empty()) {
+                runStart = it->first;
+            }
+            run.insert(run.end(), it->second.begin(), it->second.end());
+            auto next = std::next(it);
+            if (next == dirty.end() || next->first != it->first + 1) {
+                // Pages evicted while dirty may have been refilled from the image, so the cache is refreshed too
+                VOLUME->blockCache->update(runStart * VOLUME->cachePageSize, run.data(), run.size());
+                forgetHole(runStart * VOLUME->cachePageSize, run.size());
+                diskWrite(runStart * VOLUME->cachePageSize, run.data(), run.size());
+                run.clear();
+            }
+        }
+        pagesWritten += dirty.size();
+        dirty.clear();
+        syncImage();
+        checkpointing = false;
+    }
+};
+
+/*
+ Sparse images. Ranges inside a hole of the image file read as zeros, so callers that only
+ need to know whether a cluster is empty ask isHole instead of reading it. The last hole
+ found is remembered so that scanning consecutive clusters costs one lseek per hole.
+*/
+bool isHole(uint64_t offset, size_t size) {
+    if (!VOLUME->sparse || VOLUME->journal->isDirty(offset, size)) {
+        return false;
+    }
+    if (offset >= VOLUME->holeStart && offset + size <= VOLUME->holeEnd) {
+        return true;
+    }
+    off_t data = lseek(VOLUME->imgFd, offset, SEEK_DATA);
+    if (data < 0) {
+        if (errno != ENXIO) { // SEEK_DATA is not supported here
+            VOLUME->sparse = false;
+            return false;
+        }
+        VOLUME->holeStart = offset;
+        VOLUME->holeEnd = UINT64_MAX; // No data until the end of the image
+        return true;
+    }
+    if ((uint64_t) data <= offset) {
+        return false;
+    }
+    VOLUME->holeStart = offset;
+    VOLUME->holeEnd = data;
+    return offset + size <= (uint64_t) data;
+}
+
+void forgetHole(uint64_t offset, size_t size) {
+    if (offset < VOLUME->holeEnd && offset + size > VOLUME->holeStart) {
+        VOLUME->holeEnd = VOLUME->holeStart;
+    }
+}
+
+// Deallocates a range of the image, writing zeros where the file system cannot punch holes.
+void punchHole(uint64_t offset, size_t size) {
+    if (VOLUME->journal->enabled && !VOLUME->journal->checkpointing) {
+        VOLUME->journal->punches.push_back({offset, size});
+        return;
+    }
+    if (VOLUME->overlay != nullptr) { // The image is read-only and holes are not used, freed clusters keep their data
+        return;
+    }
+    VOLUME->blockCache->discard(offset, size);
+    if (fallocate(VOLUME->imgFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == 0) {
+        return;
+    }
+    vector<uint8_t> zeros(min(size, (size_t) 1024 * 1024));
+    for (size_t done = 0; done < size; done += zeros.size()) {
+        diskWrite(offset + done, zeros.data(), min(zeros.size(), size - done));
+    }
+    forgetHole(offset, size);
+}
+
+bool readCached(uint64_t offset, void* buffer, size_t size) {
+    if (VOLUME->blockCache->read(offset, buffer, size)) {
+        return true;
+    }
+    // Small reads pull in their whole pages so that neighbouring entries are served from the cache
+    uint64_t start = offset / VOLUME->cachePageSize * VOLUME->cachePageSize;
+    uint64_t end = (offset + size + VOLUME->cachePageSize - 1) / VOLUME->cachePageSize * VOLUME->cachePageSize;
+    if (end - start > size && end - start <= 4 * VOLUME->cachePageSize) {
+        uint8_t span[4 * MAX_BPS];
+        bool success = diskRead(start, span, end - start);
+        VOLUME->blockCache->fill(start, span, end - start, false);
+        memcpy(buffer, span + (offset - start), size);
+        return success;
+    }
+    bool success = diskRead(offset, buffer, size);
+    VOLUME->blockCache->fill(offset, buffer, size, false);
+    return success;
+}
+
+bool readBytes(uint64_t offset, void* buffer, size_t size) {
+    if (VOLUME->heat != nullptr) {
+        VOLUME->heat->record(offset, size);
+    }
+    bool success = readCached(offset, buffer, size);
+    VOLUME->journal->overlay(offset, buffer, size);
+    return success;
+}
+
+bool writeBytes(uint64_t offset, const void* buffer, size_t size) {
+    VOLUME->blockCache->update(offset, buffer, size);
+    if (VOLUME->journal->enabled) {
+        VOLUME->journal->record(offset, buffer, size);
+        return true;
+    }
+    forgetHole(offset, size);
+    return diskWrite(offset, buffer, size);
+}
+
+// Runs a batch, serving fully cached reads from the cache and caching what comes back from the image.
+bool submitBatch(vector<IORequest>& requests) {
+    vector<IORequest> pending;
+    for (auto& request : requests) {
+        if (request.write && VOLUME->journal->enabled) {
+            VOLUME->blockCache->update(request.offset, request.buffer, request.size);
+            VOLUME->journal->record(request.offset, request.buffer, request.size);
+        } else if (request.write) {
+            VOLUME->blockCache->update(request.offset, request.buffer, request.size);
+            forgetHole(request.offset, request.size);
+            pending.push_back(request);
+        } else {
+            if (VOLUME->heat != nullptr) {
+                VOLUME->heat->record(request.offset, request.size);
+            }
+            if (!VOLUME->blockCache->read(request.offset, request.buffer, request.size)) {
+                pending.push_back(request);
+            }
+        }
+    }
+    bool success = runBatch(pending);
+    for (auto& request : pending) {
+        if (!request.write) {
+            VOLUME->blockCache->fill(request.offset, request.buffer, request.size, false);
+        }
+    }
+    for (auto& request : requests) {
+        if (!request.write) {
+            VOLUME->journal->overlay(request.offset, request.buffer, request.size);
+        }
+    }
+    return success;
+}
+
+// Runs a batch of reads straight from the image, for file data that would otherwise push the FAT and directory pages out of the cache.
+bool readUncached(vector<IORequest>& requests) {
+    if (VOLUME->heat != nullptr) {
+        for (auto& request : requests) {
+            VOLUME->heat->record(request.offset, request.size);
+        }
+    }
+    bool success = runBatch(requests);
+    for (auto& request : requests) {
+        VOLUME->journal->overlay(request.offset, request.buffer, request.size);
+    }
+    return success;
+}
+
+// Reads page-aligned ranges that are not cached yet into the cache in one batch.
+void prefetch(vector<pair<uint64_t, size_t>>& ranges) {
+    if (!USE_READAHEAD || ranges.size() == 0) {
+        return;
+    }
+    sort(ranges.begin(), ranges.end());
+    vector<pair<uint64_t, size_t>> missing;
+    size_t bytes = 0;
+    for (auto& range : ranges) {
+        if (VOLUME->blockCache->contains(range.first, range.second)) {
+            continue;
+        }
+        if (missing.size() && missing.back().first + missing.back().second >= range.first) {
+            uint64_t end = max(missing.back().first + missing.back().second, range.first + range.second);
+            bytes += end - (missing.back().first + missing.back().second);
+            missing.back().second = end - missing.back().first;
+        } else {
+            missing.push_back(range);
+            bytes += range.second;
+        }
+    }
+    PooledBuffer data(bytes);
+    vector<IORequest> requests;
+    size_t position = 0;
+    for (auto& range : missing) {
+        requests.push_back({range.first, data.data + position, range.second, false});
+        position += range.second;
+    }
+    runBatch(requests);
+    for (auto& request : requests) {
+        VOLUME->blockCache->fill(request.offset, request.buffer, request.size, true);
+    }
+}
+
+// Appends read requests for chain[first, first + count) into buffer, merging physically consecutive clusters.
+void appendChainRequests(const vector<unsigned>& chain, size_t first, size_t count, uint8_t* buffer, vector<IORequest>& requests) {
+    const size_t maxRequestBytes = 1024 * 1024;
+    for (size_t i = first; i < first + count; i++) {
+        uint8_t* target = buffer + (i - first) * VOLUME->clusterSize;
+        if (requests.size() && i > first && chain[i] == chain[i - 1] + 1 &&
+            (uint8_t*) requests.back().buffer + requests.back().size == target && requests.back().size + VOLUME->clusterSize <= maxRequestBytes) {
+            requests.back().size += VOLUME->clusterSize;
+        } else {
+            requests.push_back({clusterOffset(chain[i]), target, VOLUME->clusterSize, false});
+        }
+    }
+}
+
+vector<string> extractDirectories(string path) {
+    vector<string> directories;
+    string dirBuffer;
+    if (path[0] == '/') {
+        directories.push_back("/");
+        path = path.substr(1);
+    }
+    for (auto& dir : path) {
+        if (dir == '/') {
+            directories.push_back(dirBuffer);
+            dirBuffer.erase();
+        } else {
+            dirBuffer.push_back(dir);
+        }
+    }
+    if (dirBuffer.size() > 0) {
+        directories.push_back(dirBuffer);
+    }
+    return directories;
+}
+
+/*
+ Name index for find. Every node is listed once, and every distinct three character
+ sequence of a name points at the nodes containing it, so a substring query only checks
+ the nodes sharing its rarest trigram. Nodes are indexed as the tree is built and as
+ createChild adds them; mv keeps the node and its name, so it needs no update.
+*/
+class NameIndex {
+public:
+    unordered_map<uint32_t, vector<FileNode*>> trigrams;
+    vector<FileNode*> nodes;
+
+    static uint32_t trigramAt(const string& text, size_t i) {
+        return ((uint8_t) text[i] << 16) | ((uint8_t) text[i + 1] << 8) | (uint8_t) text[i + 2];
+    }
+
+    void add(FileNode* node) {
+        nodes.push_back(node);
+        vector<uint32_t> seen;
+        for (size_t i = 0; i + 3 <= node->name.size(); i++) {
+            uint32_t trigram = trigramAt(node->name, i);
+            if (find(seen.begin(), seen.end(), trigram) != seen.end()) {
+                continue;
+            }
+            seen.push_back(trigram);
+            trigrams[trigram].push_back(node);
+        }
+    }
+
+    // Nodes whose name contains text.
+    vector<FileNode*> search(const string& text) {
+        vector<FileNode*>* candidates = &nodes;
+        for (size_t i = 0; i + 3 <= text.size(); i++) {
+            auto it = trigrams.find(trigramAt(text, i));
+            if (it == trigrams.end()) {
+                return vector<FileNode*>();
+            }
+            if (it->second.size() < candidates->size()) {
+                candidates = &it->second;
+            }
+        }
+        vector<FileNode*> matches;
+        for (auto& node : *candidates) {
+            if (node->name.find(text) != string::npos) {
+                matches.push_back(node);
+            }
+        }
+        return matches;
+    }
+};
+
+// Applies a change in usage to directory and all of its ancestors.
+void addUsage(FileNode* directory, long long bytes, long long clusters, long long entries) {
+    for (; directory != nullptr; directory = directory->parentRef) {
+        directory->totalBytes += bytes;
+        directory->totalClusters += clusters;
+        directory->totalEntries += entries;
+    }
+}
+
+// Fills the usage totals of a freshly built tree bottom up.
+void computeUsage(FileNode* node) {
+    node->totalBytes = node->type == _FILE ? node->fileSize : 0;
+    node->totalClusters = node->clusterChain != nullptr ? node->clusterChain->size() : 0;
+    node->totalEntries = 1;
+    for (auto& child : node->children) {
+        if (child->type == _DOT) {
+            continue;
+        }
+        computeUsage(child);
+        node->totalBytes += child->totalBytes;
+        node->totalClusters += child->totalClusters;
+        node->totalEntries += child->totalEntries;
+    }
+}
+
+bool isChild(FileNode* first, FileNode* second) {
+    for (auto& child : second->children) {
+        if (child->type != _DOT && (child == first || isChild(first, child))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ Geometry kernels. The directory scans and the FAT walk run their inner loops over the entries of
+ one cluster or the links of one FAT sector. They are instantiated for every power of two cluster
+ size from 512 B to 64 KiB and every supported sector size, so those counts are constants the
+ compiler can unroll over. openVolume picks the instantiations matching the boot sector once;
+ the 0 instantiation reads the geometry from the volume and covers anything else.
+*/
+void classifyEntries(const FatFileEntry* entries, unsigned& lfnMask, unsigned& namedMask, unsigned& deletedMask);
+
+class GeometryKernels {
+public:
+    // Fills three masks per 16 entries of a cluster: LFN, 8.3 file/folder and deleted, as classifyEntries does.
+    void (*classifyCluster)(const FatFileEntry* entries, unsigned* masks);
+    // Continues a run of free entries over a cluster. Returns the index of the entry that makes the
+    // run needed entries long, or the number of entries in a cluster when the run is still shorter.
+    unsigned (*findFreeRun)(const FatFileEntry* entries, unsigned needed, unsigned& run);
+    // The index of the folder entry following the LFN entries with checksum, -1 when not in this cluster.
+    int (*findEntryAfterLfn)(const FatFileEntry* entries, uint8_t checksum, bool& foundLfn);
+    // Appends the clusters after first to chain, reading the FAT one sector at a time.
+    void (*followChain)(unsigned first, vector<unsigned>& chain);
+};
+
+template<unsigned CLUSTER_BYTES>
+unsigned entriesPerCluster() {
+    return (CLUSTER_BYTES ? CLUSTER_BYTES : VOLUME->clusterSize) / sizeof(FatFileEntry);
+}
+
+template<unsigned CLUSTER_BYTES>
+void classifyCluster(const FatFileEntry* entries, unsigned* masks) {
+    const unsigned count = entriesPerCluster<CLUSTER_BYTES>();
+    for (unsigned group = 0; group < count; group += 16) {
+        classifyEntries(entries + group, masks[0], masks[1], masks[2]);
+        masks += 3;
+    }
+}
+
+// One bit per entry of 16 whose attributes are zero.
+inline unsigned freeEntries(const FatFileEntry* entries) {
+    unsigned mask = 0;
+    for (int k = 0; k < 16; k++) {
+        mask |= (entries[k].msdos.attributes == 0) << k;
+    }
+    return mask;
+}
+
+template<unsigned CLUSTER_BYTES>
+unsigned findFreeRun(const FatFileEntry* entries, unsigned needed, unsigned& run) {
+    const unsigned count = entriesPerCluster<CLUSTER_BYTES>();
+    for (unsigned group = 0; group < count; group += 16) {
+        unsigned mask = freeEntries(entries + group);
+        if (mask == 0xFFFF && run + 16 < needed) {
+            run += 16;
+            continue;
+        }
+        if (mask == 0) {
+            run = 0;
+            continue;
+        }
+        for (unsigned k = 0; k < 16; k++) {
+            run = mask & (1 << k) ? run + 1 : 0;
+            if (run == needed) {
+                return group + k;
+            }
+        }
+    }
+    return count;
+}
+
+template<unsigned CLUSTER_BYTES>
+int findEntryAfterLfn(const FatFileEntry* entries, uint8_t checksum, bool& foundLfn) {
+    const unsigned count = entriesPerCluster<CLUSTER_BYTES>();
+    for (unsigned i = 0; i < count; i++) {
+        if (entries[i].msdos.attributes == 0xF && entries[i].lfn.checksum == checksum) {
+            foundLfn = true;
+        } else if (foundLfn && entries[i].msdos.attributes == 0x10) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+template<unsigned SECTOR_BYTES>
+void followChain(unsigned first, vector<unsigned>& chain) {
+    const unsigned sectorSize = SECTOR_BYTES ? SECTOR_BYTES : VOLUME->sectorSize;
+    const unsigned fatBlockEntries = sectorSize / 4;
+    uint8_t fatBlock[MAX_BPS];
+    unsigned loadedBlock = -1;
+    unsigned currentCluster = first;
+    while (1) {
+        unsigned block = currentCluster / fatBlockEntries;
+        if (block != loadedBlock) {
+            readBytes(VOLUME->fatStart + (uint64_t) block * sectorSize, fatBlock, sectorSize);
+            loadedBlock = block;
+        }
+        uint8_t* fatEntry = fatBlock + (currentCluster % fatBlockEntries) * 4;
+        unsigned entryValue = fatEntry[0] + (fatEntry[1] << 8) + (fatEntry[2] << 16) + (fatEntry[3] << 24);
+        if (entryValue == VOLUME->eocValue) {
+            break;
+        }
+        chain.push_back(entryValue);
+        currentCluster = entryValue;
+    }
+}
+
+template<unsigned CLUSTER_BYTES>
+void setClusterKernels(GeometryKernels* kernels) {
+    kernels->classifyCluster = classifyCluster<CLUSTER_BYTES>;
+    kernels->findFreeRun = findFreeRun<CLUSTER_BYTES>;
+    kernels->findEntryAfterLfn = findEntryAfterLfn<CLUSTER_BYTES>;
+}
+
+GeometryKernels* selectKernels(unsigned clusterSize, unsigned sectorSize) {
+    GeometryKernels* kernels = new GeometryKernels;
+    switch (clusterSize) {
+        case 512: setClusterKernels<512>(kernels); break;
+        case 1024: setClusterKernels<1024>(kernels); break;
+        case 2048: setClusterKernels<2048>(kernels); break;
+        case 4096: setClusterKernels<4096>(kernels); break;
+        case 8192: setClusterKernels<8192>(kernels); break;
+        case 16384: setClusterKernels<16384>(kernels); break;
+        case 32768: setClusterKernels<32768>(kernels); break;
+        case 65536: setClusterKernels<65536>(kernels); break;
+        default: setClusterKernels<0>(kernels); break;
+    }
+    switch (sectorSize) {
+        case 512: kernels->followChain = followChain<512>; break;
+        case 1024: kernels->followChain = followChain<1024>; break;
+        case 2048: kernels->followChain = followChain<2048>; break;
+        case 4096: kernels->followChain = followChain<4096>; break;
+        default: kernels->followChain = followChain<0>; break;
+    }
+    return kernels;
+}
+
+void updateFAT(FileNode* parentDirectory, deque<unsigned> newClusterIndices) {
+    TraceSpan span("updateFAT", "clusters", newClusterIndices.size());
+    unsigned currentFATStart = VOLUME->fatStart;
+    int i = 0;
+    vector<unsigned> parentChain = (*parentDirectory->clusterChain);
+    while (i < VOLUME->numFats) {
+        unsigned firstIndex = parentChain[parentChain.size() - 1];
+        for (auto& index : newClusterIndices) {
+            uint8_t bytes[4];
+            bytes[0] = index & 0xFF;
+            bytes[1] = (index & 0xFF00) >> 8;
+            bytes[2] = (index & 0xFF0000) >> 16;
+            bytes[3] = (index & 0xFF000000) >> 24;
+            writeBytes(currentFATStart + (uint64_t) firstIndex * 4, bytes, 4);
+            firstIndex = index;
+        }
+        writeBytes(currentFATStart + (uint64_t) firstIndex * 4, &VOLUME->eocValue, 4);
+        currentFATStart += VOLUME->fatSize;
+        i++;
+    }
+}
+
+void updateTimes(FileNode* parentDirectory, uint16_t date, uint16_t time) {
+    TraceSpan span("updateTimes");
+    parentDirectory->setModifiedDate(date);
+    parentDirectory->setModifiedTime(time);
+    bool foundLfn = false;
+    FileNode* grandFather = parentDirectory->parentRef;
+    FatFileEntry* entries = new FatFileEntry[VOLUME->clusterSize / sizeof(FatFileEntry)];
+    for (auto& cluster : *(grandFather->clusterChain)) {
+        uint64_t offset = clusterOffset(cluster);
+        readBytes(offset, entries, VOLUME->clusterSize);
+        int i = VOLUME->kernels->findEntryAfterLfn(entries, parentDirectory->checksum, foundLfn);
+        if (i >= 0) {
+            entries[i].msdos.modifiedDate = date;
+            entries[i].msdos.modifiedTime = time;
+            writeBytes(offset + i * sizeof(FatFileEntry), &entries[i], sizeof(FatFileEntry));
+            break;
+        }
+    }
+    delete[] entries;
+}
+/*
+bool updateParent(FileNode* file, int emptyClusterIndex) {
+    FILE* fp = fopen(imgFile, "r+");
+    unsigned numEntries = ceil(file->name.size() / 13.0) + 1;
+    if (emptyClusterIndex == 0) {
+        for (auto& parentCluster : *(file->parentRef->clusterChain)) {
+            for (int i = 0; i < CLUSTER_SIZE / sizeof(FatFileEntry); i++) {
+                FatFileEntry* buffer;
+                unsigned offset = DATA_START + (parentCluster - 2) * CLUSTER_SIZE + i * sizeof(FatFileEntry);
+                fseek(fp, offset, SEEK_SET);
+                fread(buffer, sizeof(FatFileEntry), 1, fp);
+                if (buffer->lfn.checksum == file->checksum) {
+                    numEntries--;
+                } else if (numEntries == 0 && emptyClusterIndex == 0) {
+                    // NECESSARY? buffer->msdos.lastAccessTime
+                    unsigned newStart = file->parentRef->clusterChain->at(1);
+                    buffer->msdos.eaIndex = (newStart & 0xFFFF0000) >> 16;
+                    buffer->msdos.firstCluster = (newStart & 0x0000FFFF);
+                    fseek(fp, offset, SEEK_SET);
+                    fwrite(buffer, sizeof(FatFileEntry), 1, fp);
+                }
+            }
+        }
+    }
+    if (emptyClusterIndex == -1) {
+        return true;
+    }
+    uint32_t zeroEntry = 0;
+    for (int i = 0; i < NUM_FATS; i++) {
+        fseek(fp, FAT_START + i * FAT_SIZE + file->clusterChain->at(emptyClusterIndex) * 4, SEEK_SET);
+        fwrite(&zeroEntry, 4, 1, fp);
+    }
+    if (emptyClusterIndex == 0) {
+        return true;
+    }
+    size_t parentCCSize = file->parentRef->clusterChain->size();
+    if (parentCCSize == 2) {
+        file->parentRef->clusterChain->erase(file->parentRef->clusterChain->begin() + emptyClusterIndex);
+        return true;
+    }
+    deque<unsigned> after;
+    for (int i = emptyClusterIndex + 1; i < parentCCSize; i++) {
+        after.push_back(file->parentRef->clusterChain->at(i));
+    }
+    for (int i = emptyClusterIndex; i < parentCCSize; i++) {
+        file->parentRef->clusterChain->erase(file->parentRef->clusterChain->begin() + i);
+    }
+    fclose(fp);
+    updateFAT(file->parentRef, after);
+    return true;
+}
+*/
+
+/*
+ Cluster allocation. The policy decides where new clusters go:
+  _LOWEST_FREE hands out the lowest numbered free clusters, as the shell always did.
+  _NEAR_GOAL starts looking at a goal cluster given by the caller and prefers one run that
+  holds the whole request. Directories grow right after the last cluster of their chain,
+  new subdirectories start after their parent's chain, and large files go to the upper
+  half of the volume so they do not interleave with directories and small files.
+*/
+allocationPolicy ALLOCATION_POLICY = _NEAR_GOAL;
+// Files of at least this size are placed in the large file region by the near goal policy.
+const uint64_t LARGE_FILE_BYTES = 4 * 1024 * 1024;
+// FAT read at a time while looking for free clusters.
+const size_t FAT_SCAN_BYTES = 1024 * 1024;
+
+unsigned largeFileGoal() {
+    return 2 + VOLUME->totalClusters / 2;
+}
+
+// The cluster after the end of a chain, 0 for an empty chain.
+unsigned chainGoal(const vector<unsigned>* chain) {
+    return chain != nullptr && chain->size() ? chain->back() + 1 : 0;
+}
+
+/*
+ Finds count free clusters, scanning the FAT forward from goal and wrapping around to cluster 2.
+ Clusters in reserved (sorted) are handed out already but not linked in the FAT yet. With the
+ near goal policy the first run long enough for the whole request wins. Otherwise, or when there
+ is no such run, the free clusters are taken in scan order. Returns fewer clusters when the
+ volume is full.
+*/
+vector<unsigned> allocateClusters(unsigned count, unsigned goal, const vector<unsigned>& reserved = vector<unsigned>()) {
+    TraceSpan span("allocateClusters", "count", count, "goal", goal);
+    if (count == 0) {
+        return vector<unsigned>();
+    }
+    uint64_t end = (uint64_t) VOLUME->totalClusters + 2;
+    uint64_t start = ALLOCATION_POLICY == _LOWEST_FREE || goal < 2 || goal >= end ? 2 : goal;
+    bool wantRun = ALLOCATION_POLICY == _NEAR_GOAL && count > 1;
+    vector<unsigned> scanned;
+    vector<uint32_t> fat(FAT_SCAN_BYTES / 4);
+    unsigned runStart = 0;
+    unsigned runLength = 0;
+    // Two passes: from start to the end of the volume, then from cluster 2 up to start
+    for (int pass = 0; pass < 2; pass++) {
+        uint64_t from = pass == 0 ? start : 2;
+        uint64_t to = pass == 0 ? end : start;
+        runLength = 0; // Runs do not wrap around
+        for (uint64_t base = from; base < to; base += fat.size()) {
+            size_t entries = min((uint64_t) fat.size(), to - base);
+            readBytes(VOLUME->fatStart + base * 4, fat.data(), entries * 4);
+            for (size_t i = 0; i < entries; i++) {
+                unsigned cluster = base + i;
+                if (fat[i] != 0 || binary_search(reserved.begin(), reserved.end(), cluster)) {
+                    runLength = 0;
+                    continue;
+                }
+                if (runLength++ == 0) {
+                    runStart = cluster;
+                }
+                if (wantRun && runLength == count) {
+                    vector<unsigned> run;
+                    for (unsigned j = 0; j < count; j++) {
+                        run.push_back(runStart + j);
+                    }
+                    return run;
+                }
+                if (scanned.size() < count) {
+                    scanned.push_back(cluster);
+                    if (!wantRun && scanned.size() == count) {
+                        return scanned;
+                    }
+                }
+            }
+        }
+    }
+    return scanned;
+}
+
+bool reserveNewCluster(FileNode* parentDirectory, unsigned remainingEntries) {
+    TraceSpan span("reserveNewCluster", "entries", remainingEntries);
+    unsigned neededClusters = remainingEntries / (VOLUME->clusterSize / sizeof(FatFileEntry)) + 1;
+    // A directory grows after its last cluster and a new one starts after its parent's chain
+    unsigned goal = chainGoal(parentDirectory->clusterChain);
+    if (goal == 0 && parentDirectory->parentRef != nullptr) {
+        goal = chainGoal(parentDirectory->parentRef->clusterChain);
+    }
+    vector<unsigned> clusters = allocateClusters(neededClusters, goal);
+    deque<unsigned> newClusterIndices(clusters.begin(), clusters.end());
+    if (newClusterIndices.size() == neededClusters) {
+        // Free clusters may still hold old data, and unused directory entries must read as empty
+        vector<uint8_t> zeros(VOLUME->clusterSize);
+        for (auto& cluster : clusters) {
+            if (!isHole(clusterOffset(cluster), VOLUME->clusterSize)) {
+                writeBytes(clusterOffset(cluster), zeros.data(), VOLUME->clusterSize);
+            }
+        }
+        if (parentDirectory->clusterChain->size() == 0) { // First time creation, for the sake of consistency
+            parentDirectory->firstClusterIndex = newClusterIndices[0];
+            parentDirectory->clusterChain->push_back(newClusterIndices[0]);
+            newClusterIndices.pop_front();
+        }
+        updateFAT(parentDirectory, newClusterIndices);
+        for (auto& index : newClusterIndices) {
+            parentDirectory->clusterChain->push_back(index);
+        }
+        addUsage(parentDirectory, 0, neededClusters, 0);
+        VOLUME->freeClusters -= neededClusters;
+        writeBytes(VOLUME->fsInfoStart + 488, &VOLUME->freeClusters, 4);
+        return true;
+    }
+    return false;
+}
+
+// Returns clusters to the free pool in every FAT and punches them out of the image so it stays sparse.
+void freeClusters(const vector<unsigned>& clusters) {
+    uint32_t zero = 0;
+    for (unsigned i = 0; i < VOLUME->numFats; i++) {
+        for (auto& cluster : clusters) {
+            writeBytes(VOLUME->fatStart + i * VOLUME->fatSize + (uint64_t) cluster * 4, &zero, 4);
+        }
+    }
+    VOLUME->freeClusters += clusters.size();
+    writeBytes(VOLUME->fsInfoStart + 488, &VOLUME->freeClusters, 4);
+    vector<unsigned> sorted(clusters);
+    sort(sorted.begin(), sorted.end());
+    for (size_t runStart = 0; runStart < sorted.size();) {
+        size_t runEnd = runStart + 1;
+        while (runEnd < sorted.size() && sorted[runEnd] == sorted[runEnd - 1] + 1) {
+            runEnd++;
+        }
+        punchHole(clusterOffset(sorted[runStart]), (runEnd - runStart) * VOLUME->clusterSize);
+        runStart = runEnd;
+    }
+}
+
+/*
+ Free cluster recount. The FSInfo free count and next free hint are only kept up to date by
+ this program, so they drift when an image is changed by anything else. The recount counts
+ the zero entries of the first FAT in large direct reads, eight entries at a time with AVX2
+ when the processor has it, and rewrites FSInfo when it disagrees. Holes in a sparse image
+ are counted as free without being read.
+*/
+const size_t RECOUNT_CHUNK_BYTES = 4 * 1024 * 1024;
+const uint32_t FSINFO_LEAD_SIGNATURE = 0x41615252;
+const uint32_t FSINFO_STRUCT_SIGNATURE = 0x61417272;
+const uint32_t FSINFO_TRAIL_SIGNATURE = 0xAA550000;
+const uint32_t FSINFO_UNKNOWN = 0xFFFFFFFF;
+
+// Whether an FSInfo sector carries the lead signature at 0, the struct signature at 484 and the trail signature at 508.
+bool hasFsInfoSignatures(const uint8_t* sector) {
+    uint32_t lead, structure, trail;
+    memcpy(&lead, sector, 4);
+    memcpy(&structure, sector + 484, 4);
+    memcpy(&trail, sector + 508, 4);
+    return lead == FSINFO_LEAD_SIGNATURE && structure == FSINFO_STRUCT_SIGNATURE && trail == FSINFO_TRAIL_SIGNATURE;
+}
+
+size_t countZeroEntriesScalar(const uint32_t* entries, size_t count) {
+    size_t zeros = 0;
+    for (size_t i = 0; i < count; i++) {
+        zeros += entries[i] == 0;
+    }
+    return zeros;
+}
+
+#ifdef HAVE_AVX2_TARGET
+__attribute__((target("avx2")))
+size_t countZeroEntriesAvx2(const uint32_t* entries, size_t count) {
+    // Each lane counts down by one for every zero it sees, two accumulators to overlap the loads
+    __m256i zero = _mm256_setzero_si256();
+    __m256i first = zero;
+    __m256i second = zero;
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        first = _mm256_add_epi32(first, _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*) (entries + i)), zero));
+        second = _mm256_add_epi32(second, _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*) (entries + i + 8)), zero));
+    }
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i*) lanes, _mm256_sub_epi32(zero, _mm256_add_epi32(first, second)));
+    size_t zeros = 0;
+    for (int lane = 0; lane < 8; lane++) {
+        zeros += lanes[lane];
+    }
+    return zeros + countZeroEntriesScalar(entries + i, count - i);
+}
+#endif
+
+size_t countZeroEntries(const uint32_t* entries, size_t count) {
+#ifdef HAVE_AVX2_TARGET
+    static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+    if (hasAvx2) {
+        return countZeroEntriesAvx2(entries, count);
+    }
+#endif
+    return countZeroEntriesScalar(entries, count);
+}
+
+// Counts the free clusters and finds the first one. With fix, FSInfo and the volume take the counted values.
+FreeCount recountFreeClusters(bool fix) {
+    FreeCount result;
+    uint32_t fsInfo[MAX_BPS / 4];
+    readBytes(VOLUME->fsInfoStart, fsInfo, VOLUME->sectorSize);
+    result.storedFree = fsInfo[488 / 4];
+    result.storedNextFree = fsInfo[492 / 4];
+    result.validFsInfo = fsInfo[0] == FSINFO_LEAD_SIGNATURE && fsInfo[484 / 4] == FSINFO_STRUCT_SIGNATURE;
+    result.freeClusters = 0;
+    result.nextFree = FSINFO_UNKNOWN;
+    result.corrected = false;
+    // Write-through caching keeps the image current, only the journal can hold newer FAT sectors
+    PooledBuffer data(RECOUNT_CHUNK_BYTES);
+    uint32_t* entries = (uint32_t*) data.data;
+    uint64_t end = (uint64_t) VOLUME->totalClusters + 2;
+    for (uint64_t base = 0; base < end; base += RECOUNT_CHUNK_BYTES / 4) {
+        size_t count = min((uint64_t) RECOUNT_CHUNK_BYTES / 4, end - base);
+        size_t first = base == 0 ? 2 : 0; // Entries 0 and 1 are not clusters
+        if (isHole(VOLUME->fatStart + base * 4, count * 4)) { // The never written part of a fresh FAT reads as zero
+            if (result.nextFree == FSINFO_UNKNOWN) {
+                result.nextFree = base + first;
+            }
+            result.freeClusters += count - first;
+            continue;
+        }
+        diskRead(VOLUME->fatStart + base * 4, entries, count * 4);
+        VOLUME->journal->overlay(VOLUME->fatStart + base * 4, entries, count * 4);
+        size_t zeros = countZeroEntries(entries + first, count - first);
+        if (zeros && result.nextFree == FSINFO_UNKNOWN) {
+            result.nextFree = base + (find(entries + first, entries + count, 0) - entries);
+        }
+        result.freeClusters += zeros;
+    }
+    VOLUME->freeClusters = result.freeClusters;
+    if (fix && result.validFsInfo && (result.storedFree != result.freeClusters || result.storedNextFree != result.nextFree)) {
+        writeBytes(VOLUME->fsInfoStart + 488, &result.freeClusters, 4);
+        writeBytes(VOLUME->fsInfoStart + 492, &result.nextFree, 4);
+        result.corrected = true;
+    }
+    return result;
+}
+
+vector<uint64_t> getAvailableAddresses(FileNode* parentDirectory, unsigned numEntries) {
+    TraceSpan span("getAvailableAddresses", "entries", numEntries);
+    bool addressesFound = false;
+    vector<uint64_t> spaces;
+    vector<unsigned>& chain = *parentDirectory->clusterChain;
+    const unsigned entriesPerCluster = VOLUME->clusterSize / sizeof(FatFileEntry);
+    unsigned run = 0; // Free entries in a row so far, they may span clusters
+    FatFileEntry* entries = new FatFileEntry[entriesPerCluster];
+    for (size_t c = 0; c < chain.size(); c++) {
+        readBytes(clusterOffset(chain[c]), entries, VOLUME->clusterSize);
+        unsigned last = VOLUME->kernels->findFreeRun(entries, numEntries, run);
+        if (last < entriesPerCluster) {
+            uint64_t position = c * entriesPerCluster + last + 1 - numEntries;
+            for (; position <= c * entriesPerCluster + last; position++) {
+                spaces.push_back(clusterOffset(chain[position / entriesPerCluster]) + position % entriesPerCluster * sizeof(FatFileEntry));
+            }
+            addressesFound = true;
+            break;
+        }
+    }
+    delete[] entries;
+    if (!addressesFound) { // fallback
+        unsigned remaining = numEntries - run;
+        bool hasReserved = reserveNewCluster(parentDirectory, remaining);
+
+        // clusters in "spaces" are already available and can be reserved. find places for the remaining entries
+        if (hasReserved) {
+            return getAvailableAddresses(parentDirectory, numEntries);
+        } else { // address & new cluster not found, returns zero sized vector
+            spaces.erase(spaces.begin(), spaces.end());
+            return spaces;
+        }
+        /*
+        reserving needs to:
+            - find an available space in data area if exists
+            - update fat table (does it have to update all tables?):
+                - find new space in fat table (and store its address ex. 0x0a)
+                - write EOC in that address
+                - go to the last chain index of fat table and update it with stored address
+                - then inform the calling routine about reserved or not
+        -- sending arguments to reserveNewCluster will make it too specific.
+           it should be used in another context as well.
+        */
+    }
+    return spaces;
+}
+
+vector<unsigned>* getClusterChain(uint32_t firstClusterIndex) {
+    vector<unsigned>* clusterChain = new vector<unsigned>;
+    unsigned currentCluster = firstClusterIndex;
+    if (currentCluster == 0) { // For empty files
+        return clusterChain;
+    }
+    clusterChain->push_back(currentCluster);
+    // Follow the chain one FAT sector at a time, most links stay inside the sector already read
+    VOLUME->kernels->followChain(currentCluster, *clusterChain);
+    return clusterChain;
+}
+
+// Merges the chain of a file into extents of consecutive clusters, cut at the file size.
+vector<Extent> fileExtents(FileNode* file) {
+    vector<Extent> extents;
+    uint64_t remaining = file->fileSize;
+    for (auto& cluster : *file->clusterChain) {
+        if (remaining == 0) {
+            break;
+        }
+        uint64_t length = min(remaining, (uint64_t) VOLUME->clusterSize);
+        uint64_t offset = clusterOffset(cluster);
+        if (extents.size() && extents.back().imageOffset + extents.back().length == offset) {
+            extents.back().length += length;
+        } else {
+            extents.push_back({file->fileSize - remaining, offset, length});
+        }
+        remaining -= length;
+    }
+    return extents;
+}
+
+size_t FileReader::read(uint64_t position, void* buffer, size_t size) {
+    if (position >= file->fileSize) {
+        return 0;
+    }
+    size = min((uint64_t) size, file->fileSize - position);
+    // The last extent starting at or before position holds it
+    auto it = upper_bound(extents.begin(), extents.end(), position, [](uint64_t value, const Extent& extent) {
+        return value < extent.fileOffset;
+    }) - 1;
+    vector<IORequest> requests;
+    size_t done = 0;
+    for (; it != extents.end() && done < size; it++) {
+        uint64_t skip = position + done - it->fileOffset;
+        size_t length = min((uint64_t) size - done, it->length - skip);
+        requests.push_back({it->imageOffset + skip, (uint8_t*) buffer + done, length, false});
+        done += length;
+    }
+    return submitBatch(requests) ? done : 0;
+}
+
+// Appends the valid prefix of each of the three name pieces of an LFN entry to out and returns the count.
+// A piece ends at the first NUL, space or non-ASCII character, as in the original per-character parser.
+size_t narrowLfn(const FatFileLFN* lfn, char* out) {
+    uint16_t chars[16] = {0};
+    memcpy(chars, lfn->name1, 10);
+    memcpy(chars + 5, lfn->name2, 12);
+    memcpy(chars + 11, lfn->name3, 4);
+    unsigned validMask;
+    char narrowed[16];
+#ifdef __SSE2__
+    __m128i low = _mm_loadu_si128((__m128i*) chars);
+    __m128i high = _mm_loadu_si128((__m128i*) (chars + 8));
+    __m128i zero = _mm_setzero_si128();
+    __m128i nonAscii = _mm_set1_epi16((short) 0xFF80);
+    __m128i space = _mm_set1_epi16(32);
+    __m128i invalidLow = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi16(low, zero), _mm_cmpeq_epi16(low, space)),
+                                      _mm_xor_si128(_mm_cmpeq_epi16(_mm_and_si128(low, nonAscii), zero), _mm_set1_epi16(-1)));
+    __m128i invalidHigh = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi16(high, zero), _mm_cmpeq_epi16(high, space)),
+                                       _mm_xor_si128(_mm_cmpeq_epi16(_mm_and_si128(high, nonAscii), zero), _mm_set1_epi16(-1)));
+    validMask = ~_mm_movemask_epi8(_mm_packs_epi16(invalidLow, invalidHigh)) & 0x1FFF;
+    _mm_storeu_si128((__m128i*) narrowed, _mm_packus_epi16(low, high));
+#else
+    validMask = 0;
+    for (int j = 0; j < 13; j++) {
+        if (chars[j] != 0 && chars[j] != 32 && chars[j] < 128) {
+            validMask |= 1 << j;
+        }
+        narrowed[j] = (char) chars[j];
+    }
+#endif
+    size_t length = 0;
+    const int pieceStart[3] = {0, 5, 11};
+    const int pieceLength[3] = {5, 6, 2};
+    for (int piece = 0; piece < 3; piece++) {
+        unsigned invalid = ~(validMask >> pieceStart[piece]) & ((1 << pieceLength[piece]) - 1);
+        int validPrefix = invalid ? __builtin_ctz(invalid) : pieceLength[piece];
+        memcpy(out + length, narrowed + pieceStart[piece], validPrefix);
+        length += validPrefix;
+    }
+    return length;
+}
+
+// Classifies 16 consecutive entries at once into LFN, 8.3 file/folder and deleted entries, one bit per entry.
+void classifyEntries(const FatFileEntry* entries, unsigned& lfnMask, unsigned& namedMask, unsigned& deletedMask) {
+    uint8_t attributes[16];
+    uint8_t firstBytes[16];
+    for (int k = 0; k < 16; k++) {
+        attributes[k] = entries[k].msdos.attributes;
+        firstBytes[k] = entries[k].msdos.filename[0];
+    }
+#ifdef __SSE2__
+    __m128i attributeVector = _mm_loadu_si128((__m128i*) attributes);
+    __m128i firstVector = _mm_loadu_si128((__m128i*) firstBytes);
+    lfnMask = _mm_movemask_epi8(_mm_cmpeq_epi8(attributeVector, _mm_set1_epi8(0x0F)));
+    namedMask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(attributeVector, _mm_set1_epi8(0x10)),
+                                               _mm_cmpeq_epi8(attributeVector, _mm_set1_epi8(0x20))));
+    deletedMask = _mm_movemask_epi8(_mm_cmpeq_epi8(firstVector, _mm_set1_epi8((char) 0xE5)));
+#else
+    lfnMask = namedMask = deletedMask = 0;
+    for (int k = 0; k < 16; k++) {
+        lfnMask |= (attributes[k] == 0x0F) << k;
+        namedMask |= (attributes[k] == 0x10 || attributes[k] == 0x20) << k;
+        deletedMask |= (firstBytes[k] == 0xE5) << k;
+    }
+#endif
+}
+
+// Parses the directory contents in data, which holds every cluster of root's chain back to back.
+// Entries are classified 16 at a time and only the interesting ones are visited. LFN pieces arrive
+// last piece first, so the name is assembled backwards from the end of a fixed buffer.
+void getFileAndFolders(FileNode* root, uint8_t* data) {
+    vector<unsigned>* clusterChain = root->clusterChain;
+    char nameBuffer[LFN_NAME_MAX];
+    size_t nameStart = LFN_NAME_MAX;
+    uint8_t checksum = 0;
+    vector<FileNode*> discovered;
+    const unsigned entriesPerCluster = VOLUME->clusterSize / sizeof(FatFileEntry);
+    vector<unsigned> masks(entriesPerCluster / 16 * 3);
+    for (size_t c = 0; c < clusterChain->size(); c++) {
+        uint64_t offset = clusterOffset((*clusterChain)[c]);
+        FatFileEntry* clusterEntries = (FatFileEntry*) (data + c * VOLUME->clusterSize);
+        VOLUME->kernels->classifyCluster(clusterEntries, masks.data());
+        for (unsigned group = 0; group < entriesPerCluster; group += 16) {
+            unsigned lfnMask = masks[group / 16 * 3];
+            unsigned namedMask = masks[group / 16 * 3 + 1];
+            unsigned deletedMask = masks[group / 16 * 3 + 2];
+            unsigned interesting = lfnMask | namedMask | deletedMask;
+            while (interesting) {
+                unsigned k = __builtin_ctz(interesting);
+                interesting &= interesting - 1;
+                unsigned i = group + k;
+                FatFileEntry* fatFile = clusterEntries + i;
+                unsigned attributes = fatFile->msdos.attributes;
+                if (deletedMask & (1 << k)) { // Deleted entry fix
+                    writeBytes(offset + i * sizeof(FatFileEntry), ZERO_ENTRY, sizeof(FatFileEntry));
+                } else if (lfnMask & (1 << k)) { // LFN entry
+                    char piece[16];
+                    size_t length = narrowLfn(&fatFile->lfn, piece);
+                    if (length <= nameStart) {
+                        nameStart -= length;
+                        memcpy(nameBuffer + nameStart, piece, length);
+                    }
+                    checksum = fatFile->lfn.checksum;
+                } else if (nameStart < LFN_NAME_MAX) { // 8.3 entry ending an LFN
+                    uint32_t firstCluster = (fatFile->msdos.eaIndex << 16) + fatFile->msdos.firstCluster;
+                    FileNode* newNode = new FileNode;
+                    newNode->name.assign(nameBuffer + nameStart, LFN_NAME_MAX - nameStart);
+                    newNode->parentRef = root;
+                    newNode->type = attributes == 16 ? _FOLDER : _FILE;
+                    newNode->firstClusterIndex = firstCluster;
+                    discovered.push_back(newNode);
+                    newNode->entry = new FatFileEntry(*fatFile);
+                    newNode->checksum = checksum;
+                    int order = 0;
+                    for (int j = 1; j < 8 && isdigit(fatFile->msdos.filename[j]); j++) {
+                        order = order * 10 + (fatFile->msdos.filename[j] - '0');
+                    }
+                    newNode->order = order;
+                    newNode->setModifiedDate(fatFile->msdos.modifiedDate);
+                    newNode->setModifiedTime(fatFile->msdos.modifiedTime);
+                    newNode->fileSize = fatFile->msdos.fileSize;
+                    newNode->creationMs = fatFile->msdos.creationTimeMs;
+                    root->children.push_back(newNode);
+                    VOLUME->nameIndex->add(newNode);
+                    nameStart = LFN_NAME_MAX;
+                    checksum = 0;
+                } else if (fatFile->msdos.filename[0] == '.') {
+                    uint8_t second = fatFile->msdos.filename[1];
+                    bool secondEnds = second == ' ' || second == 0 || second > 127;
+                    uint8_t third = fatFile->msdos.filename[2];
+                    bool twoDots = second == '.' && (third == ' ' || third == 0 || third > 127);
+                    if (secondEnds) {
+                        FileNode* fptr = new FileNode(*root);
+                        fptr->name = ".";
+                        fptr->realName = root->name;
+                        fptr->realNode = root;
+                        fptr->type = _DOT;
+                        root->children.push_back(fptr);
+                    } else if (twoDots) {
+                        FileNode* fptr = new FileNode(*(root->parentRef));
+                        fptr->name = "..";
+                        fptr->realName = root->parentRef->name;
+                        fptr->realNode = root->parentRef;
+                        fptr->type = _DOT;
+                        root->children.push_back(fptr);
+                    }
+                }
+            }
+        }
+    }
+    // Readahead: the FAT sectors of every child are needed right away to build their chains,
+    // and the first cluster of every subdirectory is parsed on the next level of the tree.
+    vector<pair<uint64_t, size_t>> ranges;
+    for (auto& node : discovered) {
+        if (node->firstClusterIndex == 0) {
+            continue;
+        }
+        ranges.push_back({VOLUME->fatStart + (uint64_t) node->firstClusterIndex * 4 / VOLUME->sectorSize * VOLUME->sectorSize, VOLUME->sectorSize});
+        if (node->type == _FOLDER) {
+            ranges.push_back({clusterOffset(node->firstClusterIndex), VOLUME->clusterSize});
+        }
+    }
+    prefetch(ranges);
+    for (auto& node : discovered) {
+        node->clusterChain = getClusterChain(node->firstClusterIndex);
+    }
+}
+
+void getFileAndFolders(FileNode* root) {
+    PooledBuffer data(root->clusterChain->size() * VOLUME->clusterSize);
+    vector<IORequest> requests;
+    appendChainRequests(*root->clusterChain, 0, root->clusterChain->size(), data.data, requests);
+    submitBatch(requests);
+    getFileAndFolders(root, data.data);
+}
+
+/*
+ Streaming access. Without the tree, a directory is decoded straight from its clusters one
+ cluster at a time, following its chain in the FAT as it goes. Only the cluster being parsed
+ and the name being assembled are held, and FAT sectors come through the block cache, so
+ memory does not grow with the size of the volume. Nothing is written, not even the deleted
+ entry fix the tree build applies.
+*/
+// The cluster after cluster in its chain, 0 at the end of the chain.
+unsigned nextCluster(unsigned cluster) {
+    uint32_t entryValue = 0;
+    readBytes(VOLUME->fatStart + (uint64_t) cluster * 4, &entryValue, 4);
+    entryValue &= 0x0FFFFFFF;
+    if (entryValue == (VOLUME->eocValue & 0x0FFFFFFF) || entryValue >= 0x0FFFFFF8 || entryValue < 2) {
+        return 0;
+    }
+    return entryValue;
+}
+
+DirectoryStream::DirectoryStream(unsigned firstCluster) : buffer(VOLUME->clusterSize), nameStart(LFN_NAME_MAX) {
+    load(firstCluster);
+}
+
+void DirectoryStream::load(unsigned next) {
+    cluster = next;
+    group = 0;
+    interesting = 0;
+    if (cluster != 0) {
+        readBytes(clusterOffset(cluster), buffer.data(), VOLUME->clusterSize);
+        classifyEntries((FatFileEntry*) buffer.data(), lfnMask, namedMask, deletedMask);
+        interesting = lfnMask | namedMask | deletedMask;
+    }
+}
+
+// Same decoding as getFileAndFolders, 16 entries classified at a time.
+bool DirectoryStream::next(StreamEntry& entry) {
+    const unsigned entriesPerCluster = VOLUME->clusterSize / sizeof(FatFileEntry);
+    while (cluster != 0) {
+        if (interesting == 0) {
+            group += 16;
+            if (group >= entriesPerCluster) {
+                load(nextCluster(cluster));
+            } else {
+                classifyEntries((FatFileEntry*) buffer.data() + group, lfnMask, namedMask, deletedMask);
+                interesting = lfnMask | namedMask | deletedMask;
+            }
+            continue;
+        }
+        unsigned k = __builtin_ctz(interesting);
+        interesting &= interesting - 1;
+        FatFileEntry* fatFile = (FatFileEntry*) buffer.data() + group + k;
+        if (deletedMask & (1 << k)) {
+            continue;
+        }
+        if (lfnMask & (1 << k)) {
+            char piece[16];
+            size_t length = narrowLfn(&fatFile->lfn, piece);
+            if (length <= nameStart) {
+                nameStart -= length;
+                memcpy(nameBuffer + nameStart, piece, length);
+            }
+            continue;
+        }
+        entry.firstCluster = (fatFile->msdos.eaIndex << 16) + fatFile->msdos.firstCluster;
+        entry.fileSize = fatFile->msdos.fileSize;
+        entry.modifiedDate = fatFile->msdos.modifiedDate;
+        entry.modifiedTime = fatFile->msdos.modifiedTime;
+        if (nameStart < LFN_NAME_MAX) {
+            entry.name = string_view(nameBuffer + nameStart, LFN_NAME_MAX - nameStart);
+            entry.type = fatFile->msdos.attributes == 16 ? _FOLDER : _FILE;
+            nameStart = LFN_NAME_MAX;
+            return true;
+        }
+        if (fatFile->msdos.filename[0] == '.') {
+            uint8_t second = fatFile->msdos.filename[1];
+            uint8_t third = fatFile->msdos.filename[2];
+            entry.type = _DOT;
+            if (second == ' ' || second == 0 || second > 127) {
+                entry.name = ".";
+                return true;
+            } else if (second == '.' && (third == ' ' || third == 0 || third > 127)) {
+                entry.name = "..";
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Resolves a path like findFile, scanning one directory per component. The result is named after the last component.
+bool streamLookup(unsigned currentCluster, const vector<string>& directories, StreamEntry& result) {
+    if (directories.size() == 0) {
+        return false;
+    }
+    unsigned rootCluster = VOLUME->root->firstClusterIndex;
+    size_t index = 0;
+    if (directories[0] == "/") {
+        currentCluster = rootCluster;
+        index = 1;
+    }
+    result = {directories.back(), _FOLDER, currentCluster, 0, 0, 0};
+    for (; index < directories.size(); index++) {
+        bool last = index == directories.size() - 1;
+        DirectoryStream stream(currentCluster);
+        StreamEntry entry;
+        bool found = false;
+        while (stream.next(entry)) {
+            if (entry.name == directories[index]) {
+                found = entry.type != _FILE || last;
+                break;
+            }
+        }
+        if (!found && directories[index] == "." && currentCluster == rootCluster) {
+            entry = {directories[index], _FOLDER, rootCluster, 0, 0, 0};
+            found = true;
+        }
+        if (!found) {
+            return false;
+        }
+        if (entry.type == _DOT) { // ".." of a top level directory points at cluster 0
+            entry.type = _FOLDER;
+            entry.firstCluster = entry.firstCluster ? entry.firstCluster : rootCluster;
+        }
+        result = entry;
+        result.name = directories.back();
+        currentCluster = entry.firstCluster;
+    }
+    return true;
+}
+
+// Builds the tree level by level so that all directories discovered on one level are read in a single batch.
+void createTree(FileNode* root) {
+    vector<FileNode*> pending;
+    if (root->type == _FOLDER) {
+        pending.push_back(root);
+    }
+    size_t batchBytes = min(TREE_BATCH_BYTES, BLOCK_CACHE_BYTES / 2);
+    while (pending.size()) {
+        vector<FileNode*> discovered;
+        size_t start = 0;
+        while (start < pending.size()) {
+            size_t end = start;
+            size_t bytes = 0;
+            vector<pair<uint64_t, size_t>> ranges;
+            while (end < pending.size() && (end == start || bytes + pending[end]->clusterChain->size() * VOLUME->clusterSize <= batchBytes)) {
+                for (auto& cluster : *pending[end]->clusterChain) {
+                    ranges.push_back({clusterOffset(cluster), VOLUME->clusterSize});
+                }
+                bytes += pending[end]->clusterChain->size() * VOLUME->clusterSize;
+                end++;
+            }
+            prefetch(ranges);
+            for (size_t k = start; k < end; k++) {
+                getFileAndFolders(pending[k]);
+                for (auto& child : pending[k]->children) {
+                    if (child->type == _FOLDER) {
+                        discovered.push_back(child);
+                    }
+                }
+            }
+            start = end;
+        }
+        pending.swap(discovered);
+    }
+}
+
+FileNode* findFile(FileNode* currentDir, const vector<string>& directories) {
+    TraceSpan span("findFile", "components", directories.size());
+    if (directories.size() == 0) {
+        return nullptr;
+    }
+    size_t index = 0;
+    if (directories[0] == "/") {
+        currentDir = VOLUME->root;
+        index = 1;
+        if (directories.size() == 1) {
+            return currentDir;
+        }
+    }
+    for (; index < directories.size(); index++) {
+        bool last = index == directories.size() - 1;
+        FileNode* next = nullptr;
+        for (auto& child : currentDir->children) {
+            if (child->name == directories[index]) {
+                if (child->type == _FOLDER) {
+                    next = child;
+                } else if (child->type == _DOT) {
+                    next = child->realNode;
+                } else if (child->type == _FILE && last) {
+                    return child;
+                }
+                break;
+            }
+        }
+        if (next == nullptr && directories[index] == "." && currentDir->name == "/" && currentDir->children.size()) {
+            next = currentDir;
+        }
+        if (next == nullptr) {
+            return nullptr;
+        }
+        if (last) {
+            return next;
+        }
+        currentDir = next;
+    }
+    return nullptr;
+}
+
+string findAbsolutePath(FileNode* file) { // USE FOR FOLDERS
+    if (file->name == "/") {
+        return "/";
+    }
+    string path = "";
+    deque<string> names;
+    while (file->parentRef != nullptr) {
+        names.push_front(file->name);
+        file = file->parentRef;
+    }
+    for (int i = 0; i < names.size() - 1; i++) {
+        path = path + names[i];
+        path.push_back('/');
+    }
+    path += names[names.size() - 1];
+    return "/" + path;
+}
+
+/*
+ Dentry cache: maps an absolute path without "." or ".." components to its node. Only
+ successful lookups are stored, so creating a node never makes an entry stale; mv drops
+ every entry under the moved path. Least recently used entries are evicted past capacity.
+*/
+class DentryCache {
+public:
+    struct CacheEntry {
+        FileNode* node;
+        list<string>::iterator lruPosition;
+    };
+    map<string, CacheEntry> entries;
+    list<string> lru;
+    size_t capacity;
+    DentryCache(size_t capacity) : capacity(capacity) {}
+
+    FileNode* lookup(const string& path) {
+        auto it = entries.find(path);
+        if (it == entries.end()) {
+            return nullptr;
+        }
+        lru.splice(lru.begin(), lru, it->second.lruPosition);
+        return it->second.node;
+    }
+
+    void insert(const string& path, FileNode* node) {
+        auto it = entries.find(path);
+        if (it != entries.end()) {
+            it->second.node = node;
+            lru.splice(lru.begin(), lru, it->second.lruPosition);
+            return;
+        }
+        lru.push_front(path);
+        entries[path] = {node, lru.begin()};
+        if (entries.size() > capacity) {
+            entries.erase(lru.back());
+            lru.pop_back();
+        }
+    }
+
+    // Drops path itself and every path below it.
+    void invalidate(const string& path) {
+        string prefix = path == "/" ? "" : path;
+        auto it = entries.lower_bound(path);
+        while (it != entries.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+            if (it->first.size() == prefix.size() || it->first[prefix.size()] == '/') {
+                lru.erase(it->second.lruPosition);
+                it = entries.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+};
+
+// Builds the cache key for path relative to currentPath. Paths with ".", ".." or empty components are not cached.
+bool dentryKey(const string& currentPath, const string& path, string& key) {
+    if (path.size() == 0) {
+        return false;
+    }
+    key = path[0] == '/' ? path : (currentPath == "/" ? "/" : currentPath + "/") + path;
+    if (key.size() > 1 && key.back() == '/') {
+        key.pop_back();
+    }
+    size_t componentStart = 1;
+    while (componentStart < key.size()) {
+        size_t componentEnd = key.find('/', componentStart);
+        if (componentEnd == string::npos) {
+            componentEnd = key.size();
+        }
+        size_t length = componentEnd - componentStart;
+        if (length == 0 || (length == 1 && key[componentStart] == '.') || (length == 2 && key.compare(componentStart, 2, "..") == 0)) {
+            return false;
+        }
+        componentStart = componentEnd + 1;
+    }
+    return true;
+}
+
+// Resolves path like findFile, consulting the dentry cache first. absolutePath receives the node's path when it is known.
+FileNode* resolvePath(FileNode* currentDir, const string& currentPath, const string& path, string* absolutePath) {
+    string key;
+    bool cacheable = dentryKey(currentPath, path, key);
+    FileNode* node = cacheable ? VOLUME->dentryCache->lookup(key) : nullptr;
+    if (node == nullptr) {
+        node = findFile(currentDir, extractDirectories(path));
+        if (node != nullptr && cacheable) {
+            VOLUME->dentryCache->insert(key, node);
+        }
+    }
+    recordAccess(node);
+    if (absolutePath != nullptr && node != nullptr) {
+        *absolutePath = cacheable ? key : findAbsolutePath(node);
+    }
+    return node;
+}
+
+void printFatEntries(FileNode* node) {
+    for (auto& cluster : *node->clusterChain) {
+        cout << "cluster is " << cluster << endl;
+        uint8_t* bytes = new uint8_t[4];
+        readBytes(VOLUME->fatStart + (uint64_t) cluster * 4, bytes, 4);
+        for (int j = 0; j < 4; j++) {
+            printf("0x%X ", bytes[j]);
+        }
+        delete[] bytes;
+        cout << endl;
+    }
+}
+
+void printCluster(unsigned cluster) {
+    FatFileEntry* fatFile = new FatFileEntry;
+    uint64_t offset = clusterOffset(cluster);
+    string concatName;
+    for (int i = 0; i < VOLUME->clusterSize / sizeof(FatFileEntry); i++) { // ROOT DIRECTORY - CLUSTER 2
+        char* name = new char[13];
+        char* extension = new char[3];
+        char* shortName = new char[7];
+        uint8_t sequenceNumber;
+        uint8_t firstByte;
+        readBytes(offset + i * sizeof(FatFileEntry), fatFile, sizeof(FatFileEntry));
+        unsigned attributes = fatFile->msdos.attributes;
+        if (attributes == 15) { // LFN entry
+            string current;
+            for (int j = 0; j < 5; j++) {
+                if (!isascii(fatFile->lfn.name1[j]) || fatFile->lfn.name1[j] == 0 || fatFile->lfn.name1[j] == 32) {
+                    //break;
+                }
+                cout << "pushing val" << fatFile->lfn.name1[j] << "i = " << i << endl;
+                current.push_back((char) fatFile->lfn.name1[j]);
+            }
+            for (int j = 0; j < 6; j++) {
+                if (!isascii(fatFile->lfn.name2[j]) || fatFile->lfn.name2[j] == 0 || fatFile->lfn.name2[j] == 32) {
+                    //break;
+                }
+                cout << "pushing val" << fatFile->lfn.name2[j] << "i = " << i << endl;
+                current.push_back((char) fatFile->lfn.name2[j]);
+            }
+            for (int j = 0; j < 2; j++) {
+                if (!isascii(fatFile->lfn.name3[j]) || fatFile->lfn.name3[j] == 0 || fatFile->lfn.name3[j] == 32) {
+                    //break;
+                }
+                cout << "pushing val" << fatFile->lfn.name3[j] << "i = " << i << endl;
+                current.push_back((char) fatFile->lfn.name3[j]);
+            }
+            concatName = current + concatName;
+            cout << "name = " << concatName << "\t\t\t\t\t";
+            printf("sequence no = 0x%X ", fatFile->lfn.sequence_number);
+            cout << "checksum = " << fatFile->lfn.checksum << endl;
+        } else if (attributes == 16 || attributes == 32) { // 8.3 entry
+            concatName.erase();
+            for (int j = 0; j < 8; j++) {
+                if (!isascii(fatFile->msdos.filename[j]) || fatFile->msdos.filename[j] == 0 || fatFile->msdos.filename[j] == 32) {
+                    break;
+                }
+                if (j == 0) {
+                    printf("adding char[0] 0x%X", fatFile->msdos.filename[j]);
+                    cout << " int value = " << (int) fatFile->msdos.filename[0] << endl;
+                } else {
+                    cout << "adding a char -> " << fatFile->msdos.filename[j] << " int value = " << (int) fatFile->msdos.filename[j] << endl;
+                }
+                name[j] = fatFile->msdos.filename[j];
+            }
+            cout << "name = ..." << fatFile->msdos.filename << "...\n";
+            for (int j = 0; j < 3; j++) {
+                cout << "int val of extension + " << j << " = " << (int) fatFile->msdos.extension[j] << endl;
+                cout << "attributes = " << fatFile->msdos.attributes << endl;
+            }
+        }
+        printf("file size = %u ", fatFile->msdos.fileSize);
+        printf("attributes = 0x%X ", fatFile->msdos.attributes);
+        printf("first cluster 0-1 = 0x%X 0x%x ", fatFile->msdos.eaIndex, fatFile->msdos.firstCluster);
+        printf("modified date = %u ", fatFile->msdos.modifiedDate);
+        printf("modified time = %u ", fatFile->msdos.modifiedTime);
+        cout << "order = " << i << endl;
+        cout << endl;
+        delete[] name;
+        delete[] extension;
+        delete[] shortName;
+    }
+    delete fatFile;
+    cout << "END OF CLUSTER " << cluster << endl;
+}
+
+bool createDotEntries(FileNode* newDirNode) {
+    TraceSpan span("createDotEntries");
+    FileNode* dotEntry = new FileNode(*newDirNode);
+    dotEntry->name = ".";
+    dotEntry->realName = newDirNode->name;
+    dotEntry->realNode = newDirNode;
+    dotEntry->type = _DOT;
+    newDirNode->children.push_back(dotEntry);
+    FatFileEntry* dot83 = new FatFileEntry;
+    dot83->msdos.filename[0] = 0x2E;
+    for (int j = 1; j < 8; j++) {
+        dot83->msdos.filename[j] = 0x20;
+    }
+    for (int j = 0; j < 3; j++) {
+        dot83->msdos.extension[j] = 0x20;
+    }
+    dot83->msdos.fileSize = 0;
+    dot83->msdos.attributes = 0x10;
+    dot83->msdos.reserved = 0;
+    uint16_t creationTime = getCurrentTime();
+    uint16_t creationDate = getCurrentDate();
+    dot83->msdos.creationTimeMs = getCurrentMs();
+    dot83->msdos.creationDate = creationDate;
+    dot83->msdos.creationTime = creationTime;
+    dot83->msdos.modifiedDate = creationDate;
+    dot83->msdos.modifiedTime = creationTime;
+    dot83->msdos.eaIndex = (newDirNode->firstClusterIndex & 0xFFFF0000) >> 16;
+    dot83->msdos.firstCluster = (newDirNode->firstClusterIndex & 0x0000FFFF);
+    FileNode* parentDirectory = newDirNode->parentRef;
+    FileNode* twoDotEntry = new FileNode(*parentDirectory);
+    twoDotEntry->name = "..";
+    twoDotEntry->realName = parentDirectory->name;
+    twoDotEntry->realNode = parentDirectory;
+    twoDotEntry->type = _DOT;
+    newDirNode->children.push_back(twoDotEntry);
+    FatFileEntry* twoDot83 = new FatFileEntry;
+    twoDot83->msdos.filename[0] = 0x2E;
+    twoDot83->msdos.filename[1] = 0x2E;
+    for (int j = 2; j < 8; j++) {
+        twoDot83->msdos.filename[j] = 0x20;
+    }
+    for (int j = 0; j < 3; j++) {
+        twoDot83->msdos.extension[j] = 0x20;
+    }
+    twoDot83->msdos.fileSize = 0;
+    twoDot83->msdos.attributes = 0x10;
+    twoDot83->msdos.reserved = 0;
+    twoDot83->msdos.creationTimeMs = getCurrentMs();
+    twoDot83->msdos.creationDate = creationDate;
+    twoDot83->msdos.creationTime = creationTime;
+    twoDot83->msdos.modifiedDate = creationDate;
+    twoDot83->msdos.modifiedTime = creationTime;
+    twoDot83->msdos.eaIndex = parentDirectory->name == "/" ? 0 : (parentDirectory->firstClusterIndex & 0xFFFF0000) >> 16;
+    twoDot83->msdos.firstCluster = parentDirectory->name == "/" ? 0 : (parentDirectory->firstClusterIndex & 0x0000FFFF);
+    writeBytes(clusterOffset(newDirNode->firstClusterIndex), dot83, sizeof(FatFileEntry));
+    writeBytes(clusterOffset(newDirNode->firstClusterIndex) + 32, twoDot83, sizeof(FatFileEntry));
+    delete dot83;
+    delete twoDot83;
+    return true;
+}
+
+bool isUnder(FileNode* node, FileNode* directory) {
+    for (; node != nullptr; node = node->parentRef) {
+        if (node == directory) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Longest run of literal characters in a glob, used to narrow the candidates through the name index.
+string globLiteral(const string& pattern) {
+    string longest;
+    string current;
+    for (size_t i = 0; i < pattern.size(); i++) {
+        char c = pattern[i];
+        if (c == '*' || c == '?' || c == '[') {
+            if (c == '[') {
+                size_t close = pattern.find(']', i + 2);
+                i = close == string::npos ? pattern.size() : close;
+            }
+            current.erase();
+        } else {
+            if (c == '\\' && i + 1 < pattern.size()) {
+                c = pattern[++i];
+            }
+            current.push_back(c);
+            if (current.size() > longest.size()) {
+                longest = current;
+            }
+        }
+    }
+    return longest;
+}
+
+// Paths below base whose name matches pattern, either as a glob or as a plain substring.
+vector<string> findNames(FileNode* base, const string& pattern, bool glob) {
+    vector<FileNode*> candidates = VOLUME->nameIndex->search(glob ? globLiteral(pattern) : pattern);
+    vector<string> paths;
+    for (auto& node : candidates) {
+        if (glob && fnmatch(pattern.c_str(), node->name.c_str(), 0) != 0) {
+            continue;
+        }
+        if (isUnder(node, base)) {
+            paths.push_back(findAbsolutePath(node));
+        }
+    }
+    sort(paths.begin(), paths.end());
+    return paths;
+}
+
+/*
+ Content hashing. Files are read straight from the image with large positional reads of
+ their cluster runs, bypassing the block cache, and hashed by a pool of worker threads. The
+ default hash is XXH64; SHA-256 is available when a cryptographic digest is needed.
+*/
+const size_t HASH_CHUNK_BYTES = 4 * 1024 * 1024;
+
+uint64_t rotateLeft(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+class Xxh64 {
+public:
+    static const uint64_t P1 = 11400714785074694791ULL;
+    static const uint64_t P2 = 14029467366897019727ULL;
+    static const uint64_t P3 = 1609587929392839161ULL;
+    static const uint64_t P4 = 9650029242287828579ULL;
+    static const uint64_t P5 = 2870177450012600261ULL;
+    uint64_t lanes[4];
+    uint8_t pending[32];
+    size_t pendingSize;
+    uint64_t total;
+
+    Xxh64() {
+        lanes[0] = P1 + P2;
+        lanes[1] = P2;
+        lanes[2] = 0;
+        lanes[3] = -P1;
+        pendingSize = 0;
+        total = 0;
+    }
+
+    static uint64_t round(uint64_t accumulator, uint64_t input) {
+        return rotateLeft(accumulator + input * P2, 31) * P1;
+    }
+
+    void stripe(const uint8_t* data) {
+        for (int i = 0; i < 4; i++) {
+            uint64_t word;
+            memcpy(&word, data + i * 8, 8);
+            lanes[i] = round(lanes[i], word);
+        }
+    }
+
+    void update(const uint8_t* data, size_t size) {
+        total += size;
+        if (pendingSize) {
+            size_t taken = min(size, 32 - pendingSize);
+            memcpy(pending + pendingSize, data, taken);
+            pendingSize += taken;
+            data += taken;
+            size -= taken;
+            if (pendingSize < 32) {
+                return;
+            }
+            stripe(pending);
+            pendingSize = 0;
+        }
+        for (; size >= 32; data += 32, size -= 32) {
+            stripe(data);
+        }
+        memcpy(pending, data, size);
+        pendingSize = size;
+    }
+
+    uint64_t digest() {
+        uint64_t hash;
+        if (total >= 32) {
+            hash = rotateLeft(lanes[0], 1) + rotateLeft(lanes[1], 7) + rotateLeft(lanes[2], 12) + rotateLeft(lanes[3], 18);
+            for (int i = 0; i < 4; i++) {
+                hash = (hash ^ round(0, lanes[i])) * P1 + P4;
+            }
+        } else {
+            hash = P5;
+        }
+        hash += total;
+        size_t i = 0;
+        for (; i + 8 <= pendingSize; i += 8) {
+            uint64_t word;
+            memcpy(&word, pending + i, 8);
+            hash = rotateLeft(hash ^ round(0, word), 27) * P1 + P4;
+        }
+        if (i + 4 <= pendingSize) {
+            uint32_t word;
+            memcpy(&word, pending + i, 4);
+            hash = rotateLeft(hash ^ (word * P1), 23) * P2 + P3;
+            i += 4;
+        }
+        for (; i < pendingSize; i++) {
+            hash = rotateLeft(hash ^ (pending[i] * P5), 11) * P1;
+        }
+        hash ^= hash >> 33;
+        hash *= P2;
+        hash ^= hash >> 29;
+        hash *= P3;
+        hash ^= hash >> 32;
+        return hash;
+    }
+};
+
+class Sha256 {
+public:
+    uint32_t state[8];
+    uint8_t pending[64];
+    size_t pendingSize;
+    uint64_t total;
+
+    Sha256() {
+        const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        memcpy(state, initial, sizeof(state));
+        pendingSize = 0;
+        total = 0;
+    }
+
+    static uint32_t rotateRight(uint32_t value, int bits) {
+        return (value >> bits) | (value << (32 - bits));
+    }
+
+    void block(const uint8_t* data) {
+        static const uint32_t K[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t) data[i * 4] << 24 | (uint32_t) data[i * 4 + 1] << 16 | (uint32_t) data[i * 4 + 2] << 8 | data[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotateRight(w[i - 15], 7) ^ rotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotateRight(w[i - 2], 17) ^ rotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+
+    void update(const uint8_t* data, size_t size) {
+        total += size;
+        if (pendingSize) {
+            size_t taken = min(size, 64 - pendingSize);
+            memcpy(pending + pendingSize, data, taken);
+            pendingSize += taken;
+            data += taken;
+            size -= taken;
+            if (pendingSize < 64) {
+                return;
+            }
+            block(pending);
+            pendingSize = 0;
+        }
+        for (; size >= 64; data += 64, size -= 64) {
+            block(data);
+        }
+        memcpy(pending, data, size);
+        pendingSize = size;
+    }
+
+    string digest() {
+        uint64_t bits = total * 8;
+        uint8_t padding[72] = {0x80};
+        size_t padSize = (pendingSize < 56 ? 56 : 120) - pendingSize;
+        for (int i = 0; i < 8; i++) {
+            padding[padSize + i] = bits >> (56 - i * 8);
+        }
+        update(padding, padSize + 8);
+        char hex[65];
+        for (int i = 0; i < 8; i++) {
+            snprintf(hex + i * 8, 9, "%08x", state[i]);
+        }
+        return string(hex, 64);
+    }
+};
+
+// Hashes one file, reading its chain in runs of consecutive clusters of up to HASH_CHUNK_BYTES.
+bool hashFile(HashedFile& file, uint8_t* buffer, bool sha256) {
+    Xxh64 fast;
+    Sha256 secure;
+    vector<unsigned>& chain = *(file.node->clusterChain);
+    uint64_t remaining = file.node->fileSize;
+    size_t runClusters = max((size_t) 1, HASH_CHUNK_BYTES / VOLUME->clusterSize);
+    bool success = true;
+    for (size_t first = 0; first < chain.size() && remaining > 0;) {
+        size_t count = 1;
+        while (first + count < chain.size() && count < runClusters && chain[first + count] == chain[first + count - 1] + 1) {
+            count++;
+        }
+        size_t size = count * VOLUME->clusterSize;
+        success = diskRead(clusterOffset(chain[first]), buffer, size) && success;
+        size_t used = min((uint64_t) size, remaining);
+        if (sha256) {
+            secure.update(buffer, used);
+        } else {
+            fast.update(buffer, used);
+        }
+        remaining -= used;
+        first += count;
+    }
+    if (sha256) {
+        file.digest = secure.digest();
+    } else {
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) fast.digest());
+        file.digest = hex;
+    }
+    return success && remaining == 0;
+}
+
+// Hashes files on worker threads. Each worker has its own aligned buffer and reads with pread only.
+void hashFiles(vector<HashedFile>& files, bool sha256) {
+    // Pending metadata does not cover file contents, but the image must match what the tree says
+    VOLUME->journal->commit();
+    Volume* volume = VOLUME;
+    atomic<size_t> next(0);
+    auto worker = [&]() {
+        VOLUME = volume;
+        size_t bufferSize = BufferPool::roundSize(max((size_t) VOLUME->clusterSize, HASH_CHUNK_BYTES / VOLUME->clusterSize * VOLUME->clusterSize));
+        void* buffer = nullptr;
+        if (posix_memalign(&buffer, DIRECT_ALIGN, bufferSize) != 0) {
+            return;
+        }
+        for (size_t i = next++; i < files.size(); i = next++) {
+            files[i].readable = hashFile(files[i], (uint8_t*) buffer, sha256);
+        }
+        free(buffer);
+    };
+    unsigned workers = max(1u, min(thread::hardware_concurrency(), (unsigned) files.size()));
+    vector<thread> threads;
+    for (unsigned i = 1; i < workers; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+FileNode* searchForParent(FileNode* currentDir, const string& currentPath, const vector<string>& directories) {
+    string folderName = directories[directories.size() - 1];
+    FileNode* parentDirectory;
+    bool parentContainsFolder = false;
+    if (directories.size() > 1) {
+        string parentPath = directories[0];
+        for (size_t i = 1; i < directories.size() - 1; i++) {
+            if (parentPath != "/") {
+                parentPath.push_back('/');
+            }
+            parentPath += directories[i];
+        }
+        parentDirectory = resolvePath(currentDir, currentPath, parentPath);
+    } else {
+        parentDirectory = currentDir;
+    }
+    if (parentDirectory == nullptr) {
+        return nullptr;
+    }
+    for (auto& child : parentDirectory->children) {
+        if (child->name == folderName) {
+            parentContainsFolder = true;
+            break;
+        }
+    }
+    if (parentContainsFolder) {
+        return nullptr;
+    }
+    return parentDirectory;
+}
+
+// The entries naming a node in its directory: the LFN entries in on-disk order followed by
+// shortEntry, whose 8.3 name is set to ~order. The LFN checksum is taken over that name.
+vector<FatFileEntry> buildEntries(const string& name, int order, FatFileEntry& shortEntry) {
+    int numLfnEntries = ceil(name.size() / 13.0);
+    string digits = to_string(order);
+    memset(shortEntry.msdos.filename, ' ', 8);
+    memset(shortEntry.msdos.extension, ' ', 3);
+    shortEntry.msdos.filename[0] = 0x7E;
+    memcpy(shortEntry.msdos.filename + 1, digits.data(), min(digits.size(), (size_t) 7));
+    uint8_t checksum = lfn_checksum((char*) shortEntry.msdos.filename);
+    vector<FatFileEntry> entries(numLfnEntries + 1);
+    for (int k = 0; k < numLfnEntries; k++) {
+        FatFileLFN& lfn = entries[numLfnEntries - 1 - k].lfn;
+        lfn.sequence_number = k == numLfnEntries - 1 ? 0x40 + numLfnEntries : k + 1;
+        lfn.attributes = 0x0F;
+        lfn.reserved = 0x00;
+        lfn.checksum = checksum;
+        lfn.firstCluster = 0x0000;
+        uint16_t characters[13];
+        for (int j = 0; j < 13; j++) {
+            size_t position = k * 13 + j;
+            // The name is terminated by a null and the rest of the last entry is padding
+            characters[j] = position < name.size() ? name[position] : (position == name.size() ? 0x00 : 0xFF);
+        }
+        memcpy(lfn.name1, characters, sizeof(lfn.name1));
+        memcpy(lfn.name2, characters + 5, sizeof(lfn.name2));
+        memcpy(lfn.name3, characters + 11, sizeof(lfn.name3));
+    }
+    entries[numLfnEntries] = shortEntry;
+    return entries;
+}
+
+FileNode* createChild(FileNode* parentDirectory, string name, enum nodeType type) {
+    int numLfnEntries = ceil(name.size() / 13.0);
+    FileNode* newDirNode = new FileNode;
+    newDirNode->name = name;
+    newDirNode->order = parentDirectory->getMaxOrder() + 1;
+    newDirNode->parentRef = parentDirectory;
+    newDirNode->type = type;
+    newDirNode->clusterChain = new vector<unsigned>;
+    vector<uint64_t> availableAddresses = getAvailableAddresses(parentDirectory, numLfnEntries + 1);
+    if (availableAddresses.size() != numLfnEntries + 1) {
+        return nullptr;
+    }
+    if (type == _FOLDER && reserveNewCluster(newDirNode, 2) == false) {
+        return nullptr;
+    }
+    FatFileEntry* msdos = new FatFileEntry();
+    msdos->msdos.fileSize = 0;
+    msdos->msdos.eaIndex = (newDirNode->firstClusterIndex & 0xFFFF0000) >> 16;
+    msdos->msdos.firstCluster = newDirNode->firstClusterIndex & 0x0000FFFF;
+    msdos->msdos.attributes = type == _FOLDER ? 0x10 : 0x20;
+    msdos->msdos.reserved = 0;
+
+    uint16_t creationTime = getCurrentTime();
+    uint16_t creationDate = getCurrentDate();
+    msdos->msdos.creationTimeMs = getCurrentMs();
+    msdos->msdos.creationTime = creationTime;
+    msdos->msdos.modifiedTime = creationTime;
+    msdos->msdos.creationDate = creationDate;
+    msdos->msdos.modifiedDate = creationDate;
+    newDirNode->setModifiedDate(creationDate);
+    newDirNode->setModifiedTime(creationTime);
+    newDirNode->entry = msdos;
+    vector<FatFileEntry> entries = buildEntries(name, newDirNode->order, *msdos);
+    newDirNode->checksum = entries[0].lfn.checksum;
+    for (int i = 0; i < availableAddresses.size(); i++) {
+        writeBytes(availableAddresses[i], &entries[i], sizeof(FatFileEntry));
+    }
+    if (parentDirectory->name != "/") {
+        updateTimes(parentDirectory, creationDate, creationTime);   
+    }
+    parentDirectory->children.push_back(newDirNode);
+    VOLUME->dentryCache->insert(findAbsolutePath(newDirNode), newDirNode);
+    VOLUME->nameIndex->add(newDirNode);
+    addUsage(parentDirectory, 0, 0, 1);
+    if (type == _FOLDER) {
+        bool created = createDotEntries(newDirNode);
+        if (!created) return nullptr;
+    }
+    return newDirNode;
+}
+
+// Moves source with everything below it into destinationFolder. Fails for the root, dot entries, a move into itself and name clashes.
+bool moveNode(FileNode* source, FileNode* destinationFolder) {
+    if (source->type == _DOT || source->name == "/") {
+        return false;
+    }
+    FileNode* srcParent = source->parentRef;
+    if (srcParent == destinationFolder || isChild(destinationFolder, source)) {
+        return false;
+    }
+    bool parentContains = false;
+    for (auto& child: destinationFolder->children) {
+        if (child->name == source->name) {
+            parentContains = true;
+            break;
+        }
+    }
+    if (parentContains) {
+        return false;
+    }
+    // Take FatFileEntries from source parent directory and set spaces to ZERO_ENTRY
+    unsigned numEntries = ceil(source->name.size() / 13.0) + 1;
+    vector<FatFileEntry> sourceEntries;
+    bool insideSourceEntries = false;
+    bool completed = false;
+    int j = 0;
+    unsigned lastCluster = -1;
+    int lastClusterIndex = -1;
+    for (auto& cluster : *(srcParent->clusterChain)) {
+        for (int i = 0; i < VOLUME->clusterSize / sizeof(FatFileEntry) && !completed; i++) {
+            uint64_t offset = clusterOffset(cluster) + i * sizeof(FatFileEntry);
+            FatFileEntry* buffer = new FatFileEntry;
+            readBytes(offset, buffer, sizeof(FatFileEntry));
+            if (insideSourceEntries) {
+                sourceEntries.push_back(*buffer);
+                writeBytes(offset, ZERO_ENTRY, sizeof(FatFileEntry));
+                if (sourceEntries.size() == numEntries) {
+                    lastClusterIndex = j;
+                    lastCluster = cluster;
+                    completed = true;
+                }
+            } else if (buffer->msdos.attributes != 0xE5 && buffer->lfn.checksum == source->checksum) {
+                sourceEntries.push_back(*buffer);
+                writeBytes(offset, ZERO_ENTRY, sizeof(FatFileEntry));
+                insideSourceEntries = true;
+            }
+            delete buffer;
+        }
+        if (completed) {
+            break;
+        }
+        j++;
+    }
+    if (lastCluster == -1) {
+        return false;
+    }
+    /*
+     If parent cluster became empty, deallocate it 
+    bool fullEmpty = true;
+    for (int i = 0; i < VOLUME->clusterSize / sizeof(FatFileEntry); i++) {
+        FatFileEntry* buffer = new FatFileEntry;
+        unsigned long offset = VOLUME->dataStart + (lastCluster - 2) * VOLUME->clusterSize + i * sizeof(FatFileEntry);
+        fseek(fp, offset, SEEK_SET);
+        fread(buffer, sizeof(FatFileEntry), 1, fp);
+        if (buffer->msdos.attributes != 0) {
+            fullEmpty = false;
+            break;
+        }
+    }
+    if (fullEmpty && srcParent->clusterChain->size() > 1 && srcParent->name != "/") { // full empty and can be shrinked
+        updateParent(srcParent, lastClusterIndex);
+    }
+    */
+    uint16_t currDate = getCurrentDate();
+    uint16_t currTime = getCurrentTime();
+    if (srcParent->name != "/") {
+        updateTimes(srcParent, currDate, currTime);
+    }
+    // Update source parent directory FileNode
+    addUsage(srcParent, -(long long) source->totalBytes, -(long long) source->totalClusters, -(long long) source->totalEntries);
+    for (int i = 0; i < srcParent->children.size(); i++) {
+        if (srcParent->children[i]->name == source->name) {
+            srcParent->children.erase(srcParent->children.begin() + i);
+            break;
+        }
+    }
+    // Update source FatFileEntries
+
+    // Update source/..
+    if (source->type == _FOLDER) {
+        FatFileEntry* twoDot = new FatFileEntry;
+        unsigned firstCluster = source->clusterChain->at(0);
+        uint64_t offset = clusterOffset(firstCluster) + sizeof(FatFileEntry);
+        readBytes(offset, twoDot, sizeof(FatFileEntry));
+        unsigned parentFirstCluster = destinationFolder->clusterChain->at(0);
+        twoDot->msdos.eaIndex = (parentFirstCluster & 0xFFFF0000) >> 16;
+        twoDot->msdos.firstCluster = (parentFirstCluster & 0x0000FFFF);
+        writeBytes(offset, twoDot, sizeof(FatFileEntry));
+        delete twoDot;
+    }
+    // Update source FileNode
+    VOLUME->dentryCache->invalidate(findAbsolutePath(source));
+    source->parentRef = destinationFolder;
+    source->order = destinationFolder->getMaxOrder() + 1;
+    if (source->type == _FOLDER) {
+        for (auto& child : source->children) {
+            if (child->name == "..") {
+                child->realNode = destinationFolder;
+                child->realName = destinationFolder->name;
+                break;
+            }
+        }
+    }
+    uint8_t* new83Name = new uint8_t[8];
+    new83Name[0] = 0x7E;
+    string orderStr = to_string(source->order);
+    for (int i = 0; i < orderStr.size(); i++) {
+        new83Name[i + 1] = orderStr[i];
+    }
+    for (int i = orderStr.size() + 1; i < 8; i++) {
+        new83Name[i] = ' ';
+    }
+    for (int i = 0; i < 8; i++) {
+        sourceEntries[sourceEntries.size() - 1].msdos.filename[i] = new83Name[i];
+    }
+    char* new83Char = new char[11];
+    for (int i = 0; i < 8; i++) {
+        new83Char[i] = new83Name[i];
+    }
+    for (int i = 0; i < 3; i++) {
+        new83Char[i + 8] = 0x20; 
+    }
+    uint8_t checksum = lfn_checksum(new83Char);
+    for (int i = 0; i < sourceEntries.size() - 1; i++) {
+        sourceEntries[i].lfn.checksum = checksum;
+    }
+    delete[] new83Char;
+    // Place FatFileEntries under destination
+    vector<uint64_t> addresses = getAvailableAddresses(destinationFolder, numEntries);
+    for (int i = 0; i < addresses.size(); i++) {
+        writeBytes(addresses[i], &(sourceEntries[i]), sizeof(FatFileEntry));
+    }
+    if (destinationFolder->name != "/") {
+        updateTimes(destinationFolder, currDate, currTime);
+    }
+    // Update destination parent directory FileNode
+    destinationFolder->children.push_back(source);
+    addUsage(destinationFolder, source->totalBytes, source->totalClusters, source->totalEntries);
+    return true;
+}
+
+/*
+ Copies. cp plans the whole subtree before writing anything. The tree gives the size of every
+ file and the entries of every directory, so all clusters are allocated at once in as few
+ contiguous runs as possible. File data is copied between offsets of the image with
+ copy_file_range, the FAT chains are written one FAT sector at a time, and every new
+ directory is written with all of its entries in one pass.
+*/
+// Largest amount of data moved by one copy request.
+const size_t COPY_CHUNK_BYTES = 8 * 1024 * 1024;
+
+// Links every chain in the FAT. Each touched FAT sector is read once and written once per FAT.
+void writeChains(const vector<vector<unsigned>*>& chains) {
+    map<uint64_t, vector<uint8_t>> sectors;
+    auto link = [&](unsigned cluster, uint32_t value) {
+        uint64_t sector = (uint64_t) cluster * 4 / VOLUME->sectorSize;
+        auto it = sectors.find(sector);
+        if (it == sectors.end()) {
+            vector<uint8_t> contents(VOLUME->sectorSize);
+            readBytes(VOLUME->fatStart + sector * VOLUME->sectorSize, contents.data(), VOLUME->sectorSize);
+            it = sectors.emplace(sector, move(contents)).first;
+        }
+        memcpy(it->second.data() + (uint64_t) cluster * 4 % VOLUME->sectorSize, &value, 4);
+    };
+    for (auto& chain : chains) {
+        for (size_t i = 0; i < chain->size(); i++) {
+            link(chain->at(i), i + 1 < chain->size() ? chain->at(i + 1) : VOLUME->eocValue);
+        }
+    }
+    for (unsigned fat = 0; fat < VOLUME->numFats; fat++) {
+        vector<uint8_t> run;
+        uint64_t runStart = 0;
+        for (auto it = sectors.begin(); it != sectors.end(); it++) {
+            if (run.empty()) {
+                runStart = it->first;
+            }
+            run.insert(run.end(), it->second.begin(), it->second.end());
+            auto next = std::next(it);
+            if (next == sectors.end() || next->first != it->first + 1) {
+                writeBytes(VOLUME->fatStart + (uint64_t) fat * VOLUME->fatSize + runStart * VOLUME->sectorSize, run.data(), run.size());
+                run.clear();
+            }
+        }
+    }
+}
+
+// Copies a range of the image to another offset of it. File data bypasses the journal, like in
+// ordered mode: the clusters are free until the metadata pointing at them is written.
+bool copyRange(uint64_t from, uint64_t to, size_t size) {
+    VOLUME->blockCache->discard(to, size);
+    forgetHole(to, size);
+    while (size > 0 && VOLUME->overlay == nullptr) {
+        loff_t in = from;
+        loff_t out = to;
+        ssize_t copied = copy_file_range(VOLUME->bufferedFd, &in, VOLUME->bufferedFd, &out, size, 0);
+        if (copied <= 0) {
+            break;
+        }
+        from += copied;
+        to += copied;
+        size -= copied;
+    }
+    if (size == 0) {
+        return true;
+    }
+    // Not supported by this kernel or file system, or going to an overlay: copy through a large buffer instead
+    PooledBuffer buffer(min(size, COPY_CHUNK_BYTES));
+    bool success = true;
+    for (size_t done = 0; done < size; done += buffer.size) {
+        size_t length = min(buffer.size, size - done);
+        success = diskRead(from + done, buffer.data, length) && diskWrite(to + done, buffer.data, length) && success;
+    }
+    return success;
+}
+
+// Copies the first count clusters of a chain to another chain, merging runs consecutive in both.
+bool copyClusters(const vector<unsigned>& from, const vector<unsigned>& to, size_t count) {
+    size_t chunkClusters = max((size_t) 1, COPY_CHUNK_BYTES / VOLUME->clusterSize);
+    bool success = true;
+    for (size_t first = 0; first < count;) {
+        size_t run = 1;
+        while (first + run < count && run < chunkClusters && from[first + run] == from[first + run - 1] + 1
+            && to[first + run] == to[first + run - 1] + 1) {
+            run++;
+        }
+        success = copyRange(clusterOffset(from[first]), clusterOffset(to[first]), run * VOLUME->clusterSize) && success;
+        first += run;
+    }
+    return success;
+}
+
+// Adds a chain to the sorted list of clusters handed out but not linked yet. Chains found further up only append.
+void addReserved(vector<unsigned>& reserved, const vector<unsigned>& chain) {
+    size_t middle = reserved.size();
+    reserved.insert(reserved.end(), chain.begin(), chain.end());
+    sort(reserved.begin() + middle, reserved.end());
+    if (middle > 0 && middle < reserved.size() && reserved[middle - 1] > reserved[middle]) {
+        inplace_merge(reserved.begin(), reserved.begin() + middle, reserved.end());
+    }
+}
+
+// Writes data holding every cluster of a chain back to back, one write per run of consecutive clusters.
+void writeChainData(const vector<unsigned>& chain, const uint8_t* data) {
+    for (size_t first = 0; first < chain.size();) {
+        size_t run = 1;
+        while (first + run < chain.size() && chain[first + run] == chain[first + run - 1] + 1) {
+            run++;
+        }
+        writeBytes(clusterOffset(chain[first]), data + first * VOLUME->clusterSize, run * VOLUME->clusterSize);
+        first += run;
+    }
+}
+
+void setDotEntry(FatFileEntry& entry, bool twoDots, unsigned cluster, uint16_t date, uint16_t time) {
+    memset(&entry, 0, sizeof(FatFileEntry));
+    memset(entry.msdos.filename, ' ', 8);
+    memset(entry.msdos.extension, ' ', 3);
+    entry.msdos.filename[0] = '.';
+    if (twoDots) {
+        entry.msdos.filename[1] = '.';
+    }
+    entry.msdos.attributes = 0x10;
+    entry.msdos.creationTimeMs = getCurrentMs();
+    entry.msdos.creationDate = date;
+    entry.msdos.creationTime = time;
+    entry.msdos.modifiedDate = date;
+    entry.msdos.modifiedTime = time;
+    entry.msdos.eaIndex = (cluster & 0xFFFF0000) >> 16;
+    entry.msdos.firstCluster = cluster & 0x0000FFFF;
+}
+
+class CopyItem {
+public:
+    FileNode* source;
+    FileNode* copy;
+    int parent; // Index of the copied parent directory, -1 for the top of the copy
+    unsigned clusters;
+    vector<FatFileEntry> entries; // Entries naming the copy in its directory
+    vector<unsigned> chain;
+};
+
+// Copies source with everything below it into destinationFolder. Returns the copy, or nullptr when it is not allowed or does not fit.
+FileNode* copyTree(FileNode* source, FileNode* destinationFolder) {
+    if (source->type == _DOT || source->name == "/" || destinationFolder->type != _FOLDER
+        || destinationFolder == source || isChild(destinationFolder, source)) {
+        return nullptr;
+    }
+    for (auto& child : destinationFolder->children) {
+        if (child->name == source->name) {
+            return nullptr;
+        }
+    }
+    vector<CopyItem> items = {{source, nullptr, -1, 0, {}, {}}};
+    for (size_t i = 0; i < items.size(); i++) {
+        if (items[i].source->type != _FOLDER) {
+            continue;
+        }
+        for (auto& child : items[i].source->children) {
+            if (child->type != _DOT) {
+                items.push_back({child, nullptr, (int) i, 0, {}, {}});
+            }
+        }
+    }
+    // Every directory holds its dot entries and the entries of its children
+    vector<unsigned> directoryEntries(items.size(), 2);
+    for (auto& item : items) {
+        if (item.parent >= 0) {
+            directoryEntries[item.parent] += ceil(item.source->name.size() / 13.0) + 1;
+        }
+    }
+    unsigned entriesPerCluster = VOLUME->clusterSize / sizeof(FatFileEntry);
+    uint64_t totalClusters = 0;
+    for (size_t i = 0; i < items.size(); i++) {
+        FileNode* node = items[i].source;
+        if (node->type == _FOLDER) {
+            items[i].clusters = (directoryEntries[i] + entriesPerCluster - 1) / entriesPerCluster;
+        } else {
+            items[i].clusters = ((uint64_t) node->fileSize + VOLUME->clusterSize - 1) / VOLUME->clusterSize;
+        }
+        totalClusters += items[i].clusters;
+    }
+    if (totalClusters > VOLUME->freeClusters) {
+        return nullptr;
+    }
+    unsigned topEntries = ceil(source->name.size() / 13.0) + 1;
+    vector<uint64_t> addresses = getAvailableAddresses(destinationFolder, topEntries);
+    if (addresses.size() != topEntries) {
+        return nullptr;
+    }
+    // Directories and small files are packed after the destination, large files go to their own region.
+    // Items are in breadth first order, so clusters of siblings stay together.
+    bool separateLarge = ALLOCATION_POLICY == _NEAR_GOAL;
+    uint64_t smallClusters = 0;
+    for (auto& item : items) {
+        if (!separateLarge || item.source->type == _FOLDER || item.source->fileSize < LARGE_FILE_BYTES) {
+            smallClusters += item.clusters;
+        }
+    }
+    vector<unsigned> clusters = allocateClusters(smallClusters, chainGoal(destinationFolder->clusterChain));
+    if (clusters.size() != smallClusters) {
+        return nullptr;
+    }
+    vector<unsigned> reserved(clusters);
+    sort(reserved.begin(), reserved.end());
+    size_t nextCluster = 0;
+    for (auto& item : items) {
+        if (!separateLarge || item.source->type == _FOLDER || item.source->fileSize < LARGE_FILE_BYTES) {
+            item.chain.assign(clusters.begin() + nextCluster, clusters.begin() + nextCluster + item.clusters);
+            nextCluster += item.clusters;
+            continue;
+        }
+        item.chain = allocateClusters(item.clusters, largeFileGoal(), reserved);
+        if (item.chain.size() != item.clusters) {
+            return nullptr;
+        }
+        addReserved(reserved, item.chain);
+    }
+    // Nodes of the copy
+    uint16_t date = getCurrentDate();
+    uint16_t time = getCurrentTime();
+    vector<vector<unsigned>*> chains;
+    for (auto& item : items) {
+        FileNode* parent = item.parent >= 0 ? items[item.parent].copy : destinationFolder;
+        FileNode* copy = new FileNode;
+        copy->name = item.source->name;
+        copy->type = item.source->type;
+        copy->parentRef = parent;
+        copy->order = parent->getMaxOrder() + 1;
+        copy->fileSize = item.source->fileSize;
+        copy->clusterChain = new vector<unsigned>(item.chain);
+        copy->firstClusterIndex = copy->clusterChain->size() ? copy->clusterChain->at(0) : 0;
+        copy->entry = new FatFileEntry(*item.source->entry);
+        copy->entry->msdos.eaIndex = (copy->firstClusterIndex & 0xFFFF0000) >> 16;
+        copy->entry->msdos.firstCluster = copy->firstClusterIndex & 0x0000FFFF;
+        copy->entry->msdos.creationTimeMs = getCurrentMs();
+        copy->entry->msdos.creationDate = date;
+        copy->entry->msdos.creationTime = time;
+        copy->entry->msdos.modifiedDate = date;
+        copy->entry->msdos.modifiedTime = time;
+        copy->setModifiedDate(date);
+        copy->setModifiedTime(time);
+        item.entries = buildEntries(copy->name, copy->order, *copy->entry);
+        copy->checksum = item.entries[0].lfn.checksum;
+        if (copy->type == _FOLDER) {
+            FileNode* dot = new FileNode(*copy);
+            dot->name = ".";
+            dot->realName = copy->name;
+            dot->realNode = copy;
+            dot->type = _DOT;
+            FileNode* twoDot = new FileNode(*parent);
+            twoDot->name = "..";
+            twoDot->realName = parent->name;
+            twoDot->realNode = parent;
+            twoDot->type = _DOT;
+            copy->children.push_back(dot);
+            copy->children.push_back(twoDot);
+        }
+        if (item.parent >= 0) {
+            parent->children.push_back(copy);
+        }
+        item.copy = copy;
+        chains.push_back(copy->clusterChain);
+    }
+    // Data first, then the metadata that makes it reachable
+    bool success = true;
+    for (auto& item : items) {
+        if (item.copy->type == _FILE) {
+            success = copyClusters(*item.source->clusterChain, *item.copy->clusterChain, min((size_t) item.clusters, item.source->clusterChain->size())) && success;
+        }
+    }
+    writeChains(chains);
+    vector<uint8_t> contents;
+    for (size_t i = 0; i < items.size(); i++) {
+        FileNode* directory = items[i].copy;
+        if (directory->type != _FOLDER) {
+            continue;
+        }
+        contents.assign((size_t) items[i].clusters * VOLUME->clusterSize, 0);
+        FatFileEntry* slots = (FatFileEntry*) contents.data();
+        FileNode* parent = directory->parentRef;
+        setDotEntry(slots[0], false, directory->firstClusterIndex, date, time);
+        setDotEntry(slots[1], true, parent == VOLUME->root ? 0 : parent->firstClusterIndex, date, time);
+        size_t slot = 2;
+        for (size_t j = i + 1; j < items.size(); j++) {
+            if (items[j].parent == (int) i) {
+                memcpy(slots + slot, items[j].entries.data(), items[j].entries.size() * sizeof(FatFileEntry));
+                slot += items[j].entries.size();
+            }
+        }
+        writeChainData(*directory->clusterChain, contents.data());
+    }
+    FileNode* top = items[0].copy;
+    for (size_t i = 0; i < addresses.size(); i++) {
+        writeBytes(addresses[i], &items[0].entries[i], sizeof(FatFileEntry));
+    }
+    VOLUME->freeClusters -= totalClusters;
+    writeBytes(VOLUME->fsInfoStart + 488, &VOLUME->freeClusters, 4);
+    if (destinationFolder->name != "/") {
+        updateTimes(destinationFolder, date, time);
+    }
+    destinationFolder->children.push_back(top);
+    for (auto& item : items) {
+        VOLUME->nameIndex->add(item.copy);
+    }
+    computeUsage(top);
+    addUsage(destinationFolder, top->totalBytes, top->totalClusters, top->totalEntries);
+    if (!success) {
+        cerr << "cp: " << source->name << ": read error" << endl;
+    }
+    return top;
+}
+
+/*
+ Bulk creation. A TreeBuilder collects new nodes below a destination directory in memory and
+ writes them out at once in finish: the clusters of every new directory in one allocation,
+ every chain linked with one writeChains, each new directory written whole with its dot
+ entries, and the entries added to a directory that was already there with one
+ getAvailableAddresses. Nodes are found by their path below the destination, "" being the
+ destination itself. tar-in and mktree build with it.
+*/
+// Times outside what FAT can hold are clamped to 1980 and 2107.
+void toFatTimestamp(time_t timestamp, uint16_t& date, uint16_t& time) {
+    tm local;
+    localtime_r(&timestamp, &local);
+    if (local.tm_year < 80) {
+        date = 1;
+        time = 0;
+        return;
+    }
+    date = (min(local.tm_year - 80, 127) << 9) + (local.tm_mon << 5) + local.tm_mday;
+    time = (local.tm_hour << 11) + (local.tm_min << 5) + local.tm_sec / 2;
+}
+
+// Splits a path into the components below the destination of a build. Fails for ".." and for
+// names the shell could not read back: longer than an LFN or with spaces, control or non-ASCII characters.
+bool pathComponents(const string& path, vector<string>& components) {
+    components.clear();
+    for (auto& component : extractDirectories(path)) {
+        if (component == "/" || component == "." || component.empty()) {
+            continue;
+        }
+        if (component == ".." || component.size() > 255) {
+            return false;
+        }
+        for (auto& character : component) {
+            if (character <= ' ' || character >= 127) {
+                return false;
+            }
+        }
+        components.push_back(component);
+    }
+    return true;
+}
+
+class TreeBuilder {
+public:
+    FileNode* destination;
+    unordered_map<string, FileNode*> nodes;
+    unordered_map<FileNode*, size_t> firstAdded; // Directories whose children are in nodes, and where the added children start
+    unordered_map<FileNode*, int> nextOrder;
+    unordered_map<FileNode*, unsigned> addedEntries;
+    vector<FileNode*> touched; // Directories that were there before and got children
+    vector<FileNode*> created; // Parents before children
+    vector<unsigned> reserved; // Clusters of the new files, linked in the FAT by finish
+    uint64_t directoryClusters; // Clusters the directories may need for the added entries
+    unsigned smallGoal;
+    unsigned largeGoal;
+    TreeBuilder(FileNode* destination) : destination(destination), directoryClusters(0) {
+        nodes[""] = destination;
+        smallGoal = chainGoal(destination->clusterChain);
+        largeGoal = largeFileGoal();
+    }
+
+    static string join(const string& directoryPath, const string& name) {
+        return directoryPath.size() ? directoryPath + "/" + name : name;
+    }
+
+    // A new directory also holds its dot entries. For one that was there before no free slot is assumed.
+    uint64_t clustersFor(FileNode* directory) {
+        unsigned entriesPerCluster = VOLUME->clusterSize / sizeof(FatFileEntry);
+        unsigned entries = addedEntries[directory] + (directory->clusterChain->empty() ? 2 : 0);
+        return (entries + entriesPerCluster - 1) / entriesPerCluster;
+    }
+
+    bool fits(uint64_t clusters) {
+        return reserved.size() + directoryClusters + clusters <= VOLUME->freeClusters;
+    }
+
+    void index(FileNode* directory, const string& path) {
+        if (firstAdded.count(directory)) {
+            return;
+        }
+        int maxOrder = 0;
+        for (auto& child : directory->children) {
+            if (child->type != _DOT) {
+                nodes[join(path, child->name)] = child;
+                maxOrder = max(maxOrder, child->order);
+            }
+        }
+        firstAdded[directory] = directory->children.size();
+        nextOrder[directory] = maxOrder + 1;
+    }
+
+    FileNode* add(FileNode* parent, const string& path, const string& name, enum nodeType type, time_t mtime) {
+        FileNode* node = new FileNode;
+        node->name = name;
+        node->type = type;
+        node->parentRef = parent;
+        node->order = nextOrder[parent]++;
+        node->clusterChain = new vector<unsigned>;
+        uint16_t modifiedDate, modifiedTime;
+        toFatTimestamp(mtime, modifiedDate, modifiedTime);
+        node->entry = new FatFileEntry();
+        node->entry->msdos.attributes = type == _FOLDER ? 0x10 : 0x20;
+        node->entry->msdos.creationTimeMs = getCurrentMs();
+        node->entry->msdos.creationDate = getCurrentDate();
+        node->entry->msdos.creationTime = getCurrentTime();
+        node->entry->msdos.modifiedDate = modifiedDate;
+        node->entry->msdos.modifiedTime = modifiedTime;
+        node->setModifiedDate(modifiedDate);
+        node->setModifiedTime(modifiedTime);
+        if (!parent->clusterChain->empty() && addedEntries[parent] == 0) {
+            touched.push_back(parent);
+        }
+        uint64_t before = clustersFor(parent);
+        addedEntries[parent] += ceil(name.size() / 13.0) + 1;
+        directoryClusters += clustersFor(parent) - before;
+        if (type == _FOLDER) {
+            firstAdded[node] = 0;
+            nextOrder[node] = 1;
+            directoryClusters += clustersFor(node);
+        }
+        parent->children.push_back(node);
+        nodes[path] = node;
+        created.push_back(node);
+        return node;
+    }
+
+    // The directory at the first count components, creating the ones that are missing. nullptr when a file is in the way.
+    FileNode* directory(const vector<string>& components, size_t count, string& path) {
+        path.clear();
+        for (size_t i = 0; i < count; i++) {
+            path = join(path, components[i]);
+        }
+        // Members usually follow their directory, which is then known already
+        auto known = nodes.find(path);
+        if (known != nodes.end() && known->second->type == _FOLDER && firstAdded.count(known->second)) {
+            return known->second;
+        }
+        FileNode* current = destination;
+        path.clear();
+        for (size_t i = 0; i < count; i++) {
+            index(current, path);
+            path = join(path, components[i]);
+            auto it = nodes.find(path);
+            FileNode* next = it != nodes.end() ? it->second : add(current, path, components[i], _FOLDER, time(0));
+            if (next->type != _FOLDER) {
+                return nullptr;
+            }
+            current = next;
+        }
+        index(current, path);
+        return current;
+    }
+
+    // The entries naming a new node, with its first cluster and size filled in.
+    vector<FatFileEntry> namingEntries(FileNode* node) {
+        node->entry->msdos.eaIndex = (node->firstClusterIndex & 0xFFFF0000) >> 16;
+        node->entry->msdos.firstCluster = node->firstClusterIndex & 0x0000FFFF;
+        node->entry->msdos.fileSize = node->type == _FILE ? node->fileSize : 0;
+        vector<FatFileEntry> entries = buildEntries(node->name, node->order, *node->entry);
+        node->checksum = entries[0].lfn.checksum;
+        return entries;
+    }
+
+    // Allocates the new directories, links every new chain and writes the directory entries. Returns false
+    // when children had to be dropped because their directory could not grow after all.
+    bool finish() {
+        if (created.empty()) {
+            return true;
+        }
+        uint16_t date = getCurrentDate();
+        uint16_t time = getCurrentTime();
+        vector<FileNode*> directories;
+        uint64_t total = 0;
+        for (auto& node : created) {
+            if (node->type == _FOLDER) {
+                directories.push_back(node);
+                total += clustersFor(node);
+            }
+        }
+        vector<unsigned> clusters = allocateClusters(total, smallGoal, reserved);
+        if (clusters.size() != total) {
+            for (auto& directory : touched) {
+                directory->children.resize(firstAdded[directory]);
+            }
+            return false;
+        }
+        size_t next = 0;
+        for (auto& directory : directories) {
+            size_t count = clustersFor(directory);
+            directory->clusterChain->assign(clusters.begin() + next, clusters.begin() + next + count);
+            directory->firstClusterIndex = clusters[next];
+            next += count;
+            FileNode* dot = new FileNode(*directory);
+            dot->name = ".";
+            dot->realName = directory->name;
+            dot->realNode = directory;
+            dot->type = _DOT;
+            FileNode* twoDot = new FileNode(*directory->parentRef);
+            twoDot->name = "..";
+            twoDot->realName = directory->parentRef->name;
+            twoDot->realNode = directory->parentRef;
+            twoDot->type = _DOT;
+            directory->children.insert(directory->children.begin(), {dot, twoDot});
+        }
+        // Data is in place, now the metadata that makes it reachable
+        vector<vector<unsigned>*> chains;
+        uint64_t linked = 0;
+        for (auto& node : created) {
+            if (node->clusterChain->size()) {
+                chains.push_back(node->clusterChain);
+                linked += node->clusterChain->size();
+            }
+        }
+        writeChains(chains);
+        VOLUME->freeClusters -= linked;
+        writeBytes(VOLUME->fsInfoStart + 488, &VOLUME->freeClusters, 4);
+        vector<uint8_t> contents;
+        for (auto& directory : directories) {
+            contents.assign(directory->clusterChain->size() * VOLUME->clusterSize, 0);
+            FatFileEntry* slots = (FatFileEntry*) contents.data();
+            FileNode* parent = directory->parentRef;
+            setDotEntry(slots[0], false, directory->firstClusterIndex, date, time);
+            setDotEntry(slots[1], true, parent == VOLUME->root ? 0 : parent->firstClusterIndex, date, time);
+            size_t slot = 2;
+            for (auto& child : directory->children) {
+                if (child->type != _DOT) {
+                    vector<FatFileEntry> entries = namingEntries(child);
+                    memcpy(slots + slot, entries.data(), entries.size() * sizeof(FatFileEntry));
+                    slot += entries.size();
+                }
+            }
+            writeChainData(*directory->clusterChain, contents.data());
+        }
+        bool success = true;
+        for (auto& directory : touched) {
+            size_t first = firstAdded[directory];
+            vector<FatFileEntry> entries;
+            for (size_t i = first; i < directory->children.size(); i++) {
+                vector<FatFileEntry> naming = namingEntries(directory->children[i]);
+                entries.insert(entries.end(), naming.begin(), naming.end());
+            }
+            vector<uint64_t> addresses = getAvailableAddresses(directory, entries.size());
+            if (addresses.size() != entries.size()) {
+                // The directory could not grow: its new children are dropped and their clusters given back
+                vector<unsigned> dropped;
+                vector<FileNode*> stack(directory->children.begin() + first, directory->children.end());
+                while (stack.size()) {
+                    FileNode* node = stack.back();
+                    stack.pop_back();
+                    dropped.insert(dropped.end(), node->clusterChain->begin(), node->clusterChain->end());
+                    for (auto& child : node->children) {
+                        if (child->type != _DOT) {
+                            stack.push_back(child);
+                        }
+                    }
+                }
+                freeClusters(dropped);
+                directory->children.resize(first);
+                success = false;
+                continue;
+            }
+            for (size_t run = 0; run < addresses.size();) {
+                size_t length = 1;
+                while (run + length < addresses.size() && addresses[run + length] == addresses[run + length - 1] + sizeof(FatFileEntry)) {
+                    length++;
+                }
+                writeBytes(addresses[run], &entries[run], length * sizeof(FatFileEntry));
+                run += length;
+            }
+            if (directory != VOLUME->root) {
+                updateTimes(directory, date, time);
+            }
+            for (size_t i = first; i < directory->children.size(); i++) {
+                FileNode* top = directory->children[i];
+                computeUsage(top);
+                addUsage(directory, top->totalBytes, top->totalClusters, top->totalEntries);
+                vector<FileNode*> stack = {top};
+                while (stack.size()) {
+                    FileNode* node = stack.back();
+                    stack.pop_back();
+                    VOLUME->nameIndex->add(node);
+                    for (auto& child : node->children) {
+                        if (child->type != _DOT) {
+                            stack.push_back(child);
+                        }
+                    }
+                }
+            }
+        }
+        return success;
+    }
+};
+
+// Creates every path of the list below base, like mkdir -p for paths ending in a slash and touch for the
+// others. Paths that exist with the same type are left alone. Returns false when not all could be created.
+bool makeTree(FileNode* base, vector<string> paths) {
+    if (base->type != _FOLDER) {
+        return false;
+    }
+    // Sorted, the paths below a directory come together and its entries are laid out in name order
+    sort(paths.begin(), paths.end());
+    TreeBuilder builder(base);
+    vector<string> components;
+    time_t now = time(0);
+    bool success = true;
+    for (auto& path : paths) {
+        bool folder = path.size() && path.back() == '/';
+        if (!pathComponents(path, components)) {
+            cerr << "mktree: " << path << ": name not allowed, skipped" << endl;
+            success = false;
+            continue;
+        }
+        if (components.empty()) {
+            continue;
+        }
+        if (!builder.fits(components.size())) {
+            cerr << "mktree: " << path << ": no space left" << endl;
+            success = false;
+            break;
+        }
+        string parentPath;
+        FileNode* parent = builder.directory(components, components.size() - 1, parentPath);
+        string nodePath = TreeBuilder::join(parentPath, components.back());
+        auto existing = builder.nodes.find(nodePath);
+        if (parent == nullptr) {
+            cerr << "mktree: " << path << ": not under a directory, skipped" << endl;
+            success = false;
+        } else if (existing != builder.nodes.end()) {
+            if ((existing->second->type == _FOLDER) != folder) {
+                cerr << "mktree: " << path << ": exists, skipped" << endl;
+                success = false;
+            }
+        } else {
+            builder.add(parent, nodePath, components.back(), folder ? _FOLDER : _FILE, now);
+        }
+    }
+    return builder.finish() && success;
+}
+
+/*
+ Tar streams. writeTar sends a subtree out as a ustar archive and readTar builds a subtree from
+ one, both going through the stream once from front to back without temporary files. Paths too
+ long for the ustar name fields travel in pax extended headers. On the way in, the header of a
+ file gives its size, so its clusters are allocated in one run before the data arrives and the
+ data is written straight into them. The nodes are collected in a TreeBuilder, so the
+ metadata is written once, after the last member.
+*/
+const size_t TAR_BLOCK_BYTES = 512;
+
+#pragma pack(push, 1)
+struct TarHeader {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+};
+#pragma pack(pop)
+
+void setOctal(char* field, size_t width, uint64_t value) {
+    snprintf(field, width, "%0*llo", (int) width - 1, (unsigned long long) value);
+}
+
+// GNU tar stores values too large for octal in base 256, flagged by the top bit of the field.
+uint64_t parseOctal(const char* field, size_t width) {
+    uint64_t value = 0;
+    if ((uint8_t) field[0] & 0x80) {
+        value = (uint8_t) field[0] & 0x7F;
+        for (size_t i = 1; i < width; i++) {
+            value = value << 8 | (uint8_t) field[i];
+        }
+        return value;
+    }
+    size_t i = 0;
+    while (i < width && field[i] == ' ') {
+        i++;
+    }
+    for (; i < width && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = value * 8 + field[i] - '0';
+    }
+    return value;
+}
+
+// Sum of the header bytes with the checksum field counted as spaces.
+unsigned tarChecksum(const TarHeader& header) {
+    const uint8_t* bytes = (const uint8_t*) &header;
+    unsigned sum = 0;
+    for (size_t i = 0; i < sizeof(TarHeader); i++) {
+        bool inChecksum = i >= offsetof(TarHeader, checksum) && i < offsetof(TarHeader, checksum) + sizeof(header.checksum);
+        sum += inChecksum ? ' ' : bytes[i];
+    }
+    return sum;
+}
+
+// FAT timestamps are in local time, with months counted from 0 as getCurrentDate writes them.
+time_t fatTimestamp(uint16_t date, uint16_t time) {
+    tm local = {};
+    local.tm_year = 80 + (date >> 9);
+    local.tm_mon = (date >> 5) & 15;
+    local.tm_mday = date & 31;
+    local.tm_hour = time >> 11;
+    local.tm_min = (time >> 5) & 63;
+    local.tm_sec = (time & 31) * 2;
+    local.tm_isdst = -1;
+    return mktime(&local);
+}
+
+void writeTarPadding(ostream& out, uint64_t size) {
+    static const char zeros[TAR_BLOCK_BYTES] = {};
+    out.write(zeros, (TAR_BLOCK_BYTES - size % TAR_BLOCK_BYTES) % TAR_BLOCK_BYTES);
+}
+
+// Writes the header of one member. A path that fits neither the name field nor the prefix and name
+// fields goes into a pax header in front of it, and the name field gets a truncated copy.
+void writeTarHeader(ostream& out, const string& path, char type, uint64_t size, time_t mtime) {
+    TarHeader header;
+    memset(&header, 0, sizeof(header));
+    bool fits = path.size() <= sizeof(header.name);
+    if (fits) {
+        memcpy(header.name, path.data(), path.size());
+    } else {
+        // The last slash the prefix can reach leaves the shortest name
+        size_t cut = path.rfind('/', min(sizeof(header.prefix), path.size() - 2));
+        if (cut != string::npos && cut > 0 && path.size() - cut - 1 <= sizeof(header.name)) {
+            memcpy(header.prefix, path.data(), cut);
+            memcpy(header.name, path.data() + cut + 1, path.size() - cut - 1);
+            fits = true;
+        }
+    }
+    if (!fits) {
+        string record = " path=" + path + "\n";
+        // The length at the front of a record counts its own digits
+        size_t length = record.size() + to_string(record.size()).size();
+        while (record.size() + to_string(length).size() != length) {
+            length = record.size() + to_string(length).size();
+        }
+        string pax = to_string(length) + record;
+        writeTarHeader(out, "PaxHeader", 'x', pax.size(), mtime);
+        out.write(pax.data(), pax.size());
+        writeTarPadding(out, pax.size());
+        memcpy(header.name, path.data(), sizeof(header.name));
+    }
+    setOctal(header.mode, sizeof(header.mode), type == '5' ? 0755 : 0644);
+    setOctal(header.uid, sizeof(header.uid), 0);
+    setOctal(header.gid, sizeof(header.gid), 0);
+    setOctal(header.size, sizeof(header.size), size);
+    setOctal(header.mtime, sizeof(header.mtime), mtime > 0 ? mtime : 0);
+    header.typeflag = type;
+    memcpy(header.magic, "ustar", 6);
+    memcpy(header.version, "00", 2);
+    strcpy(header.uname, "root");
+    strcpy(header.gname, "root");
+    snprintf(header.checksum, sizeof(header.checksum), "%06o", tarChecksum(header));
+    header.checksum[7] = ' ';
+    out.write((char*) &header, sizeof(header));
+}
+
+// Writes base with everything below it as a ustar archive, the members named from base's name (from the children of root).
+// A file that cannot be read is sent as zeros so that the archive stays readable, and the result is false.
+bool writeTar(FileNode* base, ostream& out) {
+    if (base->type == _DOT) {
+        return false;
+    }
+    PooledBuffer buffer(COPY_CHUNK_BYTES);
+    bool success = true;
+    vector<pair<FileNode*, string>> stack;
+    if (base == VOLUME->root) {
+        for (size_t i = base->children.size(); i > 0; i--) {
+            if (base->children[i - 1]->type != _DOT) {
+                stack.push_back({base->children[i - 1], base->children[i - 1]->name});
+            }
+        }
+    } else {
+        stack.push_back({base, base->name});
+    }
+    while (stack.size()) {
+        pair<FileNode*, string> top = stack.back();
+        stack.pop_back();
+        FileNode* node = top.first;
+        time_t mtime = fatTimestamp(node->binaryModifiedDate, node->binaryModifiedTime);
+        if (node->type == _FOLDER) {
+            writeTarHeader(out, top.second + "/", '5', 0, mtime);
+            for (size_t i = node->children.size(); i > 0; i--) {
+                if (node->children[i - 1]->type != _DOT) {
+                    stack.push_back({node->children[i - 1], top.second + "/" + node->children[i - 1]->name});
+                }
+            }
+            continue;
+        }
+        writeTarHeader(out, top.second, '0', node->fileSize, mtime);
+        FileReader reader(node);
+        bool readable = true;
+        for (uint64_t position = 0; position < node->fileSize;) {
+            size_t length = min((uint64_t) buffer.size, node->fileSize - position);
+            if (!readable || reader.read(position, buffer.data, length) != length) {
+                memset(buffer.data, 0, length);
+                readable = false;
+            }
+            out.write((char*) buffer.data, length);
+            position += length;
+        }
+        writeTarPadding(out, node->fileSize);
+        if (!readable) {
+            cerr << "tar-out: " << top.second << ": read error" << endl;
+            success = false;
+        }
+    }
+    char end[2 * TAR_BLOCK_BYTES] = {};
+    out.write(end, sizeof(end));
+    return success && out.good();
+}
+
+string tarPath(const TarHeader& header) {
+    string name(header.name, strnlen(header.name, sizeof(header.name)));
+    if (memcmp(header.magic, "ustar", 5) == 0 && header.prefix[0] != 0) {
+        return string(header.prefix, strnlen(header.prefix, sizeof(header.prefix))) + "/" + name;
+    }
+    return name;
+}
+
+// The path record of a pax extended header, empty when it has none.
+string paxPath(const string& data) {
+    for (size_t position = 0; position < data.size();) {
+        size_t length = strtoul(data.c_str() + position, nullptr, 10);
+        size_t key = data.find(' ', position);
+        if (length == 0 || key == string::npos || position + length > data.size()) {
+            break;
+        }
+        string record = data.substr(key + 1, position + length - key - 2); // Without the newline
+        if (record.compare(0, 5, "path=") == 0) {
+            return record.substr(5);
+        }
+        position += length;
+    }
+    return "";
+}
+
+// Skips size bytes of the archive. Returns false when it ends first.
+bool skipTarBytes(istream& in, uint64_t size, PooledBuffer& buffer) {
+    while (size > 0 && in.read((char*) buffer.data, min((uint64_t) buffer.size, size))) {
+        size -= in.gcount();
+    }
+    return size == 0;
+}
+
+// Reads the data of a file member into the clusters of its chain. Like copyRange it bypasses the
+// journal. Returns false when the archive ends early.
+bool readTarData(istream& in, const vector<unsigned>& chain, uint64_t size, PooledBuffer& buffer, bool& writeFailed) {
+    size_t chunkClusters = buffer.size / VOLUME->clusterSize;
+    for (size_t first = 0; first < chain.size(); first += chunkClusters) {
+        size_t count = min(chunkClusters, chain.size() - first);
+        size_t bytes = min((uint64_t) count * VOLUME->clusterSize, size - (uint64_t) first * VOLUME->clusterSize);
+        if (!in.read((char*) buffer.data, bytes)) {
+            return false;
+        }
+        // Free clusters may still hold old data past the end of the file
+        memset(buffer.data + bytes, 0, count * VOLUME->clusterSize - bytes);
+        vector<IORequest> requests;
+        appendChainRequests(chain, first, count, buffer.data, requests);
+        for (auto& request : requests) {
+            request.write = true;
+            VOLUME->blockCache->discard(request.offset, request.size);
+            forgetHole(request.offset, request.size);
+        }
+        writeFailed = !runBatch(requests) || writeFailed;
+    }
+    return true;
+}
+
+// Builds the members of a tar archive read from in below destinationFolder, creating missing directories
+// on the way. Members that clash with existing names, links and devices are skipped with a message.
+// Reading stops after the end of the archive. Returns false when not everything could be imported.
+bool readTar(istream& in, FileNode* destinationFolder) {
+    if (destinationFolder->type != _FOLDER) {
+        return false;
+    }
+    TreeBuilder builder(destinationFolder);
+    size_t chunkClusters = max((size_t) 1, COPY_CHUNK_BYTES / VOLUME->clusterSize);
+    PooledBuffer buffer(chunkClusters * VOLUME->clusterSize);
+    static const TarHeader zeroHeader = {};
+    TarHeader header;
+    string longPath;
+    vector<string> components;
+    bool success = true;
+    bool writeFailed = false;
+    while (1) {
+        in.read((char*) &header, sizeof(header));
+        if (in.gcount() == 0 || (in.gcount() == sizeof(header) && memcmp(&header, &zeroHeader, sizeof(header)) == 0)) {
+            break; // A zero block ends the archive, and a stream ending between members is taken as the end as well
+        }
+        if (in.gcount() != sizeof(header) || parseOctal(header.checksum, sizeof(header.checksum)) != tarChecksum(header)) {
+            cerr << "tar-in: " << (in.gcount() != sizeof(header) ? "unexpected end of archive" : "bad header checksum") << endl;
+            success = false;
+            break;
+        }
+        uint64_t size = parseOctal(header.size, sizeof(header.size));
+        uint64_t padding = (TAR_BLOCK_BYTES - size % TAR_BLOCK_BYTES) % TAR_BLOCK_BYTES;
+        string path = longPath.size() ? longPath : tarPath(header);
+        longPath.clear();
+        char type = header.typeflag;
+        if (type == 'x' || type == 'L') { // Long name for the next member, pax or GNU style
+            string data(size, 0);
+            if (!in.read(&data[0], size)) {
+                cerr << "tar-in: unexpected end of archive" << endl;
+                success = false;
+                break;
+            }
+            longPath = type == 'x' ? paxPath(data) : string(data.c_str());
+            skipTarBytes(in, padding, buffer);
+            continue;
+        }
+        bool regular = type == '0' || type == 0 || type == '7';
+        uint64_t clusters = regular ? (size + VOLUME->clusterSize - 1) / VOLUME->clusterSize : 0;
+        time_t mtime = parseOctal(header.mtime, sizeof(header.mtime));
+        bool consumed = false;
+        if (!regular && type != '5') {
+            if (type != 'g') {
+                cerr << "tar-in: " << path << ": not a file or directory, skipped" << endl;
+            }
+        } else if (!pathComponents(path, components)) {
+            cerr << "tar-in: " << path << ": name not allowed, skipped" << endl;
+        } else if (components.empty()) {
+            // The destination itself
+        } else if (size > UINT32_MAX) {
+            cerr << "tar-in: " << path << ": too large for FAT32, skipped" << endl;
+        } else if (!builder.fits(clusters + components.size())) {
+            cerr << "tar-in: " << path << ": no space left" << endl;
+            success = false;
+            break;
+        } else {
+            string parentPath;
+            FileNode* parent = builder.directory(components, components.size() - 1, parentPath);
+            string memberPath = TreeBuilder::join(parentPath, components.back());
+            auto existing = builder.nodes.find(memberPath);
+            if (parent == nullptr) {
+                cerr << "tar-in: " << path << ": not under a directory, skipped" << endl;
+            } else if (existing != builder.nodes.end()) {
+                if (type != '5' || existing->second->type != _FOLDER) {
+                    cerr << "tar-in: " << path << ": exists, skipped" << endl;
+                }
+            } else if (type == '5') {
+                builder.add(parent, memberPath, components.back(), _FOLDER, mtime);
+            } else {
+                bool large = ALLOCATION_POLICY == _NEAR_GOAL && size >= LARGE_FILE_BYTES;
+                unsigned& goal = large ? builder.largeGoal : builder.smallGoal;
+                vector<unsigned> chain = allocateClusters(clusters, goal, builder.reserved);
+                if (chain.size() != clusters) {
+                    cerr << "tar-in: " << path << ": no space left" << endl;
+                    success = false;
+                    break;
+                }
+                addReserved(builder.reserved, chain);
+                goal = chain.size() ? chainGoal(&chain) : goal;
+                if (!readTarData(in, chain, size, buffer, writeFailed)) {
+                    cerr << "tar-in: unexpected end of archive" << endl;
+                    success = false;
+                    break;
+                }
+                consumed = true;
+                FileNode* file = builder.add(parent, memberPath, components.back(), _FILE, mtime);
+                file->fileSize = size;
+                *file->clusterChain = chain;
+                file->firstClusterIndex = chain.size() ? chain[0] : 0;
+            }
+        }
+        if (!skipTarBytes(in, consumed ? padding : size + padding, buffer) && !consumed) {
+            cerr << "tar-in: unexpected end of archive" << endl;
+            success = false;
+            break;
+        }
+    }
+    success = builder.finish() && success;
+    if (writeFailed) {
+        cerr << "tar-in: write error" << endl;
+        success = false;
+    }
+    return success;
+}
+
+/*
+ Heat reports and placement. The heat of a node is the number of lookups that landed on it plus
+ the reads of its hottest cluster, so reading a file whole counts once however large it is. Hot
+ fragmented files are relocated hottest first into the lowest free run that holds them, which
+ gathers the hottest data contiguously at the front of the data region.
+*/
+class HotNode {
+public:
+    FileNode* node;
+    uint64_t hits;
+    uint32_t last;
+    size_t runs;
+};
+
+// Runs of consecutive clusters in a chain.
+size_t chainRuns(const vector<unsigned>& chain) {
+    size_t runs = chain.size() ? 1 : 0;
+    for (size_t i = 1; i < chain.size(); i++) {
+        runs += chain[i] != chain[i - 1] + 1;
+    }
+    return runs;
+}
+
+// Nodes with any heat whose chain has more than one run, hottest first and most recent first among equals.
+vector<HotNode> hotFragmentedNodes(bool filesOnly) {
+    HeatMap* heat = VOLUME->heat;
+    vector<HotNode> hot;
+    vector<FileNode*> stack = {VOLUME->root};
+    while (stack.size()) {
+        FileNode* node = stack.back();
+        stack.pop_back();
+        for (auto& child : node->children) {
+            if (child->type != _DOT) {
+                stack.push_back(child);
+            }
+        }
+        if (node->clusterChain == nullptr || (filesOnly && node->type != _FILE)) {
+            continue;
+        }
+        size_t runs = chainRuns(*node->clusterChain);
+        if (runs < 2) {
+            continue;
+        }
+        HotNode entry = {node, 0, 0, runs};
+        auto it = heat->nodes.find(node->firstClusterIndex);
+        if (it != heat->nodes.end()) {
+            entry.hits = it->second.count;
+            entry.last = it->second.last;
+        }
+        uint32_t hottest = 0;
+        for (auto& cluster : *node->clusterChain) {
+            auto found = heat->clusters.find(cluster);
+            if (found != heat->clusters.end()) {
+                hottest = max(hottest, found->second.count);
+                entry.last = max(entry.last, found->second.last);
+            }
+        }
+        entry.hits += hottest;
+        if (entry.hits) {
+            hot.push_back(entry);
+        }
+    }
+    sort(hot.begin(), hot.end(), [](const HotNode& first, const HotNode& second) {
+        return first.hits != second.hits ? first.hits > second.hits : first.last > second.last;
+    });
+    return hot;
+}
+
+void recordAccess(FileNode* node) {
+    if (VOLUME->heat != nullptr && node != nullptr && node->firstClusterIndex != 0) {
+        VOLUME->heat->recordNode(node->firstClusterIndex);
+    }
+}
+
+void printHeat(ostream& out, unsigned count) {
+    vector<HotNode> hot = hotFragmentedNodes(false);
+    out << "Hits Runs Clusters Last-access Path" << endl;
+    for (size_t i = 0; i < hot.size() && i < count; i++) {
+        time_t last = hot[i].last;
+        tm local;
+        localtime_r(&last, &local);
+        char when[32];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M", &local);
+        out << hot[i].hits << " " << hot[i].runs << " " << hot[i].node->clusterChain->size() << " " << when
+            << " " << findAbsolutePath(hot[i].node) << (hot[i].node->type == _FOLDER && hot[i].node != VOLUME->root ? "/" : "") << endl;
+    }
+}
+
+// Pins the cache pages of the most read clusters, up to a part of the cache, and reads them in.
+void pinHotClusters() {
+    HeatMap* heat = VOLUME->heat;
+    vector<pair<unsigned, Heat>> hot;
+    for (auto& entry : heat->clusters) {
+        if (entry.second.count >= HEAT_PIN_MIN && entry.first >= 2 && entry.first < VOLUME->totalClusters + 2) {
+            hot.push_back(entry);
+        }
+    }
+    sort(hot.begin(), hot.end(), [](const pair<unsigned, Heat>& first, const pair<unsigned, Heat>& second) {
+        return first.second.count != second.second.count ? first.second.count > second.second.count : first.second.last > second.second.last;
+    });
+    size_t budget = VOLUME->blockCache->capacity / HEAT_PIN_DIVISOR;
+    size_t pagesPerCluster = VOLUME->clusterSize / VOLUME->cachePageSize;
+    unordered_set<uint64_t> pages;
+    vector<pair<uint64_t, size_t>> ranges;
+    for (size_t i = 0; i < hot.size() && pages.size() + pagesPerCluster <= budget; i++) {
+        uint64_t offset = clusterOffset(hot[i].first);
+        for (size_t page = 0; page < pagesPerCluster; page++) {
+            pages.insert(offset / VOLUME->cachePageSize + page);
+        }
+        ranges.push_back({offset, VOLUME->clusterSize});
+    }
+    VOLUME->blockCache->pin(pages);
+    prefetch(ranges);
+}
+
+// The first cluster of the lowest run of count free clusters, 0 when there is none.
+unsigned lowestFreeRun(unsigned count) {
+    uint64_t end = (uint64_t) VOLUME->totalClusters + 2;
+    vector<uint32_t> fat(FAT_SCAN_BYTES / 4);
+    unsigned runStart = 0;
+    unsigned runLength = 0;
+    for (uint64_t base = 2; base < end; base += fat.size()) {
+        size_t entries = min((uint64_t) fat.size(), end - base);
+        readBytes(VOLUME->fatStart + base * 4, fat.data(), entries * 4);
+        for (size_t i = 0; i < entries; i++) {
+            if (fat[i] != 0) {
+                runLength = 0;
+                continue;
+            }
+            if (runLength++ == 0) {
+                runStart = base + i;
+            }
+            if (runLength == count) {
+                return runStart;
+            }
+        }
+    }
+    return 0;
+}
+
+// Offset of the 8.3 entry of a node in its parent directory, 0 when it is not there.
+uint64_t entryOffset(FileNode* node) {
+    vector<FatFileEntry> entries(VOLUME->clusterSize / sizeof(FatFileEntry));
+    for (auto& cluster : *node->parentRef->clusterChain) {
+        readBytes(clusterOffset(cluster), entries.data(), VOLUME->clusterSize);
+        for (size_t i = 0; i < entries.size(); i++) {
+            FatFile83& entry = entries[i].msdos;
+            if (entry.attributes != 0x0F && entry.filename[0] != 0xE5 && entry.filename[0] != '.'
+                && ((unsigned) entry.eaIndex << 16 | entry.firstCluster) == node->firstClusterIndex) {
+                return clusterOffset(cluster) + i * sizeof(FatFileEntry);
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ Moves a file into one run of free clusters. The data is copied first, then the new chain is
+ linked and the entry pointed at it. The old chain is added to released for the caller to free,
+ so a crash in between leaks clusters at worst. The heat moves along with the data.
+*/
+bool relocateFile(FileNode* file, vector<unsigned>& released) {
+    vector<unsigned>& chain = *file->clusterChain;
+    unsigned start = lowestFreeRun(chain.size());
+    uint64_t entryAt = entryOffset(file);
+    if (start == 0 || entryAt == 0) {
+        return false;
+    }
+    vector<unsigned> target;
+    for (unsigned i = 0; i < chain.size(); i++) {
+        target.push_back(start + i);
+    }
+    if (!copyClusters(chain, target, chain.size())) {
+        return false;
+    }
+    writeChains({&target});
+    VOLUME->freeClusters -= target.size();
+    FatFileEntry entry;
+    readBytes(entryAt, &entry, sizeof(FatFileEntry));
+    entry.msdos.eaIndex = (start & 0xFFFF0000) >> 16;
+    entry.msdos.firstCluster = start & 0x0000FFFF;
+    writeBytes(entryAt, &entry, sizeof(FatFileEntry));
+    *file->entry = entry;
+    HeatMap* heat = VOLUME->heat;
+    auto moveHeat = [](unordered_map<unsigned, Heat>& table, unsigned from, unsigned to) {
+        auto it = table.find(from);
+        Heat moved = it != table.end() ? it->second : Heat();
+        if (it != table.end()) {
+            table.erase(it);
+        }
+        table.erase(to); // Left over from data that was freed there
+        if (moved.count) {
+            table[to] = moved;
+        }
+    };
+    for (size_t i = 0; i < chain.size(); i++) {
+        moveHeat(heat->clusters, chain[i], target[i]);
+    }
+    moveHeat(heat->nodes, file->firstClusterIndex, start);
+    heat->dirty = true;
+    released.insert(released.end(), chain.begin(), chain.end());
+    chain = target;
+    file->firstClusterIndex = start;
+    return true;
+}
+
+unsigned relocateHot(unsigned count) {
+    vector<HotNode> hot = hotFragmentedNodes(true);
+    unsigned moved = 0;
+    vector<unsigned> released;
+    for (size_t i = 0; i < hot.size() && moved < count; i++) {
+        moved += relocateFile(hot[i].node, released);
+    }
+    freeClusters(released);
+    // The journal punches freed clusters only once their group is durable. Committing now keeps
+    // data that later commands write directly into those clusters from being punched away.
+    if (VOLUME->journal->enabled && released.size()) {
+        VOLUME->journal->commit();
+    }
+    pinHotClusters();
+    return moved;
+}
+
+void closeVolume(Volume* volume);
+
+// Reads the free count and builds the tree of the current volume from its root directory.
+void mountTree() {
+    readBytes(VOLUME->fsInfoStart + 488, &VOLUME->freeClusters, 4);
+    if (RECOUNT_AT_MOUNT) {
+        FreeCount count = recountFreeClusters(true);
+        if (count.corrected) {
+            cerr << VOLUME->imagePath << ": FSInfo free count " << count.storedFree << " corrected to " << count.freeClusters << endl;
+        } else if (!count.validFsInfo) {
+            cerr << VOLUME->imagePath << ": FSInfo signature invalid, free count " << count.freeClusters << " not stored" << endl;
+        }
+    }
+    FileNode* root = new FileNode;
+    root->name = "/";
+    root->firstClusterIndex = VOLUME->rootCluster;
+    root->clusterChain = getClusterChain(root->firstClusterIndex);
+    root->type = _FOLDER;
+    if (!VOLUME->streaming) {
+        createTree(root);
+        computeUsage(root);
+    }
+    VOLUME->root = root;
+}
+
+// Sets the layout of the current volume from its boot sector.
+void setGeometry(const BPB_struct& bpb) {
+    VOLUME->clusterSize = bpb.BytesPerSector * bpb.SectorsPerCluster;
+    VOLUME->fatStart = bpb.ReservedSectorCount * bpb.BytesPerSector;
+    VOLUME->fatSize = bpb.extended.FATSize * bpb.BytesPerSector;
+    VOLUME->numFats = bpb.NumFATs;
+    VOLUME->dataStart = VOLUME->fatStart + VOLUME->numFats * VOLUME->fatSize;
+    VOLUME->fsInfoStart = bpb.BytesPerSector * bpb.extended.FSInfo;
+    VOLUME->rootCluster = bpb.extended.RootCluster;
+    VOLUME->totalClusters = ((uint64_t) bpb.TotalSectors32 * bpb.BytesPerSector - VOLUME->dataStart) / VOLUME->clusterSize;
+}
+
+// Opens an image and builds its tree. The volume becomes the current one of the calling thread.
+Volume* openVolume(const string& path, string& error) {
+    TraceSpan span("openVolume", path);
+    // Bytes per sector = 512
+    // cluster size = 1024 bytes
+    // Sectors per FAT = 794
+    // #FATs = 2
+    // Sectors per cluster = 2
+    // # reserved sectors = 32
+    // start byte of fat = 16384
+    // FATs size = 2 * 794 * 512 = 813056
+    // data section start = 829440
+    Volume* volume = new Volume;
+    VOLUME = volume;
+    volume->imagePath = path;
+    volume->bufferPool = new BufferPool;
+    volume->blockCache = new BlockCache;
+    volume->journal = new Journal;
+    volume->journal->enabled = USE_JOURNAL;
+    volume->nameIndex = new NameIndex;
+    volume->dentryCache = new DentryCache(DENTRY_CACHE_CAPACITY);
+    int openFlags = USE_OVERLAY ? O_RDONLY : O_RDWR; // An overlay takes every write
+    volume->bufferedFd = volume->imgFd = open(path.c_str(), openFlags);
+    if (volume->imgFd < 0) {
+        error = path + ": " + strerror(errno);
+        closeVolume(volume);
+        return nullptr;
+    }
+    if (DIRECT_IO) {
+        volume->imgFd = open(path.c_str(), openFlags | O_DIRECT);
+        if (volume->imgFd < 0) {
+            cerr << path << ": O_DIRECT: " << strerror(errno) << endl;
+            volume->imgFd = volume->bufferedFd;
+        }
+    }
+#ifdef HAVE_IO_URING
+    if (USE_IO_URING && !USE_OVERLAY) {
+        volume->ring = new IOUring;
+        if (!volume->ring->setup(IO_QUEUE_DEPTH)) {
+            delete volume->ring;
+            volume->ring = nullptr;
+        }
+    }
+#endif
+    // The boot sector is only written by a resize, through the journal, so it is read before the
+    // overlay and the journal are set up and read again if a group was left to replay
+    BPB_struct bpb;
+    diskRead(0, &bpb, sizeof(BPB_struct)); // The cache page size is not known before this
+    volume->sectorSize = bpb.BytesPerSector;
+    if (volume->sectorSize < MIN_BPS || volume->sectorSize > MAX_BPS || (volume->sectorSize & (volume->sectorSize - 1)) != 0) {
+        error = path + ": unsupported sector size " + to_string(volume->sectorSize);
+        closeVolume(volume);
+        return nullptr;
+    }
+    volume->cachePageSize = volume->sectorSize;
+    volume->blockCache->capacity = BLOCK_CACHE_BYTES / volume->cachePageSize;
+    setGeometry(bpb);
+    volume->kernels = selectKernels(volume->clusterSize, volume->sectorSize);
+    if (USE_OVERLAY) {
+        volume->overlay = new Overlay;
+        volume->sparse = false;
+        if (!volume->overlay->open(path + ".overlay", lseek(volume->bufferedFd, 0, SEEK_END), volume->clusterSize, error)) {
+            closeVolume(volume);
+            return nullptr;
+        }
+    }
+    // A group left behind by a crash is replayed even when journaling is not requested this time
+    string journalPath = path + ".journal";
+    if (volume->journal->enabled || access(journalPath.c_str(), F_OK) == 0) {
+        if (!volume->journal->open(journalPath)) {
+            cerr << journalPath << ": " << strerror(errno) << endl;
+            volume->journal->enabled = false;
+        } else if (!volume->journal->enabled) {
+            close(volume->journal->fd);
+            volume->journal->fd = -1;
+            unlink(journalPath.c_str());
+        }
+        diskRead(0, &bpb, sizeof(BPB_struct));
+        setGeometry(bpb);
+    }
+    readBytes(volume->fatStart, &volume->eocValue, 4);
+    mountTree();
+    if (TRACK_HEAT) {
+        volume->heat = new HeatMap;
+        volume->heat->load(path + ".heat");
+        pinHotClusters();
+    }
+    return volume;
+}
+
+// Frees a tree. Dot entries share their chain and entry with the directory they stand for.
+void deleteTree(FileNode* root) {
+    vector<FileNode*> stack = {root};
+    while (stack.size()) {
+        FileNode* node = stack.back();
+        stack.pop_back();
+        if (node->type != _DOT) {
+            for (auto& child : node->children) {
+                stack.push_back(child);
+            }
+            delete node->clusterChain;
+            delete node->entry;
+        }
+        delete node;
+    }
+}
+
+// Commits what is left in the journal and releases everything the volume holds.
+void closeVolume(Volume* volume) {
+    TraceSpan span("closeVolume");
+    VOLUME = volume;
+    if (volume->journal->fd >= 0) {
+        if (volume->journal->commit()) { // Nothing is left to replay
+            unlink(volume->journal->path.c_str());
+        }
+        close(volume->journal->fd);
+    }
+    if (volume->root != nullptr) {
+        deleteTree(volume->root);
+    }
+    if (volume->overlay != nullptr && volume->overlay->fd >= 0) {
+        volume->overlay->save();
+    }
+    if (volume->heat != nullptr) {
+        volume->heat->save();
+    }
+    delete volume->overlay;
+    delete volume->heat;
+#ifdef HAVE_IO_URING
+    delete volume->ring;
+#endif
+    if (volume->imgFd != volume->bufferedFd) {
+        close(volume->imgFd);
+    }
+    if (volume->bufferedFd >= 0) {
+        close(volume->bufferedFd);
+    }
+    delete volume->dentryCache;
+    delete volume->nameIndex;
+    delete volume->journal;
+    delete volume->blockCache;
+    delete volume->bufferPool;
+    delete volume->kernels;
+    delete volume;
+    VOLUME = nullptr;
+}
+
+// Ends one command of the volume's user. The journal commits a group every few commands.
+void endCommand() {
+    VOLUME->journal->endCommand();
+}
+
+// Commits the journal now and makes the image, or the overlay and its map, durable.
+bool syncVolume() {
+    bool success = VOLUME->journal->commit();
+    syncImage();
+    if (VOLUME->heat != nullptr) {
+        success = VOLUME->heat->save() && success;
+    }
+    return success;
+}
+
+// Writes everything the overlay holds into the image, which is opened for writing only for this, and empties the overlay.
+bool commitOverlay(string& error) {
+    Overlay* overlay = VOLUME->overlay;
+    if (overlay == nullptr) {
+        error = "no overlay";
+        return false;
+    }
+    VOLUME->journal->commit();
+    int imageFd = open(VOLUME->imagePath.c_str(), O_RDWR);
+    if (imageFd < 0) {
+        error = VOLUME->imagePath + ": " + strerror(errno);
+        return false;
+    }
+    PooledBuffer buffer(COPY_CHUNK_BYTES);
+    uint64_t granules = (overlay->imageSize + overlay->granule - 1) / overlay->granule;
+    bool success = true;
+    for (uint64_t index = 0; index < granules && success; index++) {
+        if (!overlay->mapped(index)) {
+            continue;
+        }
+        uint64_t end = index + 1;
+        while (end < granules && overlay->mapped(end) && (end - index + 1) * overlay->granule <= COPY_CHUNK_BYTES) {
+            end++;
+        }
+        uint64_t offset = index * overlay->granule;
+        size_t length = min(end * overlay->granule, overlay->imageSize) - offset;
+        success = readFully(overlay->fd, offset, buffer.data, length) && writeFully(imageFd, offset, buffer.data, length);
+        index = end - 1;
+    }
+    success = success && fdatasync(imageFd) == 0;
+    close(imageFd);
+    if (!success) {
+        error = VOLUME->imagePath + ": " + strerror(errno);
+        return false;
+    }
+    return overlay->clear() && overlay->save();
+}
+
+// Drops the cached pages, the tree and the lookups built on it, and builds the tree again from the image.
+void remountTree() {
+    VOLUME->blockCache->clear();
+    deleteTree(VOLUME->root);
+    VOLUME->root = nullptr; // No heat is recorded while the tree is built again
+    delete VOLUME->dentryCache;
+    delete VOLUME->nameIndex;
+    VOLUME->nameIndex = new NameIndex;
+    VOLUME->dentryCache = new DentryCache(DENTRY_CACHE_CAPACITY);
+    mountTree();
+}
+
+// Drops everything the overlay holds and rebuilds the tree from the image as it was.
+bool discardOverlay() {
+    if (VOLUME->overlay == nullptr) {
+        return false;
+    }
+    VOLUME->journal->commit();
+    VOLUME->overlay->clear();
+    VOLUME->overlay->save();
+    remountTree();
+    return true;
+}
+
+/*
+ Resizing. The image grows or shrinks in place. When the FAT has to grow, it takes over the first
+ clusters of the data region instead of the data region moving: the FAT grows by a whole number
+ of clusters, the clusters it will cover are moved out, and every cluster number is lowered by
+ that many, so all other data stays where it is. Clusters past a smaller end are moved down the
+ same way. The FAT is remapped in memory and written once in its new layout, so a resize costs
+ the FAT, a pass over the directories and the clusters that move. The FAT never shrinks.
+ Clusters are only moved into free clusters, so the old tree stays intact until the new FAT, FSInfo,
+ the directories and both boot sectors are committed as one journal group. A crash leaves either
+ layout, never a mix. Without --journal the journal is opened for the resize alone.
+ The chains are found by walking the directory entries on disk rather than the tree, which leaves
+ out entries without a long name and files with uncommon attributes, so those move with the rest.
+*/
+// The chain starting at first in an in-memory FAT, stopping at anything that is not a cluster before end.
+vector<unsigned> fatChain(const vector<uint32_t>& fat, unsigned first, uint64_t end) {
+    vector<unsigned> chain;
+    for (unsigned cluster = first; cluster >= 2 && cluster < end && chain.size() < end; cluster = fat[cluster] & 0x0FFFFFFF) {
+        chain.push_back(cluster);
+    }
+    return chain;
+}
+
+// Every allocated chain reachable from the root on disk: the root, each directory and each file.
+// directories holds the indexes of the directory chains, the root first.
+void scanChains(const vector<uint32_t>& fat, uint64_t end, vector<vector<unsigned>>& chains, vector<size_t>& directories) {
+    vector<FatFileEntry> entries(VOLUME->clusterSize / sizeof(FatFileEntry));
+    unordered_set<unsigned> seen = {VOLUME->rootCluster};
+    chains.push_back(fatChain(fat, VOLUME->rootCluster, end));
+    directories.push_back(0);
+    for (size_t d = 0; d < directories.size(); d++) {
+        vector<unsigned> directory = chains[directories[d]];
+        for (auto& cluster : directory) {
+            readBytes(clusterOffset(cluster), entries.data(), VOLUME->clusterSize);
+            for (auto& entry : entries) {
+                FatFile83& msdos = entry.msdos;
+                if (msdos.attributes == 0x0F || msdos.filename[0] == 0 || msdos.filename[0] == 0xE5 || msdos.filename[0] == '.') {
+                    continue;
+                }
+                unsigned first = (unsigned) msdos.eaIndex << 16 | msdos.firstCluster;
+                if (first < 2 || first >= end || !seen.insert(first).second) {
+                    continue;
+                }
+                chains.push_back(fatChain(fat, first, end));
+                if (msdos.attributes & 0x10) {
+                    directories.push_back(chains.size() - 1);
+                }
+            }
+        }
+    }
+}
+
+// Passes the cluster of every entry in the given directories through remap, dot entries included,
+// and writes back the directory clusters that changed.
+template<class Remap>
+void remapEntries(const vector<vector<unsigned>>& chains, const vector<size_t>& directories, const Remap& remap) {
+    vector<FatFileEntry> entries(VOLUME->clusterSize / sizeof(FatFileEntry));
+    for (auto& directory : directories) {
+        for (auto& cluster : chains[directory]) {
+            readBytes(clusterOffset(cluster), entries.data(), VOLUME->clusterSize);
+            bool changed = false;
+            for (auto& entry : entries) {
+                FatFile83& msdos = entry.msdos;
+                if (msdos.attributes == 0x0F || msdos.filename[0] == 0 || msdos.filename[0] == 0xE5) {
+                    continue;
+                }
+                unsigned current = (unsigned) msdos.eaIndex << 16 | msdos.firstCluster;
+                unsigned mapped = current != 0 ? remap(current) : 0;
+                if (mapped != current) {
+                    msdos.eaIndex = (mapped & 0xFFFF0000) >> 16;
+                    msdos.firstCluster = mapped & 0x0000FFFF;
+                    changed = true;
+                }
+            }
+            if (changed) {
+                writeBytes(clusterOffset(cluster), entries.data(), VOLUME->clusterSize);
+            }
+        }
+    }
+}
+
+bool resizeVolume(uint64_t bytes, string& error) {
+    TraceSpan span("resizeVolume", "bytes", bytes);
+    if (VOLUME->overlay != nullptr || VOLUME->streaming) {
+        error = "not possible with an overlay or in streaming mode";
+        return false;
+    }
+    BPB_struct bpb;
+    diskRead(0, &bpb, sizeof(BPB_struct));
+    uint64_t totalSectors = bytes / VOLUME->sectorSize;
+    unsigned oldFatSectors = bpb.extended.FATSize;
+    unsigned fatSectors = oldFatSectors;
+    uint64_t clusters;
+    // The FAT must hold every cluster and grow by whole clusters
+    while (1) {
+        uint64_t metadataSectors = bpb.ReservedSectorCount + (uint64_t) VOLUME->numFats * fatSectors;
+        if (totalSectors < metadataSectors + bpb.SectorsPerCluster) {
+            error = "too small for the reserved sectors and the FAT";
+            return false;
+        }
+        clusters = (totalSectors - metadataSectors) / bpb.SectorsPerCluster;
+        bool wholeClusters = (uint64_t) (fatSectors - oldFatSectors) * VOLUME->numFats * VOLUME->sectorSize % VOLUME->clusterSize == 0;
+        if ((clusters + 2) * 4 <= (uint64_t) fatSectors * VOLUME->sectorSize && wholeClusters) {
+            break;
+        }
+        fatSectors++;
+    }
+    if (totalSectors > 0xFFFFFFFF || clusters > 0x0FFFFFF5 - 2) {
+        error = "too large for FAT32";
+        return false;
+    }
+    // In the current numbering the new data region holds clusters [shift + 2, newEnd)
+    unsigned shift = (uint64_t) (fatSectors - oldFatSectors) * VOLUME->numFats * VOLUME->sectorSize / VOLUME->clusterSize;
+    uint64_t newEnd = shift + clusters + 2;
+    uint64_t oldEnd = (uint64_t) VOLUME->totalClusters + 2;
+    uint64_t newBytes = totalSectors * VOLUME->sectorSize;
+    off_t imageBytes = lseek(VOLUME->bufferedFd, 0, SEEK_END);
+    VOLUME->journal->commit();
+    if ((off_t) newBytes > imageBytes && ftruncate(VOLUME->bufferedFd, newBytes) != 0) {
+        error = strerror(errno);
+        return false;
+    }
+
+    // The whole FAT is worked on in memory, covering the clusters past the old end when growing
+    vector<uint32_t> fat(max(oldEnd, newEnd));
+    readBytes(VOLUME->fatStart, fat.data(), oldEnd * 4);
+
+    // Move the clusters of every file and directory that lie outside the new data region
+    vector<vector<unsigned>> chains;
+    vector<size_t> directories;
+    scanChains(fat, oldEnd, chains, directories);
+    size_t outside = 0;
+    for (auto& chain : chains) {
+        for (auto& cluster : chain) {
+            outside += cluster < shift + 2 || cluster >= newEnd;
+        }
+    }
+    vector<unsigned> targets;
+    for (uint64_t cluster = shift + 2; cluster < newEnd && targets.size() < outside; cluster++) {
+        if (fat[cluster] == 0) {
+            targets.push_back(cluster);
+        }
+    }
+    if (targets.size() < outside) {
+        error = "no room to move " + to_string(outside) + " clusters";
+        if (ftruncate(VOLUME->bufferedFd, imageBytes) != 0) {
+            error += string(", ") + strerror(errno);
+        }
+        return false;
+    }
+    vector<unsigned> from;
+    unordered_map<unsigned, unsigned> moved;
+    for (auto& chain : chains) {
+        bool chainMoved = false;
+        for (auto& cluster : chain) {
+            if (cluster < shift + 2 || cluster >= newEnd) {
+                from.push_back(cluster);
+                moved[cluster] = targets[from.size() - 1];
+                chainMoved = true;
+            }
+        }
+        if (!chainMoved) {
+            continue;
+        }
+        for (auto& cluster : chain) {
+            fat[cluster] = 0;
+            auto it = moved.find(cluster);
+            cluster = it != moved.end() ? it->second : cluster;
+        }
+        for (size_t i = 0; i < chain.size(); i++) {
+            fat[chain[i]] = i + 1 < chain.size() ? chain[i + 1] : VOLUME->eocValue;
+        }
+    }
+    if (!copyClusters(from, targets, from.size())) {
+        error = VOLUME->imagePath + ": " + strerror(errno);
+        return false;
+    }
+    bool temporaryJournal = !VOLUME->journal->enabled;
+    if (temporaryJournal && !VOLUME->journal->open(VOLUME->imagePath + ".journal")) {
+        error = VOLUME->imagePath + ".journal: " + strerror(errno);
+        if (ftruncate(VOLUME->bufferedFd, imageBytes) != 0) {
+            error += string(", ") + strerror(errno);
+        }
+        return false;
+    }
+    VOLUME->journal->enabled = true;
+    remapEntries(chains, directories, [&](unsigned cluster) {
+        auto it = moved.find(cluster);
+        return it != moved.end() ? it->second : cluster;
+    });
+    // Renumber: cluster c of the current numbering becomes c - shift
+    if (shift > 0) {
+        remapEntries(chains, directories, [&](unsigned cluster) {
+            return cluster >= shift + 2 ? cluster - shift : cluster;
+        });
+    }
+    vector<uint32_t> newFat((uint64_t) fatSectors * VOLUME->sectorSize / 4, 0);
+    newFat[0] = fat[0];
+    newFat[1] = fat[1];
+    for (uint64_t cluster = shift + 2; cluster < newEnd; cluster++) {
+        uint32_t value = fat[cluster];
+        uint32_t next = value & 0x0FFFFFFF;
+        if (next >= 2 && next < 0x0FFFFFF7) {
+            // Only a chain nothing points at can still lead out of the new data region, it is ended there
+            value = next >= shift + 2 && next < newEnd ? (value & 0xF0000000) | (next - shift) : VOLUME->eocValue;
+        }
+        newFat[cluster - shift] = value;
+    }
+    size_t fatBytes = newFat.size() * 4;
+    for (unsigned copy = 0; copy < VOLUME->numFats; copy++) {
+        for (size_t done = 0; done < fatBytes; done += COPY_CHUNK_BYTES) {
+            writeBytes(VOLUME->fatStart + (uint64_t) copy * fatBytes + done, (uint8_t*) newFat.data() + done, min(COPY_CHUNK_BYTES, fatBytes - done));
+        }
+    }
+    // FSInfo takes the counts of the new FAT in the same group
+    uint32_t freeClusters = countZeroEntries(newFat.data() + 2, clusters);
+    uint32_t fsInfo[MAX_BPS / 4];
+    readBytes(VOLUME->fsInfoStart, fsInfo, VOLUME->sectorSize);
+    if (fsInfo[0] == FSINFO_LEAD_SIGNATURE && fsInfo[484 / 4] == FSINFO_STRUCT_SIGNATURE) {
+        fsInfo[488 / 4] = freeClusters;
+        fsInfo[492 / 4] = freeClusters ? find(newFat.begin() + 2, newFat.begin() + clusters + 2, 0) - newFat.begin() : FSINFO_UNKNOWN;
+        writeBytes(VOLUME->fsInfoStart, fsInfo, VOLUME->sectorSize);
+    }
+    bpb.TotalSectors32 = totalSectors;
+    bpb.extended.FATSize = fatSectors;
+    bpb.extended.RootCluster = chains[0][0] - shift;
+    writeBytes(0, &bpb, sizeof(BPB_struct));
+    if (bpb.extended.BkBootSec != 0) {
+        writeBytes((uint64_t) bpb.extended.BkBootSec * VOLUME->sectorSize, &bpb, sizeof(BPB_struct));
+    }
+    bool success = VOLUME->journal->commit();
+    if (temporaryJournal) {
+        VOLUME->journal->enabled = false;
+        close(VOLUME->journal->fd);
+        VOLUME->journal->fd = -1;
+        if (success) { // Nothing is left to replay
+            unlink(VOLUME->journal->path.c_str());
+        }
+    }
+    if ((off_t) newBytes < imageBytes && ftruncate(VOLUME->bufferedFd, newBytes) != 0) {
+        success = false;
+    }
+    setGeometry(bpb);
+    VOLUME->holeStart = VOLUME->holeEnd = 0;
+    remountTree();
+    VOLUME->freeClusters = freeClusters;
+    if (VOLUME->heat != nullptr) { // Cluster numbers changed, the heat starts over
+        VOLUME->heat->clusters.clear();
+        VOLUME->heat->nodes.clear();
+        VOLUME->heat->dirty = true;
+        VOLUME->blockCache->pin(unordered_set<uint64_t>());
+    }
+    if (!success) {
+        error = VOLUME->imagePath + ": " + strerror(errno);
+    }
+    return success;
+}
+
+void printCacheStats(ostream& out) {
+    out << "hits " << VOLUME->blockCache->hits << " misses " << VOLUME->blockCache->misses
+    << " readahead " << VOLUME->blockCache->readaheadPages << " readahead-hits " << VOLUME->blockCache->readaheadHits
+    << " resident " << VOLUME->blockCache->pages.size() << "/" << VOLUME->blockCache->capacity
+    << " pinned " << VOLUME->blockCache->pinned.size() << endl;
+}
+
+/*
+ Image creation. makeImage lays out a new, empty FAT32 image: the boot sector and FSInfo with
+ their backups in the reserved sectors, and every FAT with only the reserved entries and the
+ root directory's cluster in use. The reserved sectors and the FATs are allocated with fallocate,
+ which hands them out zeroed without writing them, so only the sectors holding something are
+ written: the reserved area in one write and the first sector of each FAT. The data region stays
+ a hole, or is allocated too with --no-sparse.
+*/
+const unsigned NEW_IMAGE_RESERVED_SECTORS = 32;
+const unsigned NEW_IMAGE_FATS = 2;
+const unsigned NEW_IMAGE_BACKUP_SECTOR = 6;
+// The cluster count alone decides the FAT type. Fewer clusters than this make a FAT12 or FAT16 volume.
+const uint64_t FAT32_MIN_CLUSTERS = 65525;
+
+// The cluster size Microsoft's format tools pick for a FAT32 volume of this size.
+unsigned defaultClusterSize(uint64_t bytes) {
+    const uint64_t megabyte = 1024 * 1024;
+    if (bytes <= 260 * megabyte) {
+        return 512;
+    } else if (bytes <= 8192 * megabyte) {
+        return 4096;
+    } else if (bytes <= 16384 * megabyte) {
+        return 8192;
+    } else if (bytes <= 32768 * megabyte) {
+        return 16384;
+    }
+    return 32768;
+}
+
+// Clusters of a new image and the sectors of each FAT. The FAT covers the clusters left after the
+// FATs themselves, so its size is found by iterating. Returns 0 when not even one cluster fits.
+uint64_t newImageClusters(uint64_t totalSectors, unsigned sectorSize, unsigned sectorsPerCluster, uint64_t& fatSectors) {
+    fatSectors = 1;
+    while (1) {
+        uint64_t metadataSectors = NEW_IMAGE_RESERVED_SECTORS + NEW_IMAGE_FATS * fatSectors;
+        if (totalSectors < metadataSectors + sectorsPerCluster) {
+            return 0;
+        }
+        uint64_t clusters = (totalSectors - metadataSectors) / sectorsPerCluster;
+        uint64_t needed = ((clusters + 2) * 4 + sectorSize - 1) / sectorSize;
+        if (needed <= fatSectors) {
+            return clusters;
+        }
+        fatSectors = needed;
+    }
+}
+
+bool makeImage(const string& path, uint64_t bytes, unsigned sectorSize, unsigned clusterSize, string& error) {
+    TraceSpan span("makeImage", path);
+    if (sectorSize < MIN_BPS || sectorSize > MAX_BPS || (sectorSize & (sectorSize - 1)) != 0) {
+        error = "unsupported sector size " + to_string(sectorSize);
+        return false;
+    }
+    clusterSize = clusterSize ? clusterSize : max(sectorSize, defaultClusterSize(bytes));
+    if (clusterSize < sectorSize || clusterSize > 65536 || (clusterSize & (clusterSize - 1)) != 0) {
+        error = "unsupported cluster size " + to_string(clusterSize);
+        return false;
+    }
+    uint64_t totalSectors = bytes / sectorSize;
+    unsigned sectorsPerCluster = clusterSize / sectorSize;
+    uint64_t fatSectors;
+    uint64_t clusters = newImageClusters(totalSectors, sectorSize, sectorsPerCluster, fatSectors);
+    if (clusters < FAT32_MIN_CLUSTERS) {
+        uint64_t minimumMegabytes = (bytes >> 20) + 1;
+        while (newImageClusters((minimumMegabytes << 20) / sectorSize, sectorSize, sectorsPerCluster, fatSectors) < FAT32_MIN_CLUSTERS) {
+            minimumMegabytes++;
+        }
+        error = to_string(clusters) + " clusters of " + to_string(clusterSize) + " bytes, FAT32 needs at least " + to_string(FAT32_MIN_CLUSTERS)
+                + ": use an image of at least " + to_string(minimumMegabytes) + "M";
+        for (unsigned smaller = clusterSize / 2; smaller >= sectorSize; smaller /= 2) {
+            if (newImageClusters(totalSectors, sectorSize, smaller / sectorSize, fatSectors) >= FAT32_MIN_CLUSTERS) {
+                error += " or clusters of at most " + to_string(smaller) + " bytes";
+                break;
+            }
+        }
+        return false;
+    }
+    if (totalSectors > 0xFFFFFFFF || clusters > 0x0FFFFFF5 - 2) {
+        error = "too large for FAT32 with " + to_string(clusterSize) + " byte clusters";
+        return false;
+    }
+
+    vector<uint8_t> reserved((uint64_t) NEW_IMAGE_RESERVED_SECTORS * sectorSize);
+    BPB_struct* bpb = (BPB_struct*) reserved.data();
+    memcpy(bpb->BS_JumpBoot, "\xEB\x58\x90", 3);
+    memcpy(bpb->BS_OEMName, "MSWIN4.1", 8);
+    bpb->BytesPerSector = sectorSize;
+    bpb->SectorsPerCluster = sectorsPerCluster;
+    bpb->ReservedSectorCount = NEW_IMAGE_RESERVED_SECTORS;
+    bpb->NumFATs = NEW_IMAGE_FATS;
+    bpb->Media = 0xF8;
+    bpb->SectorsPerTrack = 32;
+    bpb->NumberOfHeads = 64;
+    bpb->TotalSectors32 = totalSectors;
+    bpb->extended.FATSize = fatSectors;
+    bpb->extended.RootCluster = 2;
+    bpb->extended.FSInfo = 1;
+    bpb->extended.BkBootSec = NEW_IMAGE_BACKUP_SECTOR;
+    bpb->extended.BS_DriveNumber = 0x80;
+    bpb->extended.BS_BootSig = 0x29;
+    bpb->extended.BS_VolumeID = time(nullptr);
+    memcpy(bpb->extended.BS_VolumeLabel, "NO NAME    ", 11);
+    memcpy(bpb->extended.BS_FileSystemType, "FAT32   ", 8);
+    reserved[510] = 0x55;
+    reserved[511] = 0xAA;
+    uint8_t* fsInfo = reserved.data() + sectorSize;
+    uint32_t fsInfoFields[3] = {FSINFO_STRUCT_SIGNATURE, (uint32_t) clusters - 1, 3};
+    memcpy(fsInfo, &FSINFO_LEAD_SIGNATURE, 4);
+    memcpy(fsInfo + 484, fsInfoFields, 12); // 496 to 507 stay reserved
+    memcpy(fsInfo + 508, &FSINFO_TRAIL_SIGNATURE, 4);
+    // The backup boot sector and FSInfo follow at the backup sector
+    memcpy(reserved.data() + NEW_IMAGE_BACKUP_SECTOR * sectorSize, reserved.data(), 2 * sectorSize);
+    // The media descriptor entry doubles as the end of chain mark
+    vector<uint8_t> fatStart(sectorSize);
+    uint32_t firstEntries[3] = {0x0FFFFFF8, 0x0FFFFFFF, 0x0FFFFFF8};
+    memcpy(fatStart.data(), firstEntries, sizeof(firstEntries));
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        error = path + ": " + strerror(errno);
+        return false;
+    }
+    uint64_t imageBytes = totalSectors * sectorSize;
+    uint64_t fatBytes = fatSectors * sectorSize;
+    uint64_t dataStart = reserved.size() + NEW_IMAGE_FATS * fatBytes;
+    bool success = ftruncate(fd, imageBytes) == 0;
+    if (success && fallocate(fd, 0, 0, SPARSE_IMAGE ? dataStart : imageBytes) != 0) {
+        // Nothing to allocate with: write the zeros of the metadata in large chunks instead
+        vector<uint8_t> zeros(min(dataStart, (uint64_t) COPY_CHUNK_BYTES));
+        for (uint64_t done = 0; done < dataStart && success; done += zeros.size()) {
+            success = writeFully(fd, done, zeros.data(), min((uint64_t) zeros.size(), dataStart - done));
+        }
+    }
+    success = success && writeFully(fd, 0, reserved.data(), reserved.size());
+    for (unsigned fat = 0; fat < NEW_IMAGE_FATS && success; fat++) {
+        success = writeFully(fd, reserved.size() + fat * fatBytes, fatStart.data(), fatStart.size());
+    }
+    success = success && fdatasync(fd) == 0;
+    if (!success) {
+        error = path + ": " + strerror(errno);
+    }
+    // Reads both FSInfo sectors back as another driver would find them
+    for (unsigned sector : {1u, NEW_IMAGE_BACKUP_SECTOR + 1}) {
+        vector<uint8_t> written(sectorSize);
+        if (success && (!readFully(fd, (uint64_t) sector * sectorSize, written.data(), sectorSize) || !hasFsInfoSignatures(written.data()))) {
+            error = path + ": FSInfo in sector " + to_string(sector) + " does not read back with its signatures";
+            success = false;
+        }
+    }
+    if (!success) {
+        unlink(path.c_str());
+    }
+    close(fd);
+    return success;
+}
@@ -0,0 +1,506 @@
+#ifndef LIBFAT32_H
+#define LIBFAT32_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <iostream>
+#include "fat32.h"
+
+/*
+ libfat32: the FAT32 engine behind the shell, for programs that want to query and change an
+ image in process instead of scripting the shell over a pipe. Open an image with openVolume,
+ which makes it the volume of the calling thread, walk the tree from VOLUME->root with
+ DirectoryIterator or resolvePath, read files with FileReader and change the tree with
+ createChild, moveNode and copyTree. Each thread works on the volume VOLUME points at, so a
+ program holding several volumes on one thread switches by assigning VOLUME.
+*/
+
+enum nodeType {_FILE, _FOLDER, _DOT};
+
+extern std::vector<std::string> MONTHS;
+extern FatFileEntry* ZERO_ENTRY;
+
+// Options shared by every volume. They are read by openVolume, so set them before opening.
+extern bool USE_IO_URING;
+extern bool DIRECT_IO;
+extern size_t BLOCK_CACHE_BYTES;
+extern bool USE_READAHEAD;
+extern bool SPARSE_IMAGE;
+extern bool USE_JOURNAL;
+// Opens images read-only and sends every write to a copy-on-write overlay file, <image>.overlay.
+extern bool USE_OVERLAY;
+// Counts the free clusters at mount instead of trusting FSInfo.
+extern bool RECOUNT_AT_MOUNT;
+// Streaming mode mounts without building the tree. cat reads through a buffer of STREAM_BUFFER_BYTES.
+extern bool STREAM_MODE;
+extern size_t STREAM_BUFFER_BYTES;
+// Records how often and how recently clusters and nodes are read, kept in <image>.heat.
+extern bool TRACK_HEAT;
+
+enum allocationPolicy {_LOWEST_FREE, _NEAR_GOAL};
+
+extern allocationPolicy ALLOCATION_POLICY;
+
+// O_DIRECT transfers must be aligned to this in offset, size and memory.
+const size_t DIRECT_ALIGN = 4096;
+// Longest name that can be assembled from LFN entries (20 entries of 13 characters).
+const size_t LFN_NAME_MAX = 20 * 13;
+
+/*
+ Tracing. While a trace is open, shell commands, lookups, allocation and block I/O record nested
+ spans as Chrome trace events, for chrome://tracing or Perfetto. A span is a TraceSpan living
+ for the scope it measures, with up to two numbers attached. With no trace open a span costs a
+ test of TRACING.
+*/
+extern bool TRACING;
+
+bool openTrace(const std::string& path, std::string& error);
+void closeTrace();
+
+class TraceSpan;
+void endSpan(const TraceSpan& span);
+uint64_t traceClock();
+
+class TraceSpan {
+public:
+    const char* name; // nullptr when not tracing
+    const std::string* text; // Shown as "text" in the arguments when set
+    const char* firstArg;
+    uint64_t first;
+    const char* secondArg;
+    uint64_t second;
+    uint64_t start;
+    TraceSpan(const char* name, const char* firstArg = nullptr, uint64_t first = 0, const char* secondArg = nullptr, uint64_t second = 0) :
+        name(TRACING ? name : nullptr), text(nullptr), firstArg(firstArg), first(first), secondArg(secondArg), second(second) {
+        if (this->name != nullptr) {
+            start = traceClock();
+        }
+    }
+    TraceSpan(const char* name, const std::string& text) : TraceSpan(name) {
+        this->text = &text;
+    }
+    ~TraceSpan() {
+        if (name != nullptr) {
+            endSpan(*this);
+        }
+    }
+};
+
+class BufferPool;
+class IOUring;
+class BlockCache;
+class Journal;
+class FileNode;
+class NameIndex;
+class DentryCache;
+class Overlay;
+class GeometryKernels;
+class HeatMap;
+
+/*
+ Everything that belongs to one open image. Code always works on the volume of its thread,
+ so fleet mode can keep one image open per worker thread.
+*/
+class Volume {
+public:
+    std::string imagePath;
+    int imgFd; // The O_DIRECT descriptor with --direct, otherwise the same as bufferedFd
+    int bufferedFd;
+    IOUring* ring;
+    unsigned eocValue;
+    unsigned fatStart;
+    unsigned fatSize;
+    unsigned dataStart;
+    unsigned fsInfoStart;
+    unsigned clusterSize;
+    unsigned sectorSize;
+    unsigned numFats;
+    unsigned freeClusters;
+    unsigned totalClusters;
+    unsigned rootCluster;
+    // Block cache pages are one sector, so clusters and FAT sectors always cover whole pages.
+    size_t cachePageSize;
+    // Hole queries are used while the image file system supports SEEK_DATA.
+    bool sparse;
+    uint64_t holeStart;
+    uint64_t holeEnd;
+    // Mounted in streaming mode: root has no children and only the stream functions see the directories.
+    bool streaming;
+    BufferPool* bufferPool;
+    BlockCache* blockCache;
+    Journal* journal;
+    NameIndex* nameIndex;
+    DentryCache* dentryCache;
+    Overlay* overlay; // nullptr unless writes go to an overlay
+    GeometryKernels* kernels; // Chosen for the cluster and sector size when the boot sector is read
+    HeatMap* heat; // nullptr unless access heat is tracked
+    FileNode* root;
+    Volume() {
+        imgFd = bufferedFd = -1;
+        ring = nullptr;
+        cachePageSize = MIN_BPS;
+        sparse = SPARSE_IMAGE;
+        streaming = STREAM_MODE;
+        holeStart = holeEnd = 0;
+        bufferPool = nullptr;
+        blockCache = nullptr;
+        journal = nullptr;
+        nameIndex = nullptr;
+        dentryCache = nullptr;
+        overlay = nullptr;
+        kernels = nullptr;
+        heat = nullptr;
+        root = nullptr;
+    }
+};
+
+extern thread_local Volume* VOLUME;
+
+/*
+ Block I/O. An IORequest is one positional transfer against the image of the current volume.
+ submitBatch runs independent requests together and sees pending journal writes.
+*/
+struct IORequest {
+    uint64_t offset;
+    void* buffer;
+    size_t size;
+    bool write;
+};
+
+// Aligned buffers for large cluster transfers, kept for reuse by size.
+class BufferPool {
+public:
+    std::unordered_map<size_t, std::vector<uint8_t*>> freeBuffers;
+
+    ~BufferPool() {
+        for (auto& size : freeBuffers) {
+            for (auto& buffer : size.second) {
+                free(buffer);
+            }
+        }
+    }
+
+    static size_t roundSize(size_t size) {
+        return (size + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    }
+
+    uint8_t* acquire(size_t size) {
+        std::vector<uint8_t*>& available = freeBuffers[roundSize(size)];
+        if (available.size()) {
+            uint8_t* buffer = available.back();
+            available.pop_back();
+            return buffer;
+        }
+        void* buffer = nullptr;
+        if (posix_memalign(&buffer, DIRECT_ALIGN, std::max(roundSize(size), DIRECT_ALIGN)) != 0) {
+            throw std::bad_alloc();
+        }
+        return (uint8_t*) buffer;
+    }
+
+    void release(uint8_t* buffer, size_t size) {
+        std::vector<uint8_t*>& available = freeBuffers[roundSize(size)];
+        if (available.size() < 4) {
+            available.push_back(buffer);
+        } else {
+            free(buffer);
+        }
+    }
+};
+
+class PooledBuffer {
+public:
+    uint8_t* data;
+    size_t size;
+    PooledBuffer(size_t size) : data(VOLUME->bufferPool->acquire(size)), size(size) {}
+    ~PooledBuffer() {
+        VOLUME->bufferPool->release(data, size);
+    }
+};
+
+class FileNode {
+public:
+    std::string name;
+    std::string realName;
+    FileNode* realNode;
+    enum nodeType type;             
+    std::vector<unsigned>* clusterChain;
+    FileNode* parentRef;
+    unsigned firstClusterIndex;
+    std::vector<FileNode*> children;
+    FatFileEntry* entry;
+    int order;
+    uint8_t checksum;
+    uint16_t binaryModifiedDate;
+    unsigned short modifiedDay;
+    unsigned short modifiedYear;
+    std::string modifiedMonth;
+    uint16_t binaryModifiedTime;
+    unsigned short modifiedHour;
+    unsigned short modifiedMinute;
+    unsigned short modifiedSecond;
+    uint8_t creationMs;
+    unsigned fileSize;
+    // Rolled up over the node and everything below it: file bytes, allocated clusters and number of nodes.
+    unsigned long long totalBytes;
+    unsigned long long totalClusters;
+    unsigned long long totalEntries;
+    FileNode() {
+        totalBytes = 0;
+        totalClusters = 0;
+        totalEntries = 1;
+        checksum = 0;
+        clusterChain = nullptr;
+        parentRef = nullptr;
+        firstClusterIndex = 0;
+        fileSize = 0;
+        entry = nullptr;
+        realNode = nullptr;
+        order = 0;
+    }
+    FileNode(std::string name, enum nodeType type, std::vector<unsigned>* clusterChain, FileNode* parentRef, unsigned firstClusterIndex, std::vector<FileNode*> children, FatFileEntry* entry) :
+        name(name),
+        type(type),
+        clusterChain(clusterChain),
+        parentRef(parentRef),
+        children(children),
+        entry(entry),
+        firstClusterIndex(firstClusterIndex)
+    {}
+    FileNode(const FileNode& base) {
+        order = 0;
+        fileSize = base.fileSize;
+        type = base.type;
+        clusterChain = base.clusterChain;
+        parentRef = base.parentRef;
+        firstClusterIndex = base.firstClusterIndex;
+        children = base.children;
+        entry = base.entry;
+        binaryModifiedDate = base.binaryModifiedDate;
+        modifiedDay = base.modifiedDay;
+        modifiedMonth = base.modifiedMonth;
+        modifiedYear = base.modifiedYear;
+        binaryModifiedTime = base.binaryModifiedTime;
+        modifiedHour = base.modifiedHour;
+        modifiedMinute = base.modifiedMinute;
+        modifiedSecond = base.modifiedSecond;
+        creationMs = base.creationMs;
+    }
+
+    bool isListable() {
+        return (this->name != "/" &&  this->children.size() > 2) || (this->name == "/" && this->children.size() > 0);
+    }
+
+    int getMaxOrder() {
+        int max = 0;
+        for (auto& child : this->children) {
+            max = child->order > max ? child->order : max;
+        }
+        return max;
+    }
+
+    void setModifiedDate(uint16_t date) {
+        binaryModifiedDate = date;
+        modifiedYear = 1980 + (date >> 9);
+        uint16_t mask = 480; 
+        modifiedMonth = MONTHS[((date & mask) >> 5)];
+        uint16_t mask2 = 31;
+        modifiedDay = date & mask2;
+    }
+    void setModifiedTime(uint16_t time) {
+        binaryModifiedTime = time;
+        modifiedHour = time >> 11;
+        uint16_t mask = 2016; // 00000 111111 00000 
+        modifiedMinute = (time & mask) >> 5;
+        uint16_t mask2 = 31; // 00000 000000 11111
+        modifiedSecond = (time & mask2) * 2;
+    }
+    void setModifiedTimeAndYear(int year, int month, int day, int hour, int minute, int second) {
+        modifiedYear = year + 1900;
+        modifiedMonth = MONTHS[month - 1];
+        modifiedDay = day;
+        modifiedHour = hour;
+        modifiedMinute = minute;
+        modifiedSecond = second;
+    }
+};
+
+/*
+ Zero-copy iteration. A DirectoryIterator walks the children of a directory in disk order,
+ skipping the dot entries. The names are views into the tree, so a walk allocates nothing;
+ they stay valid until the directory is changed.
+*/
+class DirectoryEntryView {
+public:
+    std::string_view name;
+    enum nodeType type;
+    unsigned fileSize;
+    unsigned firstCluster;
+    FileNode* node;
+};
+
+class DirectoryIterator {
+public:
+    FileNode* directory;
+    size_t index;
+    DirectoryIterator(FileNode* directory) : directory(directory), index(0) {}
+
+    bool next(DirectoryEntryView& entry) {
+        while (index < directory->children.size()) {
+            FileNode* child = directory->children[index++];
+            if (child->type == _DOT) {
+                continue;
+            }
+            entry.name = child->name;
+            entry.type = child->type;
+            entry.fileSize = child->fileSize;
+            entry.firstCluster = child->firstClusterIndex;
+            entry.node = child;
+            return true;
+        }
+        return false;
+    }
+};
+
+// Consecutive clusters of a file: where they start in the file and in the image, and how many bytes of the file they hold.
+class Extent {
+public:
+    uint64_t fileOffset;
+    uint64_t imageOffset;
+    uint64_t length;
+};
+
+std::vector<Extent> fileExtents(FileNode* file);
+
+/*
+ Reads a file through its extents. A read turns into one request per extent it touches,
+ submitted as a single batch, and stops at the end of the file.
+*/
+class FileReader {
+public:
+    FileNode* file;
+    std::vector<Extent> extents;
+    FileReader(FileNode* file) : file(file), extents(fileExtents(file)) {}
+
+    // Returns the number of bytes read, 0 at the end of the file or on a read error.
+    size_t read(uint64_t position, void* buffer, size_t size);
+};
+
+/*
+ Streaming iteration for volumes mounted in streaming mode, where the tree is never built.
+ A DirectoryStream decodes a directory from its clusters through a buffer of one cluster and
+ yields its entries, dot entries included. Names are views into the stream, valid until the
+ next call to next.
+*/
+class StreamEntry {
+public:
+    std::string_view name;
+    enum nodeType type;
+    unsigned firstCluster;
+    unsigned fileSize;
+    uint16_t modifiedDate;
+    uint16_t modifiedTime;
+};
+
+class DirectoryStream {
+public:
+    unsigned cluster; // Cluster in the buffer, 0 after the end of the chain
+    std::vector<uint8_t> buffer;
+    unsigned group; // First of the 16 entries the masks describe
+    unsigned interesting;
+    unsigned lfnMask;
+    unsigned namedMask;
+    unsigned deletedMask;
+    char nameBuffer[LFN_NAME_MAX];
+    size_t nameStart;
+    DirectoryStream(unsigned firstCluster);
+
+    void load(unsigned next);
+    bool next(StreamEntry& entry);
+};
+
+class HashedFile {
+public:
+    FileNode* node;
+    std::string path;
+    std::string digest;
+    bool readable;
+};
+
+// Free cluster totals from a FAT scan next to the ones FSInfo held.
+class FreeCount {
+public:
+    unsigned freeClusters;
+    unsigned nextFree;
+    unsigned storedFree;
+    unsigned storedNextFree;
+    bool validFsInfo;
+    bool corrected;
+};
+
+// Volumes
+Volume* openVolume(const std::string& path, std::string& error);
+void closeVolume(Volume* volume);
+void endCommand();
+bool syncVolume();
+void printCacheStats(std::ostream& out);
+FreeCount recountFreeClusters(bool fix);
+bool commitOverlay(std::string& error);
+bool discardOverlay();
+// Grows or shrinks the image to bytes, growing the FAT when needed, and builds the tree again.
+bool resizeVolume(uint64_t bytes, std::string& error);
+// Creates a new, empty image of bytes. A clusterSize of 0 picks one from the size.
+bool makeImage(const std::string& path, uint64_t bytes, unsigned sectorSize, unsigned clusterSize, std::string& error);
+
+// Block I/O
+uint64_t clusterOffset(unsigned cluster);
+bool readBytes(uint64_t offset, void* buffer, size_t size);
+bool writeBytes(uint64_t offset, const void* buffer, size_t size);
+bool submitBatch(std::vector<IORequest>& requests);
+bool readUncached(std::vector<IORequest>& requests);
+void prefetch(std::vector<std::pair<uint64_t, size_t>>& ranges);
+void appendChainRequests(const std::vector<unsigned>& chain, size_t first, size_t count, uint8_t* buffer, std::vector<IORequest>& requests);
+std::vector<unsigned>* getClusterChain(uint32_t firstClusterIndex);
+unsigned nextCluster(unsigned cluster);
+
+// Tree
+std::vector<std::string> extractDirectories(std::string path);
+void getFileAndFolders(FileNode* root);
+FileNode* findFile(FileNode* currentDir, const std::vector<std::string>& directories);
+std::string findAbsolutePath(FileNode* file);
+FileNode* resolvePath(FileNode* currentDir, const std::string& currentPath, const std::string& path, std::string* absolutePath = nullptr);
+FileNode* searchForParent(FileNode* currentDir, const std::string& currentPath, const std::vector<std::string>& directories);
+bool isChild(FileNode* first, FileNode* second);
+std::vector<std::string> findNames(FileNode* base, const std::string& pattern, bool glob);
+bool streamLookup(unsigned currentCluster, const std::vector<std::string>& directories, StreamEntry& result);
+
+// Changes
+FileNode* createChild(FileNode* parentDirectory, std::string name, enum nodeType type);
+bool moveNode(FileNode* source, FileNode* destinationFolder);
+FileNode* copyTree(FileNode* source, FileNode* destinationFolder);
+// Creates the paths below base in one pass, like mkdir -p for paths ending in a slash and touch for the others.
+bool makeTree(FileNode* base, std::vector<std::string> paths);
+
+// Archives. writeTar sends base and everything below it to out as a ustar archive, readTar
+// extracts an archive from in below destinationFolder. Problems are reported on cerr.
+bool writeTar(FileNode* base, std::ostream& out);
+bool readTar(std::istream& in, FileNode* destinationFolder);
+
+// Access heat. recordAccess counts a lookup of node, printHeat lists the hottest fragmented files and
+// directories, and relocateHot makes up to count of the hottest fragmented files contiguous.
+void recordAccess(FileNode* node);
+void printHeat(std::ostream& out, unsigned count);
+unsigned relocateHot(unsigned count);
+
+// Contents and debugging
+void hashFiles(std::vector<HashedFile>& files, bool sha256);
+uint8_t lfn_checksum(char *pFCBName);
+void printFatEntries(FileNode* node);
+void printCluster(unsigned cluster);
+
+#endif //LIBFAT32_H
@@ -1,33 +1,34 @@
-#include <fcntl.h>
-#include <unistd.h>
-#include <stdlib.h>
-#include <time.h>
-#include <sys/time.h>
-#include <ctype.h>
+#include <stdio.h>
 #include <math.h>
-#include <cstdio>
+#include <errno.h>
+#include <fnmatch.h>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <vector>
-#include <deque>
-#include "fat32.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include "libfat32.h"
 
 using namespace std;
 
-vector<string> MONTHS = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+// Read window of cat in clusters. It starts small and doubles on every window read up to the maximum.
+const unsigned CAT_READAHEAD_MIN = 4;
+const unsigned CAT_READAHEAD_MAX = 256;
+// Size of the buffer listings are formatted into before being written out.
+const size_t OUTPUT_BUFFER_BYTES = 1024 * 1024;
 
-enum nodeType {_FILE, _FOLDER, _DOT};
-
-unsigned EOCVAL;
-unsigned FAT_START;
-unsigned FAT_SIZE;
-unsigned DATA_START;
-unsigned FS_INFO_START;
-unsigned CLUSTER_SIZE;
-unsigned NUM_FATS;
-unsigned FREE_CLUSTERS;
-FatFileEntry* ZERO_ENTRY;
-char* imgFile;
+// Byte count written as a number with an optional K, M or G suffix.
+uint64_t parseSize(const string& text) {
+    char* suffix;
+    uint64_t bytes = strtoull(text.c_str(), &suffix, 10);
+    int shift = *suffix == 'K' ? 10 : *suffix == 'M' ? 20 : *suffix == 'G' ? 30 : 0;
+    return bytes << shift;
+}
 
 vector<string> tokenizeString(string s, char delimeter) {
     vector<string> tokens;
@@ -46,958 +47,497 @@ vector<string> tokenizeString(string s, char delimeter) {
     return tokens;
 }
 
-uint32_t toLittleEndian(uint32_t number) {
-    return (number & 0xFF000000) >> 24 + (number & 0x00FF0000) >> 16 + (number & 0x0000FF00) >> 8 + (number & 0x000000FF);
-}
-
-uint8_t getCurrentMs() {
-    timeval curTime;
-    gettimeofday(&curTime, NULL);
-    uint8_t ms = curTime.tv_usec / 1000;
-    return ms;
-}
-
-uint16_t getCurrentDate() {
-    time_t now = time(0);
-    tm *tm = localtime(&now);
-    uint16_t creationDate = ((tm->tm_year - 80) << 9) + (tm->tm_mon << 5) + tm->tm_mday;
-    return creationDate;
-}
-
-uint16_t getCurrentTime() {
-    time_t now = time(0);
-    tm *tm = localtime(&now);
-    uint16_t creationTime = (tm->tm_hour << 11) + (tm->tm_min << 5) + tm->tm_sec / 2;
-    return creationTime;
-}
-
-uint8_t lfn_checksum(char *pFCBName) {
-   int i;
-   uint8_t sum = 0;
-   for (i = 11; i; i--)
-      sum = ((sum & 1) << 7) + (sum >> 1) + *pFCBName++;
-
-   return sum;
-}
-
-vector<string> extractDirectories(string path) {
-    vector<string> directories;
-    string dirBuffer;
-    if (path[0] == '/') {
-        directories.push_back("/");
-        path = path.substr(1);
+/*
+ Listing output. Lines are formatted by hand into a large buffer that is written to
+ the shell's output stream in big chunks, instead of through many small inserts and endl flushes.
+*/
+class OutputBuffer {
+public:
+    ostream& stream;
+    vector<char> data;
+    size_t used;
+    OutputBuffer(ostream& stream, size_t capacity) : stream(stream), data(capacity), used(0) {}
+    ~OutputBuffer() {
+        flush();
     }
-    for (auto& dir : path) {
-        if (dir == '/') {
-            directories.push_back(dirBuffer);
-            dirBuffer.erase();
-        } else {
-            dirBuffer.push_back(dir);
+
+    void append(const char* text, size_t length) {
+        if (used + length > data.size()) {
+            flush();
+            if (length > data.size()) {
+                stream.write(text, length);
+                return;
+            }
         }
+        memcpy(data.data() + used, text, length);
+        used += length;
     }
-    if (dirBuffer.size() > 0) {
-        directories.push_back(dirBuffer);
-    }
-    return directories;
-}
 
-class FileNode {
-public:
-    string name;
-    string realName;
-    FileNode* realNode;
-    enum nodeType type;             
-    vector<unsigned>* clusterChain;
-    FileNode* parentRef;
-    unsigned firstClusterIndex;
-    vector<FileNode*> children;
-    FatFileEntry* entry;
-    int order;
-    uint8_t checksum;
-    uint16_t binaryModifiedDate;
-    unsigned short modifiedDay;
-    unsigned short modifiedYear;
-    string modifiedMonth;
-    uint16_t binaryModifiedTime;
-    unsigned short modifiedHour;
-    unsigned short modifiedMinute;
-    unsigned short modifiedSecond;
-    uint8_t creationMs;
-    unsigned fileSize;
-    FileNode() {
-        checksum = 0;
-        clusterChain = nullptr;
-        parentRef = nullptr;
-        firstClusterIndex = 0;
-        fileSize = 0;
-        entry = nullptr;
-        realNode = nullptr;
-        order = 0;
+    void append(const string& text) {
+        append(text.data(), text.size());
     }
-    FileNode(string name, enum nodeType type, vector<unsigned>* clusterChain, FileNode* parentRef, unsigned firstClusterIndex, vector<FileNode*> children, FatFileEntry* entry) :
-        name(name),
-        type(type),
-        clusterChain(clusterChain),
-        parentRef(parentRef),
-        children(children),
-        entry(entry),
-        firstClusterIndex(firstClusterIndex)
-    {}
-    FileNode(const FileNode& base) {
-        order = 0;
-        fileSize = base.fileSize;
-        type = base.type;
-        clusterChain = base.clusterChain;
-        parentRef = base.parentRef;
-        firstClusterIndex = base.firstClusterIndex;
-        children = base.children;
-        entry = base.entry;
-        binaryModifiedDate = base.binaryModifiedDate;
-        modifiedDay = base.modifiedDay;
-        modifiedMonth = base.modifiedMonth;
-        modifiedYear = base.modifiedYear;
-        binaryModifiedTime = base.binaryModifiedTime;
-        modifiedHour = base.modifiedHour;
-        modifiedMinute = base.modifiedMinute;
-        modifiedSecond = base.modifiedSecond;
-        creationMs = base.creationMs;
+
+    void append(char character) {
+        append(&character, 1);
     }
 
-    bool isListable() {
-        return (this->name != "/" &&  this->children.size() > 2) || (this->name == "/" && this->children.size() > 0);
+    void appendNumber(unsigned long long value) {
+        char digits[20];
+        int count = 0;
+        do {
+            digits[19 - count++] = '0' + value % 10;
+            value /= 10;
+        } while (value);
+        append(digits + 20 - count, count);
     }
 
-    int getMaxOrder() {
-        int max = 0;
-        for (auto& child : this->children) {
-            max = child->order > max ? child->order : max;
+    // Numbers below ten get a leading zero, as for hours and minutes in ls -l.
+    void appendTwoDigits(unsigned value) {
+        if (value < 10) {
+            append('0');
         }
-        return max;
+        appendNumber(value);
     }
 
-    void setModifiedDate(uint16_t date) {
-        binaryModifiedDate = date;
-        modifiedYear = 1980 + (date >> 9);
-        uint16_t mask = 480; 
-        modifiedMonth = MONTHS[((date & mask) >> 5)];
-        uint16_t mask2 = 31;
-        modifiedDay = date & mask2;
-    }
-    void setModifiedTime(uint16_t time) {
-        binaryModifiedTime = time;
-        modifiedHour = time >> 11;
-        uint16_t mask = 2016; // 00000 111111 00000 
-        modifiedMinute = (time & mask) >> 5;
-        uint16_t mask2 = 31; // 00000 000000 11111
-        modifiedSecond = (time & mask2) * 2;
-    }
-    void setModifiedTimeAndYear(int year, int month, int day, int hour, int minute, int second) {
-        modifiedYear = year + 1900;
-        modifiedMonth = MONTHS[month - 1];
-        modifiedDay = day;
-        modifiedHour = hour;
-        modifiedMinute = minute;
-        modifiedSecond = second;
+    void flush() {
+        stream.write(data.data(), used);
+        used = 0;
     }
 };
 
-FileNode** fileTree = new FileNode*;
+enum sortKey {_DISK_ORDER, _BY_NAME, _BY_SIZE, _BY_TIME};
 
-bool isChild(FileNode* first, FileNode* second) {
-    bool cond = false;
-    for (auto& child : second->children) {
-        if (child->type != _DOT) {
-            cond = (child == first) || isChild(first, child);
-        }
-    }
-    return cond;
-}
-
-void updateFAT(FileNode* parentDirectory, deque<unsigned> newClusterIndices) {
-    FILE* fp = fopen(imgFile, "r+");
-    unsigned currentFATStart = FAT_START;
-    int i = 0;
-    vector<unsigned> parentChain = (*parentDirectory->clusterChain);
-    while (i < NUM_FATS) {
-        unsigned firstIndex = parentChain[parentChain.size() - 1];
-        for (auto& index : newClusterIndices) {
-            fseek(fp, currentFATStart + firstIndex * 4, SEEK_SET);
-            uint8_t bytes[4];
-            bytes[0] = index & 0xFF;
-            bytes[1] = (index & 0xFF00) >> 8;
-            bytes[2] = (index & 0xFF0000) >> 16;
-            bytes[3] = (index & 0xFF000000) >> 24;
-            for (int j = 0; j < 4; j++) {
-                fwrite(bytes + j, 1, 1, fp);
+bool parseListFlag(const string& flag, bool& longFormat, bool& recursive, enum sortKey& sortBy) {
+    if (flag == "--sort=name") {
+        sortBy = _BY_NAME;
+    } else if (flag == "--sort=size") {
+        sortBy = _BY_SIZE;
+    } else if (flag == "--sort=time") {
+        sortBy = _BY_TIME;
+    } else if (flag.size() > 1 && flag[1] != '-') {
+        for (size_t i = 1; i < flag.size(); i++) {
+            if (flag[i] == 'l') {
+                longFormat = true;
+            } else if (flag[i] == 'R') {
+                recursive = true;
+            } else if (flag[i] == 'S') {
+                sortBy = _BY_SIZE;
+            } else if (flag[i] == 't') {
+                sortBy = _BY_TIME;
+            } else {
+                return false;
             }
-            firstIndex = index;
         }
-        fseek(fp, currentFATStart + firstIndex * 4, SEEK_SET);
-        fwrite(&EOCVAL, 4, 1, fp);
-        currentFATStart += FAT_SIZE;
-        i++;
+    } else {
+        return false;
     }
-    fclose(fp);
+    return true;
 }
 
-void updateTimes(FileNode* parentDirectory, uint16_t date, uint16_t time) {
-    parentDirectory->setModifiedDate(date);
-    parentDirectory->setModifiedTime(time);
-    bool foundLfn = false;
-    bool completed = false;
-    FileNode* grandFather = parentDirectory->parentRef;
-    FILE* fpx = fopen(imgFile, "r+");
-    for (auto& cluster : *(grandFather->clusterChain)) {
-        for (int i = 0; i < CLUSTER_SIZE / sizeof(FatFileEntry) && !completed; i++) {
-            unsigned long offset = DATA_START + (cluster - 2) * CLUSTER_SIZE + i * sizeof(FatFileEntry);
-            fseek(fpx, offset, SEEK_SET);
-            FatFileEntry* entry = new FatFileEntry;
-            fread(entry, sizeof(FatFileEntry), 1, fpx);
-            if (entry->msdos.attributes == 0xF && entry->lfn.checksum == parentDirectory->checksum) {
-                foundLfn = true;
-            } else if (foundLfn && entry->msdos.attributes == 0x10) {
-                entry->msdos.modifiedDate = date;
-                entry->msdos.modifiedTime = time;
-                fseek(fpx, offset, SEEK_SET);
-                fwrite(entry, sizeof(FatFileEntry), 1, fpx);
-                completed = true;
-            }
-            delete entry;
-        }
-        if (completed) {
-            break;
-        }
-    }
-}
-/*
-bool updateParent(FileNode* file, int emptyClusterIndex) {
-    FILE* fp = fopen(imgFile, "r+");
-    unsigned numEntries = ceil(file->name.size() / 13.0) + 1;
-    if (emptyClusterIndex == 0) {
-        for (auto& parentCluster : *(file->parentRef->clusterChain)) {
-            for (int i = 0; i < CLUSTER_SIZE / sizeof(FatFileEntry); i++) {
-                FatFileEntry* buffer;
-                unsigned offset = DATA_START + (parentCluster - 2) * CLUSTER_SIZE + i * sizeof(FatFileEntry);
-                fseek(fp, offset, SEEK_SET);
-                fread(buffer, sizeof(FatFileEntry), 1, fp);
-                if (buffer->lfn.checksum == file->checksum) {
-                    numEntries--;
-                } else if (numEntries == 0 && emptyClusterIndex == 0) {
-                    // NECESSARY? buffer->msdos.lastAccessTime
-                    unsigned newStart = file->parentRef->clusterChain->at(1);
-                    buffer->msdos.eaIndex = (newStart & 0xFFFF0000) >> 16;
-                    buffer->msdos.firstCluster = (newStart & 0x0000FFFF);
-                    fseek(fp, offset, SEEK_SET);
-                    fwrite(buffer, sizeof(FatFileEntry), 1, fp);
-                }
-            }
+// Children other than the dot entries, in disk order or sorted (largest and newest first, like ls).
+vector<FileNode*> listedChildren(FileNode* directory, enum sortKey sortBy) {
+    vector<FileNode*> children;
+    children.reserve(directory->children.size());
+    for (auto& child : directory->children) {
+        if (child->type != _DOT) {
+            children.push_back(child);
         }
     }
-    if (emptyClusterIndex == -1) {
-        return true;
-    }
-    uint32_t zeroEntry = 0;
-    for (int i = 0; i < NUM_FATS; i++) {
-        fseek(fp, FAT_START + i * FAT_SIZE + file->clusterChain->at(emptyClusterIndex) * 4, SEEK_SET);
-        fwrite(&zeroEntry, 4, 1, fp);
-    }
-    if (emptyClusterIndex == 0) {
-        return true;
-    }
-    size_t parentCCSize = file->parentRef->clusterChain->size();
-    if (parentCCSize == 2) {
-        file->parentRef->clusterChain->erase(file->parentRef->clusterChain->begin() + emptyClusterIndex);
-        return true;
+    if (sortBy == _BY_NAME) {
+        stable_sort(children.begin(), children.end(), [](FileNode* a, FileNode* b) { return a->name < b->name; });
+    } else if (sortBy == _BY_SIZE) {
+        stable_sort(children.begin(), children.end(), [](FileNode* a, FileNode* b) {
+            return (a->type == _FILE ? a->fileSize : 0) > (b->type == _FILE ? b->fileSize : 0);
+        });
+    } else if (sortBy == _BY_TIME) {
+        stable_sort(children.begin(), children.end(), [](FileNode* a, FileNode* b) {
+            return ((uint32_t) a->binaryModifiedDate << 16 | a->binaryModifiedTime) > ((uint32_t) b->binaryModifiedDate << 16 | b->binaryModifiedTime);
+        });
     }
-    deque<unsigned> after;
-    for (int i = emptyClusterIndex + 1; i < parentCCSize; i++) {
-        after.push_back(file->parentRef->clusterChain->at(i));
-    }
-    for (int i = emptyClusterIndex; i < parentCCSize; i++) {
-        file->parentRef->clusterChain->erase(file->parentRef->clusterChain->begin() + i);
+    return children;
+}
+
+void appendLongLine(OutputBuffer& out, FileNode* child) {
+    if (child->type == _FOLDER) {
+        out.append("drwx------ 1 root root 0 ", 25);
+    } else {
+        out.append("-rwx------ 1 root root ", 23);
+        out.appendNumber(child->fileSize);
+        out.append(' ');
     }
-    fclose(fp);
-    updateFAT(file->parentRef, after);
-    return true;
+    out.appendNumber(child->modifiedYear);
+    out.append(' ');
+    out.append(child->modifiedMonth);
+    out.append(' ');
+    out.appendNumber(child->modifiedDay);
+    out.append(' ');
+    out.appendTwoDigits(child->modifiedHour);
+    out.append(':');
+    out.appendTwoDigits(child->modifiedMinute);
+    out.append(' ');
+    out.append(child->name);
+    out.append('\n');
 }
-*/
 
-bool reserveNewCluster(FileNode* parentDirectory, unsigned remainingEntries) {
-    unsigned neededClusters = remainingEntries / (CLUSTER_SIZE / sizeof(FatFileEntry)) + 1;
-    FILE* fp = fopen(imgFile, "r");
-    deque<unsigned> newClusterIndices;
-    for (unsigned i = 2; i < FAT_SIZE / 4, newClusterIndices.size() < neededClusters; i++) {
-        fseek(fp, FAT_START + i * 4, SEEK_SET);
-        uint32_t entry;
-        fread(&entry, 4, 1, fp);
-        if (entry != 0) {
-            continue;
-        }
-        fseek(fp, DATA_START + (i - 2) * CLUSTER_SIZE, SEEK_SET);
-        bool fullEmpty = true;
-        for (unsigned j = 0; j < CLUSTER_SIZE / sizeof(FatFileEntry); j++) {
-            FatFileEntry* entry = new FatFileEntry;
-            fread(entry, sizeof(FatFileEntry), 1, fp);
-            if (entry->msdos.attributes != 0) {
-                fullEmpty = false;
-                break;
-            }
-            delete entry;
-        }
-        if (fullEmpty) {
-            newClusterIndices.push_back(i);
+void listDirectory(OutputBuffer& out, FileNode* directory, bool longFormat, enum sortKey sortBy) {
+    for (auto& child : listedChildren(directory, sortBy)) {
+        if (longFormat) {
+            appendLongLine(out, child);
+        } else {
+            out.append(child->name);
+            out.append(' ');
         }
     }
-    fclose(fp);
-    if (newClusterIndices.size() == neededClusters) {
-        if (parentDirectory->clusterChain->size() == 0) { // First time creation, for the sake of consistency
-            parentDirectory->firstClusterIndex = newClusterIndices[0];
-            parentDirectory->clusterChain->push_back(newClusterIndices[0]);
-            newClusterIndices.pop_front();
-        }
-        updateFAT(parentDirectory, newClusterIndices);
-        for (auto& index : newClusterIndices) {
-            parentDirectory->clusterChain->push_back(index);
-        }
-        FILE* fp2 = fopen(imgFile, "r+");
-        FREE_CLUSTERS -= neededClusters;
-        fseek(fp2, FS_INFO_START + 488, SEEK_SET);
-        fwrite(&FREE_CLUSTERS, 4, 1, fp2);
-        fclose(fp2);
-        return true;
+    if (!longFormat) {
+        out.append('\n');
     }
-    return false;
 }
 
-vector<unsigned> getAvailableAddresses(FileNode* parentDirectory, unsigned numEntries) {
-    bool addressesFound = false;
-    vector<unsigned> spaces;
-    FILE* fp = fopen(imgFile, "r");
-    FatFileEntry* dummyEntry = new FatFileEntry;
-    for (auto& cluster : *(parentDirectory->clusterChain)) {
-        fseek(fp, DATA_START + (cluster - 2) * CLUSTER_SIZE, SEEK_SET);
-        for (unsigned i = 0; i < CLUSTER_SIZE / sizeof(FatFileEntry); i++) {
-            fread(dummyEntry, sizeof(FatFileEntry), 1, fp);
-            if (dummyEntry->msdos.attributes == 0) { // found a space
-                spaces.push_back(DATA_START  + (cluster - 2) * CLUSTER_SIZE + i * 32);
-            } else {
-                spaces.erase(spaces.begin(), spaces.end());
-            }
-            if (spaces.size() == numEntries) {
-                addressesFound = true;
-                break;
-            }
+// ls -R: every directory below path gets a "path:" header followed by its listing, subdirectories in listing order.
+void listRecursive(OutputBuffer& out, FileNode* base, const string& basePath, bool longFormat, enum sortKey sortBy) {
+    vector<pair<FileNode*, string>> stack = {{base, basePath}};
+    bool first = true;
+    while (stack.size()) {
+        pair<FileNode*, string> current = stack.back();
+        stack.pop_back();
+        if (!first) {
+            out.append('\n');
         }
-        if (addressesFound) {
-            break;
+        first = false;
+        out.append(current.second);
+        out.append(":\n", 2);
+        if (current.first->isListable()) {
+            listDirectory(out, current.first, longFormat, sortBy);
         }
-    }
-    delete dummyEntry;
-    fclose(fp);
-    if (!addressesFound) { // fallback
-        unsigned remaining = numEntries - spaces.size();
-        bool hasReserved = reserveNewCluster(parentDirectory, remaining);
-
-        // clusters in "spaces" are already available and can be reserved. find places for the remaining entries
-        if (hasReserved) {
-            return getAvailableAddresses(parentDirectory, numEntries);
-        } else { // address & new cluster not found, returns zero sized vector
-            spaces.erase(spaces.begin(), spaces.end());
-            return spaces;
+        vector<FileNode*> children = listedChildren(current.first, sortBy);
+        for (auto it = children.rbegin(); it != children.rend(); it++) {
+            if ((*it)->type == _FOLDER) {
+                stack.push_back({*it, current.second + (current.second == "/" ? "" : "/") + (*it)->name});
+            }
         }
-        /*
-        reserving needs to:
-            - find an available space in data area if exists
-            - update fat table (does it have to update all tables?):
-                - find new space in fat table (and store its address ex. 0x0a)
-                - write EOC in that address
-                - go to the last chain index of fat table and update it with stored address
-                - then inform the calling routine about reserved or not
-        -- sending arguments to reserveNewCluster will make it too specific.
-           it should be used in another context as well.
-        */
     }
-    return spaces;
 }
 
-vector<unsigned>* getClusterChain(uint32_t firstClusterIndex) {
-    vector<unsigned>* clusterChain = new vector<unsigned>;
-    unsigned currentCluster = firstClusterIndex;
-    if (currentCluster == 0) { // For empty files
-        return clusterChain;
+void printTree(OutputBuffer& out, FileNode* base, const string& basePath, enum sortKey sortBy) {
+    struct TreeItem {
+        FileNode* node;
+        string prefix;
+        bool last;
+    };
+    unsigned long long directories = 0;
+    unsigned long long files = 0;
+    out.append(basePath);
+    out.append('\n');
+    vector<TreeItem> stack;
+    vector<FileNode*> children = listedChildren(base, sortBy);
+    for (size_t i = children.size(); i > 0; i--) {
+        stack.push_back({children[i - 1], "", i == children.size()});
     }
-    clusterChain->push_back(currentCluster);
-    FILE* fp = fopen(imgFile, "r");
-    uint8_t* currentByte = new uint8_t;
-    while (1) {
-        fseek(fp, FAT_START + currentCluster * 4, SEEK_SET);
-        vector<unsigned> fatEntry;
-        unsigned entryValue;
-        for (int j = 0; j < 4; j++) {
-            fread(currentByte, sizeof(uint8_t), 1, fp);
-            fatEntry.push_back(unsigned(*currentByte));
+    while (stack.size()) {
+        TreeItem item = stack.back();
+        stack.pop_back();
+        out.append(item.prefix);
+        out.append(item.last ? "\u2514\u2500\u2500 " : "\u251c\u2500\u2500 ");
+        out.append(item.node->name);
+        out.append('\n');
+        if (item.node->type != _FOLDER) {
+            files++;
+            continue;
         }
-        entryValue = fatEntry[0] + (fatEntry[1] << 8) + (fatEntry[2] << 16) + (fatEntry[3] << 24);
-        if (entryValue == EOCVAL) {
-            break;
+        directories++;
+        string childPrefix = item.prefix + (item.last ? "    " : "\u2502   ");
+        children = listedChildren(item.node, sortBy);
+        for (size_t i = children.size(); i > 0; i--) {
+            stack.push_back({children[i - 1], childPrefix, i == children.size()});
         }
-        clusterChain->push_back(entryValue);
-        currentCluster = entryValue;
     }
-    delete currentByte;
-    fclose(fp);
-    return clusterChain;
+    out.append('\n');
+    out.appendNumber(directories);
+    out.append(directories == 1 ? " directory, " : " directories, ");
+    out.appendNumber(files);
+    out.append(files == 1 ? " file\n" : " files\n");
 }
 
-void getFileAndFolders(FileNode* root) {
-    FILE* fp = fopen(imgFile, "r+");
-    vector<unsigned>* clusterChain = root->clusterChain;
-    string concatLfn = "";
-    uint8_t checksum = 0;
-    for (auto& clusterIndex : *clusterChain) {
-        unsigned offset = DATA_START + (clusterIndex - 2) * CLUSTER_SIZE;
-        fseek(fp, offset, SEEK_SET);
-        for (int i = 0; i < CLUSTER_SIZE / sizeof(FatFileEntry); i++) {
-            FatFileEntry* fatFile = new FatFileEntry; // memleak
-            string name83;
-            fread(fatFile, sizeof(FatFileEntry), 1, fp);
-            unsigned attributes = fatFile->msdos.attributes;
-            if (fatFile->msdos.filename[0] == 0xE5) { // Deleted entry fix
-                fseek(fp, offset + i * sizeof(FatFileEntry), SEEK_SET);
-                fwrite(ZERO_ENTRY, sizeof(FatFileEntry), 1, fp);
-            } else if (attributes == 0xF) { // LFN entry
-                string lfnName;
-                for (int j = 0; j < 5; j++) {
-                    if (!isascii(fatFile->lfn.name1[j]) || fatFile->lfn.name1[j] == 0 || fatFile->lfn.name1[j] == 32) {
-                        break;
-                    }
-                    lfnName.push_back((char) fatFile->lfn.name1[j]);
-                }
-                for (int j = 0; j < 6; j++) {
-                    if (!isascii(fatFile->lfn.name2[j]) || fatFile->lfn.name2[j] == 0 || fatFile->lfn.name2[j] == 32) {
-                        break;
-                    }
-                    lfnName.push_back((char) fatFile->lfn.name2[j]);
-                }
-                for (int j = 0; j < 2; j++) {
-                    if (!isascii(fatFile->lfn.name3[j]) || fatFile->lfn.name3[j] == 0 || fatFile->lfn.name3[j] == 32) {
-                        break;
-                    }
-                    lfnName.push_back((char) fatFile->lfn.name3[j]);
-                }
-                concatLfn = lfnName + concatLfn;
-                checksum = fatFile->lfn.checksum;
-            } else if (attributes == 0x10 || attributes == 0x20) { // 8.3 entry
-                for (int j = 0; j < 8; j++) {
-                    if (!isascii(fatFile->msdos.filename[j]) || fatFile->msdos.filename[j] == 0 || fatFile->msdos.filename[j] == 32) {
-                        break;
-                    }
-                    name83.push_back(fatFile->msdos.filename[j]);
-                }
-                if (concatLfn.size()) { // end of LFN
-                    uint32_t firstCluster = (fatFile->msdos.eaIndex << 16) + fatFile->msdos.firstCluster;
-                    FileNode* newNode = new FileNode;
-                    newNode->name = concatLfn;
-                    newNode->parentRef = root;
-                    newNode->type = attributes == 16 ? _FOLDER : _FILE;
-                    newNode->firstClusterIndex = firstCluster;
-                    newNode->clusterChain = getClusterChain(firstCluster);
-                    newNode->entry = fatFile;
-                    newNode->checksum = checksum;
-                    string order;
-                    for (int i = 1; i < 8; i++) {
-                        if (name83[i] == ' ' || name83[i] == 0) {
-                            break;
-                        }
-                        order.push_back(name83[i]);
-                    }
-                    newNode->order = stoi(order);
-                    newNode->setModifiedDate(fatFile->msdos.modifiedDate);
-                    newNode->setModifiedTime(fatFile->msdos.modifiedTime);
-                    newNode->fileSize = fatFile->msdos.fileSize;
-                    newNode->creationMs = fatFile->msdos.creationTimeMs;
-                    root->children.push_back(newNode);
-                    concatLfn.erase();
-                    checksum = 0;
-                } else {
-                    if (name83 == ".") {
-                        FileNode* fptr = new FileNode(*root);
-                        fptr->name = ".";
-                        fptr->realName = root->name;
-                        fptr->realNode = root;
-                        fptr->type = _DOT;
-                        root->children.push_back(fptr);
-                    } else if (name83 == "..") {
-                        FileNode* fptr = new FileNode(*(root->parentRef));
-                        fptr->name = "..";
-                        fptr->realName = root->parentRef->name;
-                        fptr->realNode = root->parentRef;
-                        fptr->type = _DOT;
-                        root->children.push_back(fptr);
-                    }
-                } 
+/*
+ Streaming mode commands. They walk directories with DirectoryStream instead of the tree, so
+ only ls, cd, find and cat are offered along with df, sync and cachestat. Output is written as
+ entries are decoded: ls lists in disk order only, and find prints matches in the order it
+ walks the directories instead of sorted.
+*/
+// Absolute form of path relative to currentPath, with "." and ".." components applied.
+string joinPath(const string& currentPath, const string& path) {
+    vector<string> components;
+    for (auto& component : extractDirectories(path[0] == '/' ? path : currentPath + "/" + path)) {
+        if (component == "..") {
+            if (components.size()) {
+                components.pop_back();
             }
-            delete fatFile;
+        } else if (component != "/" && component != "." && component.size()) {
+            components.push_back(component);
         }
     }
-    fclose(fp);
-}
-
-void createTree(FileNode* root) {
-    if (root->type == _FOLDER) {
-        getFileAndFolders(root);
-        for (auto& child : root->children) {
-            createTree(child);
-        }
+    string joined;
+    for (auto& component : components) {
+        joined += "/" + component;
     }
+    return joined.size() ? joined : "/";
 }
 
-FileNode* findFile(FileNode* currentDir, vector<string>& directories) {
-    bool found = false;
-    if (directories.size() == 0) {
-        return nullptr;
+// Reads a manifest of paths, one per line with directories ending in a slash, relative to basePath.
+bool readManifest(const string& manifestPath, const string& basePath, vector<string>& paths) {
+    ifstream manifest(manifestPath);
+    if (!manifest) {
+        return false;
     }
-
-    if (directories[0] == "/") {
-        currentDir = *fileTree;
-        directories.erase(directories.begin());
-        if (directories.size() == 0) {
-            return currentDir;
+    string path;
+    while (getline(manifest, path)) {
+        if (path.size() && path.back() == '\r') {
+            path.pop_back();
         }
-    }
-    for (auto& child : currentDir->children) {
-        if (child->name == directories[0]) {
-            found = true;
-            if (child->type == _FOLDER) {
-                if (directories.size() == 1) {
-                    return child;
-                }
-                vector<string> newVector(directories.begin() + 1, directories.end());
-                return findFile(child, newVector);
-            } else if (child->type == _DOT) {
-                if (directories.size() == 1) {
-                    return child->realNode;
-                }
-                vector<string> newVector(directories.begin() + 1, directories.end());
-                return findFile(child->realNode, newVector);
-            } else if (child->type == _FILE && directories.size() == 1) {
-                return child;
-            }
-        } else if (directories[0] == "." && currentDir->name == "/") {
-            if (directories.size() == 1) {
-                return currentDir;
-            }
-            vector<string> newVector(directories.begin() + 1, directories.end());
-            return findFile(currentDir, newVector);
+        if (path.size()) {
+            paths.push_back(joinPath(basePath, path) + (path.back() == '/' ? "/" : ""));
         }
     }
-    if (!found) {
-        return nullptr;
-    }
+    return true;
 }
 
-string findAbsolutePath(FileNode* file) { // USE FOR FOLDERS
-    if (file->name == "/") {
-        return "/";
-    }
-    string path = "";
-    deque<string> names;
-    while (file->parentRef != nullptr) {
-        names.push_front(file->name);
-        file = file->parentRef;
-    }
-    for (int i = 0; i < names.size() - 1; i++) {
-        path = path + names[i];
-        path.push_back('/');
+void appendStreamLongLine(OutputBuffer& out, const StreamEntry& entry) {
+    if (entry.type == _FOLDER) {
+        out.append("drwx------ 1 root root 0 ", 25);
+    } else {
+        out.append("-rwx------ 1 root root ", 23);
+        out.appendNumber(entry.fileSize);
+        out.append(' ');
     }
-    path += names[names.size() - 1];
-    return "/" + path;
+    unsigned month = (entry.modifiedDate & 480) >> 5;
+    out.appendNumber(1980 + (entry.modifiedDate >> 9));
+    out.append(' ');
+    out.append(month < MONTHS.size() ? MONTHS[month] : "???");
+    out.append(' ');
+    out.appendNumber(entry.modifiedDate & 31);
+    out.append(' ');
+    out.appendTwoDigits(entry.modifiedTime >> 11);
+    out.append(':');
+    out.appendTwoDigits((entry.modifiedTime & 2016) >> 5);
+    out.append(' ');
+    out.append(entry.name.data(), entry.name.size());
+    out.append('\n');
 }
 
-void printFatEntries(FileNode* node) {
-    FILE* fp = fopen(imgFile, "r");
-    for (auto& cluster : *node->clusterChain) {
-        cout << "cluster is " << cluster << endl;
-        fseek(fp, FAT_START + cluster * 4, SEEK_SET);
-        uint8_t* bytes = new uint8_t[4];
-        for (int j = 0; j < 4; j++) {
-            fread(bytes + j, sizeof(uint8_t), 1, fp);
-            printf("0x%X ", bytes[j]);
+void streamList(OutputBuffer& out, unsigned cluster, bool longFormat) {
+    DirectoryStream stream(cluster);
+    StreamEntry entry;
+    bool listed = false;
+    while (stream.next(entry)) {
+        if (entry.type == _DOT) {
+            continue;
+        }
+        listed = true;
+        if (longFormat) {
+            appendStreamLongLine(out, entry);
+        } else {
+            out.append(entry.name.data(), entry.name.size());
+            out.append(' ');
         }
-        delete[] bytes;
-        cout << endl;
     }
-    fclose(fp);
+    if (listed && !longFormat) {
+        out.append('\n');
+    }
 }
 
-void printCluster(unsigned cluster) {
-    FatFileEntry* fatFile = new FatFileEntry;
-    FILE* fp = fopen(imgFile, "r");
-    fseek(fp, DATA_START + (cluster - 2) * CLUSTER_SIZE, SEEK_SET);
-    string concatName;
-    for (int i = 0; i < CLUSTER_SIZE / sizeof(FatFileEntry); i++) { // ROOT DIRECTORY - CLUSTER 2
-        char* name = new char[13];
-        char* extension = new char[3];
-        char* shortName = new char[7];
-        uint8_t sequenceNumber;
-        uint8_t firstByte;
-        fread(fatFile, sizeof(FatFileEntry), 1, fp);
-        unsigned attributes = fatFile->msdos.attributes;
-        if (attributes == 15) { // LFN entry
-            string current;
-            for (int j = 0; j < 5; j++) {
-                if (!isascii(fatFile->lfn.name1[j]) || fatFile->lfn.name1[j] == 0 || fatFile->lfn.name1[j] == 32) {
-                    //break;
-                }
-                cout << "pushing val" << fatFile->lfn.name1[j] << "i = " << i << endl;
-                current.push_back((char) fatFile->lfn.name1[j]);
-            }
-            for (int j = 0; j < 6; j++) {
-                if (!isascii(fatFile->lfn.name2[j]) || fatFile->lfn.name2[j] == 0 || fatFile->lfn.name2[j] == 32) {
-                    //break;
-                }
-                cout << "pushing val" << fatFile->lfn.name2[j] << "i = " << i << endl;
-                current.push_back((char) fatFile->lfn.name2[j]);
-            }
-            for (int j = 0; j < 2; j++) {
-                if (!isascii(fatFile->lfn.name3[j]) || fatFile->lfn.name3[j] == 0 || fatFile->lfn.name3[j] == 32) {
-                    //break;
-                }
-                cout << "pushing val" << fatFile->lfn.name3[j] << "i = " << i << endl;
-                current.push_back((char) fatFile->lfn.name3[j]);
-            }
-            concatName = current + concatName;
-            cout << "name = " << concatName << "\t\t\t\t\t";
-            printf("sequence no = 0x%X ", fatFile->lfn.sequence_number);
-            cout << "checksum = " << fatFile->lfn.checksum << endl;
-        } else if (attributes == 16 || attributes == 32) { // 8.3 entry
-            concatName.erase();
-            for (int j = 0; j < 8; j++) {
-                if (!isascii(fatFile->msdos.filename[j]) || fatFile->msdos.filename[j] == 0 || fatFile->msdos.filename[j] == 32) {
-                    break;
-                }
-                if (j == 0) {
-                    printf("adding char[0] 0x%X", fatFile->msdos.filename[j]);
-                    cout << " int value = " << (int) fatFile->msdos.filename[0] << endl;
-                } else {
-                    cout << "adding a char -> " << fatFile->msdos.filename[j] << " int value = " << (int) fatFile->msdos.filename[j] << endl;
-                }
-                name[j] = fatFile->msdos.filename[j];
-            }
-            cout << "name = ..." << fatFile->msdos.filename << "...\n";
-            for (int j = 0; j < 3; j++) {
-                cout << "int val of extension + " << j << " = " << (int) fatFile->msdos.extension[j] << endl;
-                cout << "attributes = " << fatFile->msdos.attributes << endl;
+// Depth first walk holding one DirectoryStream per level, so memory follows the depth of the tree and not its size.
+void streamFind(OutputBuffer& out, unsigned baseCluster, string path, const string& pattern, bool glob) {
+    vector<DirectoryStream> stack;
+    vector<size_t> pathLengths = {path.size()};
+    stack.emplace_back(baseCluster);
+    char name[LFN_NAME_MAX + 1];
+    StreamEntry entry;
+    while (stack.size()) {
+        if (!stack.back().next(entry)) {
+            stack.pop_back();
+            pathLengths.pop_back();
+            if (pathLengths.size()) {
+                path.resize(pathLengths.back());
             }
+            continue;
+        }
+        if (entry.type == _DOT) {
+            continue;
+        }
+        size_t parentLength = path.size();
+        if (path.back() != '/') {
+            path.push_back('/');
+        }
+        path.append(entry.name.data(), entry.name.size());
+        bool match;
+        if (glob) {
+            memcpy(name, entry.name.data(), entry.name.size());
+            name[entry.name.size()] = 0;
+            match = fnmatch(pattern.c_str(), name, 0) == 0;
+        } else {
+            match = entry.name.find(pattern) != string_view::npos;
+        }
+        if (match) {
+            out.append(path);
+            out.append('\n');
+        }
+        if (entry.type == _FOLDER && entry.firstCluster != 0) {
+            stack.emplace_back(entry.firstCluster);
+            pathLengths.push_back(path.size());
+        } else {
+            path.resize(parentLength);
         }
-        printf("file size = %u ", fatFile->msdos.fileSize);
-        printf("attributes = 0x%X ", fatFile->msdos.attributes);
-        printf("first cluster 0-1 = 0x%X 0x%x ", fatFile->msdos.eaIndex, fatFile->msdos.firstCluster);
-        printf("modified date = %u ", fatFile->msdos.modifiedDate);
-        printf("modified time = %u ", fatFile->msdos.modifiedTime);
-        cout << "order = " << i << endl;
-        cout << endl;
-        delete[] name;
-        delete[] extension;
-        delete[] shortName;
-    }
-    fclose(fp);
-    cout << "END OF CLUSTER " << cluster << endl;
-}
-
-bool createDotEntries(FileNode* newDirNode) {
-    FileNode* dotEntry = new FileNode(*newDirNode);
-    dotEntry->name = ".";
-    dotEntry->realName = newDirNode->name;
-    dotEntry->realNode = newDirNode;
-    dotEntry->type = _DOT;
-    newDirNode->children.push_back(dotEntry);
-    FatFileEntry* dot83 = new FatFileEntry;
-    dot83->msdos.filename[0] = 0x2E;
-    for (int j = 1; j < 8; j++) {
-        dot83->msdos.filename[j] = 0x20;
-    }
-    for (int j = 0; j < 3; j++) {
-        dot83->msdos.extension[j] = 0x20;
-    }
-    dot83->msdos.fileSize = 0;
-    dot83->msdos.attributes = 0x10;
-    dot83->msdos.reserved = 0;
-    uint16_t creationTime = getCurrentTime();
-    uint16_t creationDate = getCurrentDate();
-    dot83->msdos.creationTimeMs = getCurrentMs();
-    dot83->msdos.creationDate = creationDate;
-    dot83->msdos.creationTime = creationTime;
-    dot83->msdos.modifiedDate = creationDate;
-    dot83->msdos.modifiedTime = creationTime;
-    dot83->msdos.eaIndex = (newDirNode->firstClusterIndex & 0xFFFF0000) >> 16;
-    dot83->msdos.firstCluster = (newDirNode->firstClusterIndex & 0x0000FFFF);
-    FileNode* parentDirectory = newDirNode->parentRef;
-    FileNode* twoDotEntry = new FileNode(*parentDirectory);
-    twoDotEntry->name = "..";
-    twoDotEntry->realName = parentDirectory->name;
-    twoDotEntry->realNode = parentDirectory;
-    twoDotEntry->type = _DOT;
-    newDirNode->children.push_back(twoDotEntry);
-    FatFileEntry* twoDot83 = new FatFileEntry;
-    twoDot83->msdos.filename[0] = 0x2E;
-    twoDot83->msdos.filename[1] = 0x2E;
-    for (int j = 2; j < 8; j++) {
-        twoDot83->msdos.filename[j] = 0x20;
-    }
-    for (int j = 0; j < 3; j++) {
-        twoDot83->msdos.extension[j] = 0x20;
     }
-    twoDot83->msdos.fileSize = 0;
-    twoDot83->msdos.attributes = 0x10;
-    twoDot83->msdos.reserved = 0;
-    twoDot83->msdos.creationTimeMs = getCurrentMs();
-    twoDot83->msdos.creationDate = creationDate;
-    twoDot83->msdos.creationTime = creationTime;
-    twoDot83->msdos.modifiedDate = creationDate;
-    twoDot83->msdos.modifiedTime = creationTime;
-    twoDot83->msdos.eaIndex = parentDirectory->name == "/" ? 0 : (parentDirectory->firstClusterIndex & 0xFFFF0000) >> 16;
-    twoDot83->msdos.firstCluster = parentDirectory->name == "/" ? 0 : (parentDirectory->firstClusterIndex & 0x0000FFFF);
-    FILE* fpx = fopen(imgFile, "r+");
-    fseek(fpx, DATA_START + CLUSTER_SIZE * (newDirNode->firstClusterIndex - 2), SEEK_SET);
-    fwrite(dot83, sizeof(FatFileEntry), 1, fpx);
-    fseek(fpx, DATA_START + CLUSTER_SIZE * (newDirNode->firstClusterIndex - 2) + 32, SEEK_SET);
-    fwrite(twoDot83, sizeof(FatFileEntry), 1, fpx);
-    fclose(fpx);
 }
 
-FileNode* searchForParent(FileNode* currentDir, vector<string> directories) {
-    string folderName = directories[directories.size() - 1];
-    FileNode* parentDirectory;
-    bool parentContainsFolder = false;
-    if (directories.size() > 1) {
-        vector<string> v(directories.begin(), directories.end() - 1);
-        parentDirectory = findFile(currentDir, v);
-    } else {
-        parentDirectory = currentDir;
-    }
-    if (parentDirectory == nullptr) {
-        return nullptr;
-    }
-    for (auto& child : parentDirectory->children) {
-        if (child->name == folderName) {
-            parentContainsFolder = true;
-            break;
+// Writes every cluster of a chain like cat, following the FAT window by window instead of holding the chain.
+void streamCat(ostream& out, unsigned firstCluster) {
+    size_t windowClusters = max((size_t) 1, STREAM_BUFFER_BYTES / VOLUME->clusterSize);
+    PooledBuffer data(windowClusters * VOLUME->clusterSize);
+    unsigned cluster = firstCluster;
+    while (cluster != 0) {
+        vector<IORequest> requests;
+        size_t count = 0;
+        for (; cluster != 0 && count < windowClusters; count++, cluster = nextCluster(cluster)) {
+            uint64_t offset = clusterOffset(cluster);
+            if (requests.size() && requests.back().offset + requests.back().size == offset) {
+                requests.back().size += VOLUME->clusterSize;
+            } else {
+                requests.push_back({offset, data.data + count * VOLUME->clusterSize, VOLUME->clusterSize, false});
+            }
         }
+        submitBatch(requests);
+        out.write((char*) data.data, count * VOLUME->clusterSize);
     }
-    if (parentContainsFolder) {
-        return nullptr;
-    }
-    return parentDirectory;
 }
 
-FileNode* createChild(FileNode* parentDirectory, string name, enum nodeType type) {
-    int numLfnEntries = ceil(name.size() / 13.0);
-    FileNode* newDirNode = new FileNode;
-    newDirNode->name = name;
-    newDirNode->order = parentDirectory->getMaxOrder() + 1;
-    newDirNode->parentRef = parentDirectory;
-    newDirNode->type = type;
-    newDirNode->clusterChain = new vector<unsigned>;
-    vector<unsigned> availableAddresses = getAvailableAddresses(parentDirectory, numLfnEntries + 1);
-    if (availableAddresses.size() != numLfnEntries + 1) {
-        return nullptr;
-    }
-    if (type == _FOLDER && reserveNewCluster(newDirNode, 2) == false) {
-        return nullptr;
-    }
-    FatFileEntry** entries = new FatFileEntry*[numLfnEntries + 1]; // +1 for 8.3
-    FatFileEntry* msdos = new FatFileEntry;
-    char checkSumArg[11];
-    msdos->msdos.filename[0] = 0x7E;
-    checkSumArg[0] = 0x7E;
-    string order = to_string(parentDirectory->getMaxOrder() + 1);
-    int copiedChars = 0;
-    while (copiedChars < order.size()) {
-        msdos->msdos.filename[copiedChars + 1] = order[copiedChars];
-        checkSumArg[copiedChars + 1] = order[copiedChars];
-        copiedChars++;
-    }
-    for (int i = copiedChars + 1; i < 8; i++) {
-        msdos->msdos.filename[i] = 0x20;
-        checkSumArg[i] = 0x20;
-    }
-    
-    for (int i = 0; i < 3; i++) {
-        msdos->msdos.extension[i] = 0x20;
-        checkSumArg[i + 8] = 0x20;
-    }
-    msdos->msdos.fileSize = 0;
-    msdos->msdos.eaIndex = (newDirNode->firstClusterIndex & 0xFFFF0000) >> 16;
-    msdos->msdos.firstCluster = newDirNode->firstClusterIndex & 0x0000FFFF;
-    msdos->msdos.attributes = type == _FOLDER ? 0x10 : 0x20;
-    msdos->msdos.reserved = 0;
-
-    uint16_t creationTime = getCurrentTime();
-    uint16_t creationDate = getCurrentDate();
-    msdos->msdos.creationTimeMs = getCurrentMs();
-    msdos->msdos.creationTime = creationTime;
-    msdos->msdos.modifiedTime = creationTime;
-    msdos->msdos.creationDate = creationDate;
-    msdos->msdos.modifiedDate = creationDate;
-    newDirNode->setModifiedDate(creationDate);
-    newDirNode->setModifiedTime(creationTime);
-    newDirNode->entry = msdos;
-    entries[numLfnEntries] = msdos;
-    uint8_t checksum = lfn_checksum(checkSumArg);
-    newDirNode->checksum = checksum;
-    vector<uint16_t> padding;
-    padding.reserve(13 * numLfnEntries);
-    padding[name.size()] = 0x00;
-    for (int i = name.size() + 1; i < 13 * numLfnEntries; i++) {
-        padding[i] = 0xFF;
-    }
-    for (int k = 0; k < numLfnEntries; k++) {
-        FatFileEntry* lfn = new FatFileEntry;             
-        lfn->lfn.reserved = 0x00;
-        lfn->lfn.attributes = 0x0F;
-        lfn->lfn.checksum = checksum;
-
-        lfn->lfn.firstCluster = 0x0000;
-        if (k == numLfnEntries - 1) {
-            lfn->lfn.sequence_number = 0x40 + numLfnEntries;
-        } else {
-            lfn->lfn.sequence_number = k + 1;
+void streamCommand(const vector<string>& command, ostream& out, string& pwd, unsigned& currentCluster) {
+    StreamEntry entry;
+    if (command[0] == "cd" && command.size() > 1) {
+        if (streamLookup(currentCluster, extractDirectories(command[1]), entry) && entry.type == _FOLDER) {
+            pwd = joinPath(pwd, command[1]);
+            currentCluster = entry.firstCluster;
         }
-        for (int j = 0; j < 5; j++) {
-            lfn->lfn.name1[j] = name.size() > k * 13 + j ? name[k * 13 + j] : padding[k * 13 + j];
+    } else if (command[0] == "ls") { // ls [-l] [path]
+        bool longFormat = false;
+        size_t argument = 1;
+        for (; argument < command.size() && command[argument][0] == '-'; argument++) {
+            if (command[argument] != "-l") {
+                return;
+            }
+            longFormat = true;
         }
-        for (int j = 5; j < 11; j++) {
-            lfn->lfn.name2[j - 5] = name.size() > k * 13 + j ? name[k * 13 + j] : padding[k * 13 + j];
+        unsigned cluster = currentCluster;
+        if (argument < command.size()) {
+            if (!streamLookup(currentCluster, extractDirectories(command[argument]), entry) || entry.type != _FOLDER) {
+                return;
+            }
+            cluster = entry.firstCluster;
         }
-        for (int j = 11; j < 13; j++) {
-            lfn->lfn.name3[j - 11] = name.size() > k * 13 + j ? name[k * 13 + j] : padding[k * 13 + j];
+        OutputBuffer listing(out, OUTPUT_BUFFER_BYTES);
+        streamList(listing, cluster, longFormat);
+    } else if (command[0] == "find") { // find [path] -name <glob> | find [path] -substr <text>
+        size_t optionIndex = command.size() > 1 && command[1][0] != '-' ? 2 : 1;
+        if (command.size() != optionIndex + 2 || (command[optionIndex] != "-name" && command[optionIndex] != "-substr")) {
+            return;
+        }
+        unsigned cluster = currentCluster;
+        string basePath = pwd;
+        if (optionIndex == 2) {
+            if (!streamLookup(currentCluster, extractDirectories(command[1]), entry) || entry.type != _FOLDER) {
+                return;
+            }
+            cluster = entry.firstCluster;
+            basePath = joinPath(pwd, command[1]);
+        }
+        OutputBuffer output(out, OUTPUT_BUFFER_BYTES);
+        streamFind(output, cluster, basePath, command[optionIndex + 1], command[optionIndex] == "-name");
+    } else if (command[0] == "cat" && command.size() > 1) {
+        if (streamLookup(currentCluster, extractDirectories(command[1]), entry) && entry.type == _FILE) {
+            streamCat(out, entry.firstCluster);
         }
-        entries[numLfnEntries - 1 - k] = lfn;
-    }
-    FILE* fpx = fopen(imgFile, "r+");
-    for (int i = 0; i < availableAddresses.size(); i++) {
-        fseek(fpx, availableAddresses[i], SEEK_SET);
-        fwrite(entries[i], sizeof(FatFileEntry), 1, fpx);
-    }
-    fclose(fpx);
-    if (parentDirectory->name != "/") {
-        updateTimes(parentDirectory, creationDate, creationTime);   
-    }
-    parentDirectory->children.push_back(newDirNode);
-    if (type == _FOLDER) {
-        bool created = createDotEntries(newDirNode);
-        if (!created) return nullptr;
     }
-    return newDirNode;
 }
 
-int main(int argc, char** argv) {
-    // Bytes per sector = 512
-    // cluster size = 1024 bytes
-    // Sectors per FAT = 794
-    // #FATs = 2
-    // Sectors per cluster = 2
-    // # reserved sectors = 32
-    // start byte of fat = 16384
-    // FATs size = 2 * 794 * 512 = 813056
-    // data section start = 829440
-    ZERO_ENTRY = (FatFileEntry*) calloc(1, sizeof(FatFileEntry));
-    imgFile = argv[1];
-    BPB_struct* bpb = new BPB_struct;
-    BPB32_struct* bpb32 = new BPB32_struct;
-    void* vp = ((void*) bpb) + 36;
-    bpb32 = (BPB32_struct*) vp;
-    FILE* fp2 = fopen(argv[1], "r");
-    fread(bpb, sizeof(BPB_struct), 1, fp2);
-    CLUSTER_SIZE = bpb->BytesPerSector * bpb->SectorsPerCluster;
-    FAT_START = bpb->ReservedSectorCount * bpb->BytesPerSector;
-    FAT_SIZE = bpb32->FATSize * bpb->BytesPerSector;
-    NUM_FATS = bpb->NumFATs;
-    DATA_START = FAT_START + NUM_FATS * FAT_SIZE;
-    FS_INFO_START = bpb->BytesPerSector * bpb32->FSInfo;
-    fseek(fp2, FAT_START, SEEK_SET);
-    fread(&EOCVAL, 4, 1, fp2);
-    fseek(fp2, FS_INFO_START + 488, SEEK_SET);
-    fread(&FREE_CLUSTERS, 4, 1, fp2);
-    fclose(fp2);
+// Runs commands from in against the current volume until quit or the end of input.
+void runShell(istream& in, ostream& out, bool prompt) {
     string pwd = "/";
-    FileNode* root = new FileNode;
-    root->name = "/";
-    root->firstClusterIndex = bpb32->RootCluster;
-    root->clusterChain = getClusterChain(root->firstClusterIndex); // will have memleak;
-    root->type = _FOLDER;
-    const clock_t begin_time = clock();
-    createTree(root);
-    *fileTree = root;
     string line;
-    FileNode* currentDir = root;
+    FileNode* currentDir = VOLUME->root;
+    unsigned currentCluster = VOLUME->root->firstClusterIndex;
     while (1) {
-        cout << pwd << "> ";
-        getline(cin, line);
+        if (line.size()) {
+            endCommand(); // The previous command is complete
+        }
+        if (prompt) {
+            out << pwd << "> ";
+        }
+        if (!getline(in, line)) {
+            break;
+        }
         vector<string> command = tokenizeString(line, ' ');
         if (!command.size()) { continue; }
+        TraceSpan span(command[0].c_str(), line);
         if (command[0] == "quit") {
             break;
+        } else if (VOLUME->streaming && command[0] != "df" && command[0] != "sync" && command[0] != "cachestat" && command[0] != "recount") {
+            streamCommand(command, out, pwd, currentCluster); // Commands that need the tree are ignored
         } else if (command[0] == "cd") {
-            string arg1 = string(command[1]);
-            vector<string> directories = extractDirectories(arg1);
-            FileNode* directory = findFile(currentDir, directories);
+            string path;
+            FileNode* directory = resolvePath(currentDir, pwd, command[1], &path);
             if (directory != nullptr && directory->type == _FOLDER) {
-                pwd = findAbsolutePath(directory);
+                pwd = path;
                 currentDir = directory;
             }
 
-        } else if (command[0] == "ls") {
+        } else if (command[0] == "ls") { // ls [-l] [-R] [-S|-t|--sort=name|size|time] [path]
+            bool longFormat = false;
+            bool recursive = false;
+            enum sortKey sortBy = _DISK_ORDER;
+            size_t argument = 1;
+            bool validFlags = true;
+            for (; argument < command.size() && command[argument][0] == '-'; argument++) {
+                validFlags = parseListFlag(command[argument], longFormat, recursive, sortBy) && validFlags;
+            }
+            if (!validFlags) {
+                continue;
+            }
             FileNode* listedDirectory = currentDir;
-            if (command.size() > 1 && command[1] == "-l") {
-                if (command.size() > 2) { // ls -l <path>
-                    vector<string> directories = extractDirectories(command[2]);
-                    FileNode* directory = findFile(currentDir, directories);
-                    listedDirectory = directory;
-                }
-                if (listedDirectory == nullptr || !listedDirectory->isListable()) {
-                    continue;
-                }
-                for (auto& child : listedDirectory->children) {
-                    if (child->type == _DOT) {
-                        continue;
-                    } else if (child->type == _FOLDER) {
-                        cout << "drwx------ 1 root root 0 ";
-                    } else if (child->type == _FILE) {
-                        cout << "-rwx------ 1 root root " << child->fileSize << " ";
-                    }
-                    cout << child->modifiedYear << " " << child->modifiedMonth << " " << child->modifiedDay
-                    << " ";
-                    if (child->modifiedHour < 10) {
-                        cout << "0";
-                    }
-                    cout << child->modifiedHour << ":";
-                    if (child->modifiedMinute < 10) {
-                        cout << "0";
-                    }
-                    cout << child->modifiedMinute << " " << child->name << endl;
-                }
-            } else { // ls <path> or ls
-                if (command.size() > 1) {
-                    vector<string> directories = extractDirectories(command[1]);
-                    FileNode* directory = findFile(currentDir, directories);
-                    listedDirectory = directory;
-                }
-                if (listedDirectory == nullptr || !listedDirectory->isListable()) {
-                    continue;
-                }
-                for (auto& child : listedDirectory->children) {
-                    if (child->type != _DOT) {
-                        cout << child->name << " ";
-                    }
-                }
-                cout << endl;
+            string listedPath = ".";
+            if (argument < command.size()) { // ls <path>
+                listedDirectory = resolvePath(currentDir, pwd, command[argument]);
+                listedPath = command[argument];
+            } else {
+                recordAccess(currentDir);
+            }
+            if (listedDirectory == nullptr || (!recursive && !listedDirectory->isListable())) {
+                continue;
+            }
+            OutputBuffer listing(out, OUTPUT_BUFFER_BYTES);
+            if (recursive) {
+                listRecursive(listing, listedDirectory, listedPath, longFormat, sortBy);
+            } else {
+                listDirectory(listing, listedDirectory, longFormat, sortBy);
             }
+        } else if (command[0] == "tree") { // tree [-S|-t|--sort=name|size|time] [path]
+            bool longFormat = false;
+            bool recursive = true;
+            enum sortKey sortBy = _DISK_ORDER;
+            size_t argument = 1;
+            bool validFlags = true;
+            for (; argument < command.size() && command[argument][0] == '-'; argument++) {
+                validFlags = parseListFlag(command[argument], longFormat, recursive, sortBy) && validFlags;
+            }
+            FileNode* base = argument < command.size() ? resolvePath(currentDir, pwd, command[argument]) : currentDir;
+            if (!validFlags || base == nullptr) {
+                continue;
+            }
+            OutputBuffer listing(out, OUTPUT_BUFFER_BYTES);
+            printTree(listing, base, argument < command.size() ? command[argument] : ".", sortBy);
         } else if (command[0] == "mkdir") {
             vector<string> directories = extractDirectories(command[1]);
             string folderName = directories[directories.size() - 1];
-            FileNode* parentDirectory = searchForParent(currentDir, directories);
+            FileNode* parentDirectory = searchForParent(currentDir, pwd, directories);
             if (parentDirectory == nullptr) {
                 continue;
             }
@@ -1010,7 +550,7 @@ int main(int argc, char** argv) {
         } else if (command[0] == "touch") {
             vector<string> directories = extractDirectories(command[1]);
             string fileName = directories[directories.size() - 1];
-            FileNode* parentDirectory = searchForParent(currentDir, directories);
+            FileNode* parentDirectory = searchForParent(currentDir, pwd, directories);
             if (parentDirectory == nullptr) {
                 continue;
             }
@@ -1020,194 +560,257 @@ int main(int argc, char** argv) {
                 continue;
             }
         } else if (command[0] == "cat") {
-            vector<string> directories = extractDirectories(command[1]);
-            FileNode* file = findFile(currentDir, directories);
+            FileNode* file = resolvePath(currentDir, pwd, command[1]);
             if (file == nullptr || file->type != _FILE) {
                 continue;
             }
-            FILE* fp = fopen(imgFile, "r");
-            for (auto& cluster : *(file->clusterChain)) {
-                fseek(fp, DATA_START + (cluster - 2) * CLUSTER_SIZE, SEEK_SET);
-                char* c = new char;
-                for (int i = 0; i < CLUSTER_SIZE; i++) {
-                    fread(c, sizeof(char), 1, fp);
-                    cout << *c;
-                }
-                delete c;
+            vector<unsigned>& chain = *(file->clusterChain);
+            PooledBuffer data(min((size_t) CAT_READAHEAD_MAX, chain.size()) * VOLUME->clusterSize);
+            size_t window = CAT_READAHEAD_MIN;
+            for (size_t start = 0; start < chain.size(); start += window, window = min(window * 2, (size_t) CAT_READAHEAD_MAX)) {
+                size_t count = min(window, chain.size() - start);
+                // File data is read around the block cache, which is kept for the FAT and directories
+                vector<IORequest> requests;
+                appendChainRequests(chain, start, count, data.data, requests);
+                readUncached(requests);
+                out.write((char*) data.data, count * VOLUME->clusterSize);
             }
-            fclose(fp);
         } else if (command[0] == "mv") {
-            // Find source & destination
-            vector<string> sourceDirectories = extractDirectories(command[1]);
-            vector<string> destinationDirectories = extractDirectories(command[2]);
-            FileNode* source = findFile(currentDir, sourceDirectories);
-            if (source == nullptr || source->type == _DOT || source->name == "/") {
+            FileNode* source = resolvePath(currentDir, pwd, command[1]);
+            FileNode* destinationFolder = resolvePath(currentDir, pwd, command[2]);
+            if (source == nullptr || destinationFolder == nullptr || !moveNode(source, destinationFolder)) {
                 continue;
             }
-            FileNode* srcParent = source->parentRef;
-            FileNode* destinationFolder = findFile(currentDir, destinationDirectories);
-            if (destinationFolder == nullptr || srcParent == destinationFolder || isChild(destinationFolder, source)) {
+            pwd = findAbsolutePath(currentDir);
+
+        } else if (command[0] == "cp") { // cp [-r] <source> <destination folder>
+            bool recursive = command.size() > 1 && command[1] == "-r";
+            size_t argument = recursive ? 2 : 1;
+            if (command.size() != argument + 2) {
                 continue;
             }
-            bool parentContains = false;
-            for (auto& child: destinationFolder->children) {
-                if (child->name == source->name) {
-                    parentContains = true;
-                    break;
-                }
+            FileNode* source = resolvePath(currentDir, pwd, command[argument]);
+            if (source == nullptr || (source->type == _FOLDER && !recursive)) {
+                continue;
             }
-            if (parentContains) {
+            FileNode* destinationFolder = resolvePath(currentDir, pwd, command[argument + 1]);
+            if (destinationFolder == nullptr) {
                 continue;
             }
-            // Take FatFileEntries from source parent directory and set spaces to ZERO_ENTRY
-            unsigned numEntries = ceil(source->name.size() / 13.0) + 1;
-            vector<FatFileEntry> sourceEntries;
-            FILE* fp = fopen(imgFile, "r+");
-            bool insideSourceEntries = false;
-            bool completed = false;
-            int j = 0;
-            unsigned lastCluster = -1;
-            int lastClusterIndex = -1;
-            for (auto& cluster : *(srcParent->clusterChain)) {
-                for (int i = 0; i < CLUSTER_SIZE / sizeof(FatFileEntry) && !completed; i++) {
-                    unsigned long offset = DATA_START + (cluster - 2) * CLUSTER_SIZE + i * sizeof(FatFileEntry);
-                    FatFileEntry* buffer = new FatFileEntry;
-                    fseek(fp, offset, SEEK_SET);
-                    fread(buffer, sizeof(FatFileEntry), 1, fp);
-                    if (insideSourceEntries) {
-                        sourceEntries.push_back(*buffer);
-                        fseek(fp, offset, SEEK_SET);
-                        fwrite(ZERO_ENTRY, sizeof(FatFileEntry), 1, fp);
-                        if (sourceEntries.size() == numEntries) {
-                            lastClusterIndex = j;
-                            lastCluster = cluster;
-                            completed = true;
-                        }
-                    } else if (buffer->msdos.attributes != 0xE5 && buffer->lfn.checksum == source->checksum) {
-                        sourceEntries.push_back(*buffer);
-                        fseek(fp, offset, SEEK_SET);
-                        fwrite(ZERO_ENTRY, sizeof(FatFileEntry), 1, fp);
-                        insideSourceEntries = true;
-                    }
-                    delete buffer;
-                }
-                if (completed) {
-                    break;
-                }
-                j++;
+            copyTree(source, destinationFolder);
+        } else if (command[0] == "tar-out" && command.size() == 3) { // tar-out <path> <archive>
+            FileNode* base = resolvePath(currentDir, pwd, command[1]);
+            if (base == nullptr) {
+                continue;
+            }
+            ofstream archive(command[2], ios::binary);
+            if (!archive) {
+                out << "tar-out: " << command[2] << ": " << strerror(errno) << endl;
+                continue;
+            }
+            writeTar(base, archive);
+        } else if (command[0] == "tar-in" && command.size() == 3) { // tar-in <path> <archive>
+            FileNode* destinationFolder = resolvePath(currentDir, pwd, command[1]);
+            if (destinationFolder == nullptr || destinationFolder->type != _FOLDER) {
+                continue;
+            }
+            ifstream archive(command[2], ios::binary);
+            if (!archive) {
+                out << "tar-in: " << command[2] << ": " << strerror(errno) << endl;
+                continue;
+            }
+            readTar(archive, destinationFolder);
+        } else if (command[0] == "mktree" && command.size() == 2) { // mktree <manifest>: a path per line, directories end in a slash
+            vector<string> paths;
+            if (!readManifest(command[1], pwd, paths)) {
+                out << "mktree: " << command[1] << ": " << strerror(errno) << endl;
+                continue;
+            }
+            makeTree(VOLUME->root, paths);
+        } else if (command[0] == "checksumtest") {
+            char testsum[11];
+            testsum[0] = VOLUME->root->children[0]->entry->msdos.filename[0];
+            cout << "00 name = " << VOLUME->root->children[0]->name << endl;
+            printf("00 attributes = 0x%X", VOLUME->root->children[0]->entry->msdos.attributes);
+            printf("testsum0 = 0x%X\n", testsum[0]);
+            testsum[1] = VOLUME->root->children[0]->entry->msdos.filename[1];
+            for (int k = 2; k < 11; k++) {
+                testsum[k] = ' ';
+            }
+            uint8_t cs = lfn_checksum(testsum);
+
+            cout << "checksum of [0][0] is = " << cs << endl;
+        } else if (command[0] == "find") { // find [path] -name <glob> | find [path] -substr <text>
+            size_t optionIndex = command.size() > 1 && command[1][0] != '-' ? 2 : 1;
+            if (command.size() != optionIndex + 2 || (command[optionIndex] != "-name" && command[optionIndex] != "-substr")) {
+                continue;
             }
-            if (lastCluster == -1) {
+            FileNode* base = optionIndex == 2 ? resolvePath(currentDir, pwd, command[1]) : currentDir;
+            if (base == nullptr) {
                 continue;
             }
-            /*
-             If parent cluster became empty, deallocate it 
-            bool fullEmpty = true;
-            for (int i = 0; i < CLUSTER_SIZE / sizeof(FatFileEntry); i++) {
-                FatFileEntry* buffer = new FatFileEntry;
-                unsigned long offset = DATA_START + (lastCluster - 2) * CLUSTER_SIZE + i * sizeof(FatFileEntry);
-                fseek(fp, offset, SEEK_SET);
-                fread(buffer, sizeof(FatFileEntry), 1, fp);
-                if (buffer->msdos.attributes != 0) {
-                    fullEmpty = false;
-                    break;
+            string output;
+            for (auto& path : findNames(base, command[optionIndex + 1], command[optionIndex] == "-name")) {
+                output += path;
+                output.push_back('\n');
+            }
+            out << output;
+        } else if (command[0] == "hash") { // hash [-r] [--sha256] <path>
+            bool recursive = false;
+            bool sha256 = false;
+            size_t argument = 1;
+            bool validFlags = true;
+            for (; argument < command.size() && command[argument][0] == '-'; argument++) {
+                if (command[argument] == "-r") {
+                    recursive = true;
+                } else if (command[argument] == "--sha256") {
+                    sha256 = true;
+                } else {
+                    validFlags = false;
                 }
             }
-            if (fullEmpty && srcParent->clusterChain->size() > 1 && srcParent->name != "/") { // full empty and can be shrinked
-                updateParent(srcParent, lastClusterIndex);
+            if (!validFlags || argument + 1 != command.size()) {
+                continue;
             }
-            */
-            uint16_t currDate = getCurrentDate();
-            uint16_t currTime = getCurrentTime();
-            fclose(fp);
-            if (srcParent->name != "/") {
-                updateTimes(srcParent, currDate, currTime);
+            string basePath = command[argument];
+            FileNode* base = resolvePath(currentDir, pwd, basePath);
+            if (base == nullptr) {
+                continue;
             }
-            // Update source parent directory FileNode
-            for (int i = 0; i < srcParent->children.size(); i++) {
-                if (srcParent->children[i]->name == source->name) {
-                    srcParent->children.erase(srcParent->children.begin() + i);
-                    break;
+            // A file hashes itself, a directory its files, and with -r everything below it
+            vector<HashedFile> files;
+            vector<pair<FileNode*, string>> stack = {{base, basePath}};
+            while (stack.size()) {
+                pair<FileNode*, string> top = stack.back();
+                stack.pop_back();
+                if (top.first->type == _FILE) {
+                    files.push_back({top.first, top.second, "", false});
+                    continue;
+                }
+                for (auto& child : top.first->children) {
+                    if (child->type == _FILE || (recursive && child->type == _FOLDER)) {
+                        stack.push_back({child, top.second + (top.second.back() == '/' ? "" : "/") + child->name});
+                    }
                 }
             }
-            // Update source FatFileEntries
-
-            // Update source/..
-            fp = fopen(imgFile, "r+");
-            FatFileEntry* twoDot = new FatFileEntry;
-            unsigned firstCluster = source->clusterChain->at(0);
-            unsigned long offset = DATA_START + (firstCluster - 2) * CLUSTER_SIZE + sizeof(FatFileEntry);
-            fseek(fp, offset, SEEK_SET);
-            fread(twoDot, sizeof(FatFileEntry), 1, fp);
-            unsigned parentFirstCluster = destinationFolder->clusterChain->at(0);
-            twoDot->msdos.eaIndex = (parentFirstCluster & 0xFFFF0000) >> 16;
-            twoDot->msdos.firstCluster = (parentFirstCluster & 0x0000FFFF);
-            fseek(fp, offset, SEEK_SET);
-            fwrite(twoDot, sizeof(FatFileEntry), 1, fp);
-            delete twoDot;
-            fclose(fp);
-            // Update source FileNode
-            source->parentRef = destinationFolder;
-            source->order = destinationFolder->getMaxOrder() + 1;
-            if (source->type == _FOLDER) {
-                for (auto& child : source->children) {
-                    if (child->name == "..") {
-                        child->realNode = destinationFolder;
-                        child->realName = destinationFolder->name;
-                        break;
+            // Workers pick files in disk order so that reads sweep the image forward
+            sort(files.begin(), files.end(), [](const HashedFile& a, const HashedFile& b) {
+                return a.node->firstClusterIndex < b.node->firstClusterIndex;
+            });
+            hashFiles(files, sha256);
+            sort(files.begin(), files.end(), [](const HashedFile& a, const HashedFile& b) {
+                return a.path < b.path;
+            });
+            string output;
+            for (auto& file : files) {
+                output += file.readable ? file.digest + "  " + file.path + "\n" : file.path + ": read error\n";
+            }
+            // Duplicates share the size first and the digest second. Empty files are not reported.
+            vector<HashedFile*> candidates;
+            for (auto& file : files) {
+                if (file.readable && file.node->fileSize > 0) {
+                    candidates.push_back(&file);
+                }
+            }
+            stable_sort(candidates.begin(), candidates.end(), [](const HashedFile* a, const HashedFile* b) {
+                return a->node->fileSize != b->node->fileSize ? a->node->fileSize < b->node->fileSize : a->digest < b->digest;
+            });
+            for (size_t first = 0; first < candidates.size();) {
+                size_t end = first + 1;
+                while (end < candidates.size() && candidates[end]->node->fileSize == candidates[first]->node->fileSize
+                    && candidates[end]->digest == candidates[first]->digest) {
+                    end++;
+                }
+                if (end - first > 1) {
+                    output += "duplicates " + to_string(candidates[first]->node->fileSize) + " bytes " + candidates[first]->digest + "\n";
+                    for (size_t i = first; i < end; i++) {
+                        output += "  " + candidates[i]->path + "\n";
                     }
                 }
+                first = end;
+            }
+            out << output;
+        } else if (command[0] == "du") { // du [-s] [path]: file bytes, allocated bytes and entries
+            bool summary = command.size() > 1 && command[1] == "-s";
+            size_t pathIndex = summary ? 2 : 1;
+            FileNode* base = command.size() > pathIndex ? resolvePath(currentDir, pwd, command[pathIndex]) : currentDir;
+            if (base == nullptr) {
+                continue;
             }
-            uint8_t* new83Name = new uint8_t[8];
-            new83Name[0] = 0x7E;
-            string orderStr = to_string(source->order);
-            for (int i = 0; i < orderStr.size(); i++) {
-                new83Name[i + 1] = orderStr[i];
+            string basePath = command.size() > pathIndex ? command[pathIndex] : ".";
+            string output;
+            // Without -s every directory is listed after its subdirectories, like du(1)
+            vector<pair<FileNode*, string>> stack = {{base, basePath}};
+            vector<pair<FileNode*, string>> order;
+            while (!summary && stack.size()) {
+                pair<FileNode*, string> top = stack.back();
+                stack.pop_back();
+                order.push_back(top);
+                for (auto& child : top.first->children) {
+                    if (child->type == _FOLDER) {
+                        stack.push_back({child, top.second + (top.second == "/" ? "" : "/") + child->name});
+                    }
+                }
             }
-            for (int i = orderStr.size() + 1; i < 8; i++) {
-                new83Name[i] = ' ';
+            if (summary) {
+                order.push_back({base, basePath});
             }
-            for (int i = 0; i < 8; i++) {
-                sourceEntries[sourceEntries.size() - 1].msdos.filename[i] = new83Name[i];
+            for (auto it = order.rbegin(); it != order.rend(); it++) {
+                FileNode* node = it->first;
+                output += to_string(node->totalBytes) + "\t" + to_string(node->totalClusters * VOLUME->clusterSize) + "\t"
+                    + to_string(node->totalEntries - 1) + "\t" + it->second + "\n";
             }
-            char* new83Char = new char[11];
-            for (int i = 0; i < 8; i++) {
-                new83Char[i] = new83Name[i];
+            out << output;
+        } else if (command[0] == "df") {
+            unsigned long long usedClusters = VOLUME->totalClusters - VOLUME->freeClusters;
+            out << "Filesystem 1K-blocks Used Available Use%" << endl;
+            out << VOLUME->imagePath << " " << (unsigned long long) VOLUME->totalClusters * VOLUME->clusterSize / 1024 << " " << usedClusters * VOLUME->clusterSize / 1024
+            << " " << (unsigned long long) VOLUME->freeClusters * VOLUME->clusterSize / 1024 << " " << (VOLUME->totalClusters ? (usedClusters * 100 + VOLUME->totalClusters - 1) / VOLUME->totalClusters : 0) << "%" << endl;
+        } else if (command[0] == "recount") {
+            FreeCount count = recountFreeClusters(true);
+            out << "free " << count.freeClusters << " next " << count.nextFree << endl;
+            if (count.corrected) {
+                out << "FSInfo had free " << count.storedFree << " next " << count.storedNextFree << ", corrected" << endl;
+            } else if (!count.validFsInfo) {
+                out << "FSInfo signature invalid, not updated" << endl;
             }
-            for (int i = 0; i < 3; i++) {
-                new83Char[i + 8] = 0x20; 
+        } else if (command[0] == "commit") { // Merges the overlay into the image
+            string error;
+            if (!commitOverlay(error)) {
+                out << "commit: " << error << endl;
             }
-            uint8_t checksum = lfn_checksum(new83Char);
-            for (int i = 0; i < sourceEntries.size() - 1; i++) {
-                sourceEntries[i].lfn.checksum = checksum;
+        } else if (command[0] == "discard") { // Drops the overlay, back to the image as it is
+            if (discardOverlay()) {
+                pwd = "/";
+                currentDir = VOLUME->root;
+                currentCluster = VOLUME->root->firstClusterIndex;
             }
-            delete[] new83Char;
-            // Place FatFileEntries under destination
-            vector<unsigned> addresses = getAvailableAddresses(destinationFolder, numEntries);
-            fp = fopen(imgFile, "r+");
-            for (int i = 0; i < addresses.size(); i++) {
-                fseek(fp, addresses[i], SEEK_SET);
-                fwrite(&(sourceEntries[i]), sizeof(FatFileEntry), 1, fp);
+        } else if (command[0] == "resize" && command.size() > 1) { // resize <bytes>[K|M|G]
+            string error;
+            if (!resizeVolume(parseSize(command[1]), error)) {
+                out << "resize: " << error << endl;
+                continue;
             }
-            fclose(fp);
-            if (destinationFolder->name != "/") {
-                updateTimes(destinationFolder, currDate, currTime);
+            pwd = "/";
+            currentDir = VOLUME->root;
+            currentCluster = VOLUME->root->firstClusterIndex;
+        } else if (command[0] == "sync") {
+            syncVolume();
+        } else if (command[0] == "cachestat") {
+            printCacheStats(out);
+        } else if (command[0] == "heat") { // heat [count] | heat relocate [count]
+            if (VOLUME->heat == nullptr) {
+                out << "heat: not tracked, run with --heat" << endl;
+                continue;
             }
-            // Update destination parent directory FileNode
-            destinationFolder->children.push_back(source);
-
-        } else if (command[0] == "checksumtest") {
-            char testsum[11];
-            testsum[0] = fileTree[0]->children[0]->entry->msdos.filename[0];
-            cout << "00 name = " << fileTree[0]->children[0]->name << endl;
-            printf("00 attributes = 0x%X", fileTree[0]->children[0]->entry->msdos.attributes);
-            printf("testsum0 = 0x%X\n", testsum[0]);
-            testsum[1] = fileTree[0]->children[0]->entry->msdos.filename[1];
-            for (int k = 2; k < 11; k++) {
-                testsum[k] = ' ';
+            bool relocate = command.size() > 1 && command[1] == "relocate";
+            size_t countIndex = relocate ? 2 : 1;
+            unsigned count = countIndex < command.size() ? strtoul(command[countIndex].c_str(), nullptr, 10) : 10;
+            if (relocate) {
+                out << "relocated " << relocateHot(count) << endl;
+            } else {
+                printHeat(out, count);
             }
-            uint8_t cs = lfn_checksum(testsum);
-
-            cout << "checksum of [0][0] is = " << cs << endl;
         } else if (command[0] == "printc") {
             printCluster(stoi(command[1]));
         } else if (command[0] == "printcc") {
@@ -1215,7 +818,218 @@ int main(int argc, char** argv) {
         }
 
     }
+}
+
+/*
+ Fleet mode. One command script is run against many images by a fixed number of worker
+ threads. Every image is opened as its own volume on the worker that picked it, so workers
+ share nothing but the options. Output is collected per image and printed in the order the
+ images were given, each with the time spent mounting it and running the script.
+*/
+class FleetResult {
+public:
+    string output;
+    string error;
+    double mountMs;
+    double scriptMs;
+    FleetResult() : mountMs(0), scriptMs(0) {}
+};
+
+int runFleet(const string& scriptPath, const vector<string>& images, unsigned jobs) {
+    ifstream scriptFile(scriptPath);
+    if (!scriptFile) {
+        cerr << scriptPath << ": " << strerror(errno) << endl;
+        return 1;
+    }
+    stringstream script;
+    script << scriptFile.rdbuf();
+    string commands = script.str();
+    vector<FleetResult> results(images.size());
+    atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < images.size(); i = next++) {
+            FleetResult& result = results[i];
+            auto start = chrono::steady_clock::now();
+            Volume* volume = openVolume(images[i], result.error);
+            auto mounted = chrono::steady_clock::now();
+            result.mountMs = chrono::duration<double, milli>(mounted - start).count();
+            if (volume == nullptr) {
+                continue;
+            }
+            istringstream in(commands);
+            ostringstream out;
+            runShell(in, out, false);
+            closeVolume(volume);
+            result.output = out.str();
+            result.scriptMs = chrono::duration<double, milli>(chrono::steady_clock::now() - mounted).count();
+        }
+    };
+    jobs = max(1u, min(jobs, (unsigned) images.size()));
+    auto begin = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (unsigned i = 0; i < jobs; i++) {
+        workers.emplace_back(worker);
+    }
+    for (auto& thread : workers) {
+        thread.join();
+    }
+    double wallMs = chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count();
+    unsigned failed = 0;
+    char timing[96];
+    for (size_t i = 0; i < images.size(); i++) {
+        if (results[i].error.size()) {
+            failed++;
+            cout << "==> " << images[i] << ": failed <==" << endl << results[i].error << endl;
+            continue;
+        }
+        snprintf(timing, sizeof(timing), "mount %.2f ms, script %.2f ms", results[i].mountMs, results[i].scriptMs);
+        cout << "==> " << images[i] << ": " << timing << " <==" << endl << results[i].output;
+    }
+    snprintf(timing, sizeof(timing), "%.2f ms", wallMs);
+    cerr << images.size() << " images, " << failed << " failed, " << jobs << " jobs, " << timing << endl;
+    return failed ? 1 : 0;
+}
+
+// Moves one archive between the image and standard input or output, so the shell can run as a stage of a pipeline.
+int runTar(bool extract, const string& path) {
+    FileNode* node = resolvePath(VOLUME->root, "/", path);
+    if (node == nullptr || (extract && node->type != _FOLDER)) {
+        cerr << path << ": no such " << (extract ? "directory" : "file or directory") << endl;
+        return 1;
+    }
+    if (!extract) {
+        return writeTar(node, cout) ? 0 : 1;
+    }
+    bool success = readTar(cin, node);
+    // Lets the writer finish its last record
+    vector<char> rest(OUTPUT_BUFFER_BYTES);
+    while (cin.read(rest.data(), rest.size())) {
+    }
+    return success ? 0 : 1;
+}
+
+// Creates a new image and, given a manifest, the directories and empty files it lists.
+int runMakeImage(const string& path, uint64_t bytes, unsigned sectorSize, unsigned clusterSize, const string& skeletonPath) {
+    string error;
+    if (!makeImage(path, bytes, sectorSize, clusterSize, error)) {
+        cerr << "mkimage: " << error << endl;
+        return 1;
+    }
+    if (skeletonPath.empty()) {
+        return 0;
+    }
+    vector<string> paths;
+    if (!readManifest(skeletonPath, "/", paths)) {
+        cerr << "mkimage: " << skeletonPath << ": " << strerror(errno) << endl;
+        return 1;
+    }
+    Volume* volume = openVolume(path, error);
+    if (volume == nullptr) {
+        cerr << error << endl;
+        return 1;
+    }
+    bool success = makeTree(VOLUME->root, paths);
+    closeVolume(volume);
+    return success ? 0 : 1;
+}
 
-    
-    return 0;
+int main(int argc, char** argv) {
+    string fleetScript;
+    string tarPath;
+    string tracePath;
+    bool tarExtract = false;
+    string skeletonPath;
+    uint64_t imageBytes = 0;
+    unsigned sectorSize = 512;
+    unsigned clusterSize = 0;
+    unsigned jobs = max(1u, thread::hardware_concurrency());
+    bool badArgument = false;
+    int argIndex = 1;
+    for (; argIndex < argc && argv[argIndex][0] == '-' && !badArgument; argIndex++) {
+        string option = argv[argIndex];
+        if (option == "--io-uring") {
+            USE_IO_URING = true;
+        } else if (option == "--no-readahead") {
+            USE_READAHEAD = false;
+        } else if (option == "--no-sparse") {
+            SPARSE_IMAGE = false;
+        } else if (option == "--direct") {
+            DIRECT_IO = true;
+        } else if (option == "--journal") {
+            USE_JOURNAL = true;
+        } else if (option == "--alloc" && argIndex + 1 < argc) {
+            string policy = argv[++argIndex];
+            badArgument = policy != "lowest" && policy != "near";
+            ALLOCATION_POLICY = policy == "lowest" ? _LOWEST_FREE : _NEAR_GOAL;
+        } else if (option == "--overlay") {
+            USE_OVERLAY = true;
+        } else if (option == "--recount") {
+            RECOUNT_AT_MOUNT = true;
+        } else if (option == "--stream") {
+            STREAM_MODE = true;
+        } else if (option == "--heat") {
+            TRACK_HEAT = true;
+        } else if (option == "--memory-mb" && argIndex + 1 < argc) { // Half for the block cache, a quarter for file data
+            size_t memoryBytes = strtoul(argv[++argIndex], nullptr, 10) * 1024 * 1024;
+            BLOCK_CACHE_BYTES = memoryBytes / 2;
+            STREAM_BUFFER_BYTES = memoryBytes / 4;
+        } else if (option == "--cache-mb" && argIndex + 1 < argc) {
+            BLOCK_CACHE_BYTES = strtoul(argv[++argIndex], nullptr, 10) * 1024 * 1024;
+        } else if ((option == "--tar-out" || option == "--tar-in") && argIndex + 1 < argc) {
+            tarExtract = option == "--tar-in";
+            tarPath = argv[++argIndex];
+        } else if (option == "--trace" && argIndex + 1 < argc) {
+            tracePath = argv[++argIndex];
+        } else if (option == "--mkimage" && argIndex + 1 < argc) {
+            imageBytes = parseSize(argv[++argIndex]);
+        } else if (option == "--sector-size" && argIndex + 1 < argc) {
+            sectorSize = parseSize(argv[++argIndex]);
+        } else if (option == "--cluster-size" && argIndex + 1 < argc) {
+            clusterSize = parseSize(argv[++argIndex]);
+        } else if (option == "--skeleton" && argIndex + 1 < argc) {
+            skeletonPath = argv[++argIndex];
+        } else if (option == "--fleet" && argIndex + 1 < argc) {
+            fleetScript = argv[++argIndex];
+        } else if (option == "--jobs" && argIndex + 1 < argc) {
+            jobs = max(1ul, strtoul(argv[++argIndex], nullptr, 10));
+        }
+    }
+    if (badArgument || argIndex >= argc) {
+        cerr << "usage: " << argv[0] << " [--io-uring] [--direct] [--no-readahead] [--cache-mb <n>] [--no-sparse] [--journal] [--alloc lowest|near]\n"
+             << "       [--overlay] [--recount] [--stream] [--heat] [--memory-mb <n>] [--trace <file>] <image>" << endl;
+        cerr << "       " << argv[0] << " [options] --fleet <script> [--jobs <n>] <image>..." << endl;
+        cerr << "       " << argv[0] << " [options] --tar-out <path> | --tar-in <path> <image>" << endl;
+        cerr << "       " << argv[0] << " [options] --mkimage <size> [--sector-size <n>] [--cluster-size <n>] [--skeleton <manifest>] <image>" << endl;
+        return 1;
+    }
+    string error;
+    if (tracePath.size() && !openTrace(tracePath, error)) {
+        cerr << error << endl;
+        return 1;
+    }
+    if (fleetScript.size()) {
+        int status = runFleet(fleetScript, vector<string>(argv + argIndex, argv + argc), jobs);
+        closeTrace();
+        return status;
+    }
+    if (imageBytes) {
+        int status = runMakeImage(argv[argIndex], imageBytes, sectorSize, clusterSize, skeletonPath);
+        closeTrace();
+        return status;
+    }
+    Volume* volume = openVolume(argv[argIndex], error);
+    if (volume == nullptr) {
+        cerr << error << endl;
+        closeTrace();
+        return 1;
+    }
+    int status = 0;
+    if (tarPath.size()) {
+        status = runTar(tarExtract, tarPath);
+    } else {
+        runShell(cin, cout, true);
+    }
+    closeVolume(volume);
+    closeTrace();
+    return status;
 }